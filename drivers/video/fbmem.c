@@ -30,6 +30,7 @@
 #include <linux/linux_logo.h>
 #include <linux/proc_fs.h>
 #include <linux/console.h>
+#include <linux/poll.h>
 #ifdef CONFIG_KMOD
 #include <linux/kmod.h>
 #endif
@@ -975,6 +976,9 @@ fb_ioctl(struct inode *inode, struct file *file, unsigned int cmd,
 	case FBIO_UI_CLOSE:
 		return fbui_close (info, arg);
 
+	case FBIO_UI_KICK:
+		return fbui_kick (info, arg);
+
         case FBIO_UI_EXEC: {
                 short win_id=-1;
                 short nwords=0;
@@ -1036,6 +1040,16 @@ fb_mmap(struct file *file, struct vm_area_struct * vma)
 	off = vma->vm_pgoff << PAGE_SHIFT;
 	if (!fb)
 		return -ENODEV;
+#ifdef CONFIG_FB_UI
+	/* FBUI command and event rings live above any framebuffer offset */
+	if (vma->vm_pgoff >= FBUI_RING_PGOFF) {
+		int res;
+		lock_kernel();
+		res = fbui_mmap(info, file, vma);
+		unlock_kernel();
+		return res;
+	}
+#endif
 	if (fb->fb_mmap) {
 		int res;
 		lock_kernel();
@@ -1115,6 +1129,17 @@ fb_mmap(struct file *file, struct vm_area_struct * vma)
 #endif /* !sparc32 */
 }
 
+#ifdef CONFIG_FB_UI
+static unsigned int
+fb_poll(struct file *file, poll_table *wait)
+{
+	int fbidx = iminor(file->f_dentry->d_inode);
+	struct fb_info *info = registered_fb[fbidx];
+
+	return fbui_poll(info, file, wait);
+}
+#endif
+
 static int
 fb_open(struct inode *inode, struct file *file)
 {
@@ -1161,6 +1186,9 @@ static struct file_operations fb_fops = {
 	.write =	fb_write,
 	.ioctl =	fb_ioctl,
 	.mmap =		fb_mmap,
+#ifdef CONFIG_FB_UI
+	.poll =		fb_poll,
+#endif
 	.open =		fb_open,
 	.release =	fb_release,
 #ifdef HAVE_ARCH_FB_UNMAPPED_AREA
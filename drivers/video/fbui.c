@@ -139,6 +139,9 @@
 #include <linux/sem.h>
 #include <linux/delay.h>
 #include <linux/pid.h>	/* find_pid */
+#include <linux/vmalloc.h>
+#include <linux/mm.h>	/* vmalloc_to_page */
+#include <linux/poll.h>
 
 /* Variables for input_handler */
 static char fbui_handler_regd = 0;
@@ -154,14 +157,38 @@ static char intercepting_accel = 0;
 #define FBUI_VERSION "0.9.14"
 
 
+/* Pixels converted per step when reading RGB data from user space */
+#define FBUI_SPANLEN 64
+
+/* Most times per second that the shadow is flushed by its timer */
+#define FBUI_SHADOW_HZ 50
+
+/* Most times per second that a hidden pointer is put back */
+#define FBUI_POINTER_HZ 50
+
+/* Widest plain load and store for the framebuffer */
+#if BITS_PER_LONG == 64
+#define fb_readword(p) fb_readq (p)
+#define fb_writeword(v,p) fb_writeq (v, p)
+#else
+#define fb_readword(p) fb_readl (p)
+#define fb_writeword(v,p) fb_writel (v, p)
+#endif
+
 
 /* Mouse-pointer */
 #define PTRWID 10
 #define PTRHT 16
-static unsigned long pointer_saveunder[256]; /* max 16x16 */
+static unsigned char pointer_saveunder [FBUI_CURSORMAX * FBUI_CURSORMAX * 4];
 
 
 static void fbui_enable_pointer (struct fb_info *info);
+static void fbui_hw_pointer (struct fb_info *info, int enable);
+static void fbui_free_cursors (struct fb_info *info, 
+	struct fbui_processentry *pre);
+static void fbui_pointer_shape (struct fb_info *info, struct fbui_cursor *c);
+static struct fbui_cursor *fbui_window_shape (struct fb_info *info,
+	struct fbui_window *win);
 static int fbui_clear (struct fb_info *info, struct fbui_window *win);
 static int fbui_clear_area (struct fb_info *info, struct fbui_window *win,
 	short x0, short y0, short x1, short y1);
@@ -180,9 +207,13 @@ static int fbui_draw_hline (struct fb_info *info, struct fbui_window *win,
 static int fbui_draw_rect (struct fb_info *info, struct fbui_window *win, 
 	short x0, short y0, short x1, short y1, u32 color);
 static int fbui_put_rgb (struct fb_info *info, struct fbui_window *win, 
-	short x, short y,short n, unsigned long *src);
+	short x, short y, short n, u32 *src, char in_kernel);
 static int fbui_put_rgb3 (struct fb_info *info, struct fbui_window *win, 
 	short x,short y, short n, unsigned char *src);
+static int fbui_put_rgba (struct fb_info *info, struct fbui_window *win, 
+	short x, short y, short n, u32 *src, char in_kernel);
+static int fbui_blend_area (struct fb_info *info, struct fbui_window *win, 
+	short x0, short y0, short x1, short y1, u32 color);
 static int fbui_put (struct fb_info *info, struct fbui_window *win, 
 	short x,short y, short n, unsigned char *src);
 static int fbui_copy_area (struct fb_info *info, struct fbui_window *win,
@@ -191,15 +222,38 @@ static int fbui_copy_area (struct fb_info *info, struct fbui_window *win,
 static int fbui_draw_string (struct fb_info *info, struct fbui_window *win,
 	struct fbui_font *font,
 	short x, short y, unsigned char *str, u32 color);
+static int fbui_load_font (struct fb_info *info, struct fbui_window *win,
+	struct fbui_font *font);
 static int fbui_tinyblit (struct fb_info *info, struct fbui_window *win, 
 	short x, short y, short width, u32 color, u32 bgcolor, u32 bitmap);
+static int fbui_bitblit (struct fb_info *info, struct fbui_window *win,
+	short x, short y, short width, short height, unsigned char *bits,
+	u32 fg, u32 bg);
+static int fbui_put_image (struct fb_info *info, struct fbui_window *win,
+	short x, short y, short w, short h, unsigned char *src,
+	u16 stride, u16 format);
+static void fbui_init_bitmasks (void);
+static int fbui_backing_show (struct fb_info *info, struct fbui_window *win,
+	short x0, short y0, short x1, short y1);
 static struct fbui_processentry *alloc_processentry (struct fb_info *info, int pid, int cons);
 static void free_processentry (struct fb_info *info, struct fbui_processentry *pre);
+static void __free_processentry (struct fb_info *info, struct fbui_processentry *pre);
+static struct fbui_shared *fbui_shared_alloc (unsigned long size);
+static void fbui_shared_put (struct fbui_shared *sh);
 static struct fbui_window *get_pointer_window (struct fb_info *info);
 static struct fbui_window *
    accelerator_test (struct fb_info *info, int cons, unsigned char);
 static int fbui_clean (struct fb_info *info, int cons);
 static int fbui_remove_win (struct fb_info *info, short win_id, int);
+static void fbui_restore (struct fb_info *info, struct fbui_window *win);
+static void fbui_flip_end (struct fb_info *info, struct fbui_window *win);
+static int fbui_ring_drain (struct fb_info *info, struct fbui_window *win);
+static unsigned char *fbui_bounce (struct fbui_window *win, u32 size);
+static void fbui_copy_within (unsigned char *dest, unsigned char *src, u32 n);
+static void __fb_hline (struct fb_info *info, unsigned char *base, u32 linelen,
+	short x0, short x1, short y, u32 color);
+static void __fb_blend_span (struct fb_info *info, unsigned char *ptr,
+	u32 *src, u32 color, int n);
 
 
 
@@ -214,7 +268,6 @@ static int process_exists (int pid)
 }
 
 
-#if 0
 static struct fbui_processentry *lookup_processentry_by_pid (struct fb_info *info,int pid)
 {
 	int i=0;
@@ -232,16 +285,78 @@ static struct fbui_processentry *lookup_processentry_by_pid (struct fb_info *inf
 	}
 	return NULL;
 }
+
+
+/* A process's event queue is a ring with free-running indices.
+ * Producers, including input_handler, take queuelock among
+ * themselves; the process, its only reader, takes no lock at all.
+ * The process may map the ring and read it without an ioctl, so
+ * the kernel keeps head itself and trusts tail only to be a number.
+ */
+#if FBUI_MAXEVENTSPERPROCESS & (FBUI_MAXEVENTSPERPROCESS - 1)
+#error "CONFIG_FB_UI_EVENTQUEUELEN must be a power of 2"
 #endif
+#define FBUI_EVENTSLOT(i) ((i) & (FBUI_MAXEVENTSPERPROCESS - 1))
+#define FBUI_EVENTRING_SIZE (sizeof (struct fbui_eventring) + \
+	FBUI_MAXEVENTSPERPROCESS * sizeof (struct fbui_event))
+
+static inline u32 fbui_events_pending (struct fbui_processentry *pre)
+{
+	struct fbui_eventring *ring = pre->evring;
+
+	return ring ? pre->events_head - ring->tail : 0;
+}
+
+
+/* Folds a motion event into the newest queued event if that is
+ * motion for the same window. When the queue is nearly full,
+ * any queued motion for the window takes the new position
+ * instead, so that the client still sees where the pointer is.
+ * Called with queuelock held.
+ */
+static int fbui_merge_motion (struct fbui_processentry *pre, 
+	struct fbui_event *ev)
+{
+	struct fbui_event *p;
+	u32 i, n, head, tail;
+
+	if (!pre || !ev || !pre->evring)
+		return 0;
+	head = pre->events_head;
+	tail = pre->evring->tail;
+	if (head == tail)
+		return 0;
+	/*----------*/
+
+	for (i = head, n = 0; i != tail && n < FBUI_MAXEVENTSPERPROCESS; n++) {
+		p = &pre->evring->events [FBUI_EVENTSLOT(--i)];
+		if (p->type == FBUI_EVENT_MOTION && p->id == ev->id) {
+			p->x = ev->x;
+			p->y = ev->y;
+			if (p->key < 0x7fff)
+				p->key++;
+
+			/* Unless the reader had still not reached the
+			 * event afterwards, it may have copied it first;
+			 * then the caller queues the motion anew.
+			 */
+			smp_mb ();
+			return (int) (i - pre->evring->tail) > 0;
+		}
+		if (head - tail < FBUI_MAXEVENTSPERPROCESS - FBUI_RESERVEDEVENTS)
+			break;
+	}
+	return 0;
+}
 
 
 static void fbui_enqueue_event (struct fb_info *info, struct fbui_window *win, 
-                           struct fbui_event *ev, int inside_IH)
+                           struct fbui_event *ev)
 {
 	struct fbui_processentry *pre;
-	unsigned long flags = 0;
-	short head;
-	spinlock_t mylock = SPIN_LOCK_UNLOCKED;
+	unsigned long flags;
+	u32 head;
+	u32 limit = FBUI_MAXEVENTSPERPROCESS;
 
 	if (!info || !win || !ev)
 		return;
@@ -254,31 +369,40 @@ static void fbui_enqueue_event (struct fb_info *info, struct fbui_window *win,
 		printk (KERN_INFO "fbui_enqueue_event: processentry not in use\n");
 		return;
 	}
-	if (pre->events_pending >= FBUI_MAXEVENTSPERPROCESS) {
-		/*printk (KERN_INFO "fbui_enqueue_event: event buffer overflow for process %d, event type %d\n", pre->pid, ev->type);*/
-		return;
-	}
 	/*----------*/
 
-	if (!inside_IH) {
-		down (&pre->queuesem);
-		spin_lock_irqsave(&mylock, flags); 
-	}
+	spin_lock_irqsave (&pre->queuelock, flags); 
+	if (!pre->evring)
+		goto done;
 
 	ev->id = win->id;
 	ev->pid = win->pid;
-	head = pre->events_head;
-	memcpy (&pre->events[head], ev, sizeof (struct fbui_event));
-	pre->events_head = (head + 1) % FBUI_MAXEVENTSPERPROCESS;
-	pre->events_pending++;
 
-/*printk(KERN_INFO "enqueue: window %d event %d pending=%d, enqueue at head %d\n", win->id, ev->type, pre->events_pending, head); */
+	/* Motion must leave room for keys and buttons */
+	if (ev->type == FBUI_EVENT_MOTION) {
+		if (fbui_merge_motion (pre, ev))
+			goto done;
+		limit -= FBUI_RESERVEDEVENTS;
+	}
 
-	if (!inside_IH) {
-		spin_unlock_irqrestore(&mylock, flags); 
-		up (&pre->queuesem);
+	head = pre->events_head;
+	if (head - pre->evring->tail >= limit) {
+		/*printk (KERN_INFO "fbui_enqueue_event: event buffer overflow for process %d, event type %d\n", pre->pid, ev->type);*/
+		goto done;
 	}
 
+	/* The event must be complete before the reader can see it */
+	memcpy (&pre->evring->events [FBUI_EVENTSLOT(head)], ev, 
+		sizeof (struct fbui_event));
+	smp_wmb ();
+	pre->events_head = head + 1;
+	pre->evring->head = head + 1;
+
+done:
+	spin_unlock_irqrestore (&pre->queuelock, flags); 
+
+	/* A reader that set waiting after this sees the new head */
+	smp_mb ();
 	if (pre->waiting) {
 		pre->waiting = 0;
 		wake_up_interruptible (&pre->waitqueue);
@@ -286,65 +410,57 @@ static void fbui_enqueue_event (struct fb_info *info, struct fbui_window *win,
 }
 
 
-static int fbui_dequeue_event (struct fb_info *info, struct fbui_processentry *pre,
-                               struct fbui_event *ev)
+/* Removes up to n events from the queue for this process. Only the
+ * process itself reads its queue, so no lock is needed: each event 
+ * is copied out before the tail is moved past it.
+ */
+static int fbui_dequeue_events (struct fb_info *info, 
+	struct fbui_processentry *pre, struct fbui_event *ev, int n)
 {
-	short tail;
-	unsigned long flags;
+	struct fbui_eventring *ring;
+	u32 tail;
+	int count = 0;
 
 	if (!info || !pre || !ev)
 		return 0;
-
-	if (pre->events_pending <= 0) {
-/* printk(KERN_INFO "fbui_dequeue_event: no events pending\n");  */
+	if (!(ring = pre->evring))
+		return 0;
+	if (!fbui_events_pending (pre))
 		return 0;
-	}
 	/*----------*/
 
-	/* Remove an event from the event queue for this process,
-	 * locking out input_handler which writes to the queue,
-	 * and locking out via a semaphore any other process
-	 * either reading or writing the queue.
-	 */
-	down (&pre->queuesem);
-	spin_lock_irqsave(&pre->queuelock, flags); 
-
-	tail = pre->events_tail;
-	memcpy (ev, &pre->events[tail], sizeof (struct fbui_event));
-/* printk(KERN_INFO "dequeue for window %d: pending %d, tail %d\n", ev->id,pre->events_pending, tail); */
-	pre->events_tail = (tail + 1) % FBUI_MAXEVENTSPERPROCESS;
-	--pre->events_pending;
+	tail = ring->tail;
+	while (count < n && tail != pre->events_head) {
+		smp_rmb ();
+		memcpy (ev++, &ring->events [FBUI_EVENTSLOT(tail)], 
+			sizeof (struct fbui_event));
+
+		/* See fbui_merge_motion */
+		smp_mb ();
+		ring->tail = ++tail;
+		smp_mb ();
+		count++;
+	}
 
-	spin_unlock_irqrestore (&pre->queuelock, flags);
-	up (&pre->queuesem);
+	return count;
+}
 
-/* printk (KERN_INFO "dequeue: ev { type %d key %d pid %d id %d } current->pid %d pre { pid %d ix %d}\n",ev->type,ev->key,ev->pid,ev->id,current->pid,pre->pid,pre->index); */
 
-	return 1;
+static int fbui_dequeue_event (struct fb_info *info, struct fbui_processentry *pre,
+                               struct fbui_event *ev)
+{
+	return fbui_dequeue_events (info, pre, ev, 1);
 }
 
 
 u32 pixel_from_rgb (struct fb_info *info, u32 value)
 {
-	u32 r,g,b;
-	if (!info->mode24) {
-		unsigned char tmp = 0xff;
-		b = tmp & value;
-		value >>= 8;
-		g = tmp & value;
-		value >>= 8;
-		r = tmp & value;
-		tmp = 8;
-		r >>= (tmp - info->redsize);
-		g >>= (tmp - info->greensize);
-		b >>= (tmp - info->bluesize);
-		r <<= info->redshift;
-		g <<= info->greenshift;
-		b <<= info->blueshift;
-		return r | g | b;
-	} else {
+	if (!info->mode24)
+		return info->red_lut [0xff & (value >> 16)] |
+			info->green_lut [0xff & (value >> 8)] |
+			info->blue_lut [0xff & value];
+	else
 		return value & 0xffffff;
-	}
 }
 
 u32 pixel_to_rgb (struct fb_info *info, u32 value)
@@ -356,8 +472,8 @@ u32 pixel_to_rgb (struct fb_info *info, u32 value)
 		g = value >> info->greenshift;
 		b = value >> info->blueshift;
 		r &= (1 << info->redsize) - 1;
-		g &= (1 << info->bluesize) - 1;
-		b &= (1 << info->greensize) - 1;
+		g &= (1 << info->greensize) - 1;
+		b &= (1 << info->bluesize) - 1;
 		r <<= (tmp - info->redsize);
 		g <<= (tmp - info->greensize);
 		b <<= (tmp - info->bluesize);
@@ -370,27 +486,296 @@ u32 pixel_to_rgb (struct fb_info *info, u32 value)
 }
 
 
-void fb_point (struct fb_info *info, short x, short y, u32 color, char do_invert)
+/* Span routines: each stores n pixels of RGB, already in kernel
+ * memory, at ptr in the native format. There is one for each depth,
+ * and mode24 displays get ones that need no conversion, so that the
+ * loops test nothing per pixel except transparency.
+ */
+#define NATIVE(v) (info->red_lut [0xff & ((v) >> 16)] | \
+	info->green_lut [0xff & ((v) >> 8)] | info->blue_lut [0xff & (v)])
+#define NATIVE3(s) (info->red_lut [(s)[0]] | \
+	info->green_lut [(s)[1]] | info->blue_lut [(s)[2]])
+#define IDENTITY3(s) (((s)[0] << 16) | ((s)[1] << 8) | (s)[2])
+#define STORE24(v,p) { fb_writeb (v, p); fb_writeb ((v) >> 8, (p)+1); \
+	fb_writeb ((v) >> 16, (p)+2); }
+
+/* RGB source pixels whose top byte is nonzero are transparent */
+#define RGB_SPAN(name, bytes, CONVERT, STORE) \
+static void name (struct fb_info *info, unsigned char *ptr, u32 *src, int n) \
+{ \
+	while (n-- > 0) { \
+		u32 v = *src++; \
+		if (!(v & 0xff000000)) { \
+			v = CONVERT; \
+			STORE; \
+		} \
+		ptr += bytes; \
+	} \
+}
+
+#define RGB3_SPAN(name, bytes, CONVERT, STORE) \
+static void name (struct fb_info *info, unsigned char *ptr, \
+	unsigned char *src, int n) \
+{ \
+	while (n-- > 0) { \
+		u32 v = CONVERT; \
+		STORE; \
+		src += 3; \
+		ptr += bytes; \
+	} \
+}
+
+RGB_SPAN (rgb_span_8, 1, NATIVE(v), fb_writeb (v, ptr))
+RGB_SPAN (rgb_span_16, 2, NATIVE(v), fb_writew (v, ptr))
+RGB_SPAN (rgb_span_24, 3, NATIVE(v), STORE24(v, ptr))
+RGB_SPAN (rgb_span_32, 4, NATIVE(v), fb_writel (v, ptr))
+RGB_SPAN (rgb_span_24_mode24, 3, v, STORE24(v, ptr))
+RGB_SPAN (rgb_span_32_mode24, 4, v, fb_writel (v, ptr))
+
+RGB3_SPAN (rgb3_span_8, 1, NATIVE3(src), fb_writeb (v, ptr))
+RGB3_SPAN (rgb3_span_16, 2, NATIVE3(src), fb_writew (v, ptr))
+RGB3_SPAN (rgb3_span_24, 3, NATIVE3(src), STORE24(v, ptr))
+RGB3_SPAN (rgb3_span_32, 4, NATIVE3(src), fb_writel (v, ptr))
+RGB3_SPAN (rgb3_span_24_mode24, 3, IDENTITY3(src), STORE24(v, ptr))
+RGB3_SPAN (rgb3_span_32_mode24, 4, IDENTITY3(src), fb_writel (v, ptr))
+
+#undef NATIVE
+#undef NATIVE3
+#undef IDENTITY3
+#undef STORE24
+#undef RGB_SPAN
+#undef RGB3_SPAN
+
+
+/* Builds the channel lookup tables for the display's pixel format,
+ * and picks the span routines for its depth.
+ */
+static void fbui_set_pixel_format (struct fb_info *info)
 {
-	short xres, yres;
-	u32 bytes_per_pixel, offset;
-	unsigned char *ptr;
+	int i;
 
-	if (!info)
+	for (i=0; i < 256; i++) {
+		u32 r = i, g = i, b = i;
+
+		if (info->redsize <= 8)
+			r >>= 8 - info->redsize;
+		else
+			r <<= info->redsize - 8;
+		if (info->greensize <= 8)
+			g >>= 8 - info->greensize;
+		else
+			g <<= info->greensize - 8;
+		if (info->bluesize <= 8)
+			b >>= 8 - info->bluesize;
+		else
+			b <<= info->bluesize - 8;
+
+		info->red_lut [i] = r << info->redshift;
+		info->green_lut [i] = g << info->greenshift;
+		info->blue_lut [i] = b << info->blueshift;
+	}
+
+	switch ((info->var.bits_per_pixel + 7) >> 3) {
+	case 1:
+		info->rgb_span = rgb_span_8;
+		info->rgb3_span = rgb3_span_8;
+		break;
+	case 2:
+		info->rgb_span = rgb_span_16;
+		info->rgb3_span = rgb3_span_16;
+		break;
+	case 3:
+		info->rgb_span = info->mode24 ? rgb_span_24_mode24 : rgb_span_24;
+		info->rgb3_span = info->mode24 ? rgb3_span_24_mode24 : rgb3_span_24;
+		break;
+	default:
+		info->rgb_span = info->mode24 ? rgb_span_32_mode24 : rgb_span_32;
+		info->rgb3_span = info->mode24 ? rgb3_span_32_mode24 : rgb3_span_32;
+		break;
+	}
+}
+
+
+/* A window is drawn to if it is on screen, or if it keeps a backing
+ * store, which must stay current while the window is hidden or its
+ * console is in the background.
+ */
+static inline int fbui_onscreen (struct fb_info *info, struct fbui_window *win)
+{
+	return win->console == info->currcon && !win->is_hidden;
+}
+
+
+/* Intersects a window-relative rectangle with the window's
+ * i'th visible rectangle; returns 0 if they don't meet.
+ */
+static inline int fbui_clip (struct fbui_window *win, int i,
+	short *x0, short *y0, short *x1, short *y1)
+{
+	struct fbui_cliprect *r = &win->clip [i];
+
+	if (*x1 < r->x0 || *x0 > r->x1 || *y1 < r->y0 || *y0 > r->y1)
+		return 0;
+	if (*x0 < r->x0)
+		*x0 = r->x0;
+	if (*y0 < r->y0)
+		*y0 = r->y0;
+	if (*x1 > r->x1)
+		*x1 = r->x1;
+	if (*y1 > r->y1)
+		*y1 = r->y1;
+	return 1;
+}
+
+
+/* With a shadow, all drawing goes to a copy of the screen in system
+ * memory and reads never touch video memory. Areas drawn are noted
+ * as dirty, and fbui_shadow_flush copies them to the screen at the
+ * end of each batch of drawing, or from a timer at most
+ * FBUI_SHADOW_HZ times a second for everything else.
+ * Without one, the screen is whichever page is being shown.
+ */
+static inline unsigned char *fbui_screen (struct fb_info *info)
+{
+	if (info->shadow)
+		return info->shadow;
+	return (unsigned char*) info->screen_base + info->front_offset;
+}
+
+
+static void fbui_shadow_damage (struct fb_info *info, 
+	short x0, short y0, short x1, short y1)
+{
+	unsigned long flags;
+	int i;
+
+	if (!info || !info->shadow)
 		return;
-	xres = info->var.xres;
-	yres = info->var.yres;
-	if (x < 0 || y < 0 || x >= xres || y >= yres)
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 >= info->var.xres)
+		x1 = info->var.xres - 1;
+	if (y1 >= info->var.yres)
+		y1 = info->var.yres - 1;
+	if (x0 > x1 || y0 > y1)
 		return;
 	/*----------*/
 
-        bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
-        offset = y * info->fix.line_length + x * bytes_per_pixel;
-        ptr = ((unsigned char*)info->screen_base);
-	if (!ptr)
+	spin_lock_irqsave (&info->shadow_lock, flags);
+
+	/* As for fbui_add_damage: merge with any rect touched,
+	 * then see whether the grown rect touches another.
+	 */
+	i = 0;
+	while (i < info->nshadow_dirty) {
+		struct fbui_damage *r = &info->shadow_dirty[i];
+		if (x1 < r->x0-1 || x0 > r->x1+1 || y1 < r->y0-1 || y0 > r->y1+1) {
+			i++;
+			continue;
+		}
+		if (r->x0 < x0) x0 = r->x0;
+		if (r->y0 < y0) y0 = r->y0;
+		if (r->x1 > x1) x1 = r->x1;
+		if (r->y1 > y1) y1 = r->y1;
+		*r = info->shadow_dirty[--info->nshadow_dirty];
+		i = 0;
+	}
+
+	if (info->nshadow_dirty == FBUI_MAXDAMAGE) {
+		for (i=0; i < info->nshadow_dirty; i++) {
+			struct fbui_damage *r = &info->shadow_dirty[i];
+			if (r->x0 < x0) x0 = r->x0;
+			if (r->y0 < y0) y0 = r->y0;
+			if (r->x1 > x1) x1 = r->x1;
+			if (r->y1 > y1) y1 = r->y1;
+		}
+		info->nshadow_dirty = 0;
+	}
+
+	i = info->nshadow_dirty++;
+	info->shadow_dirty[i].x0 = x0;
+	info->shadow_dirty[i].y0 = y0;
+	info->shadow_dirty[i].x1 = x1;
+	info->shadow_dirty[i].y1 = y1;
+
+	spin_unlock_irqrestore (&info->shadow_lock, flags);
+
+	if (!timer_pending (&info->shadow_timer))
+		mod_timer (&info->shadow_timer, jiffies + HZ / FBUI_SHADOW_HZ + 1);
+}
+
+
+/* Copies one area of the shadow to the screen, whole rows at a time.
+ * The console may have gone back to text since it was drawn.
+ */
+static void fbui_shadow_copy (struct fb_info *info, struct fbui_damage *r)
+{
+	u32 bytes_per_pixel, offset, n;
+	short j;
+
+	if (info->currcon < 0 || info->currcon >= FBUI_MAXCONSOLES ||
+	    vt_cons [info->currcon]->vc_mode != KD_GRAPHICS)
+		return;
+	/*----------*/
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	offset = r->y0 * info->fix.line_length + r->x0 * bytes_per_pixel;
+	n = (r->x1 - r->x0 + 1) * bytes_per_pixel;
+	for (j=r->y0; j <= r->y1; j++) {
+		memcpy_toio (info->screen_base + offset, 
+			info->shadow + offset, n);
+		offset += info->fix.line_length;
+	}
+}
+
+
+/* Copies the dirty areas of the shadow to the screen. The list is
+ * taken under the lock and copied without it; anything drawn
+ * meanwhile is dirtied again and goes out next time.
+ */
+static void fbui_shadow_flush (struct fb_info *info)
+{
+	struct fbui_damage dirty [FBUI_MAXDAMAGE];
+	unsigned long flags;
+	short i, ndirty;
+
+	if (!info || !info->shadow || !info->screen_base)
+		return;
+	if (info->state != FBINFO_STATE_RUNNING)
 		return;
+	/*----------*/
+
+	spin_lock_irqsave (&info->shadow_lock, flags);
+	ndirty = info->nshadow_dirty;
+	memcpy (dirty, info->shadow_dirty, ndirty * sizeof (struct fbui_damage));
+	info->nshadow_dirty = 0;
+	spin_unlock_irqrestore (&info->shadow_lock, flags);
+
+	for (i=0; i < ndirty; i++)
+		fbui_shadow_copy (info, &dirty[i]);
+}
+
+
+static void fbui_shadow_timer (unsigned long param)
+{
+	fbui_shadow_flush ((struct fb_info*) param);
+}
 
-        ptr += offset;
+
+/* The __fb_* routines draw into any packed-pixel surface that is in
+ * the display's pixel format: the framebuffer itself, or a window's
+ * backing store in system RAM. They perform no clipping.
+ */
+static void __fb_point (struct fb_info *info, unsigned char *base, u32 linelen,
+	short x, short y, u32 color, char do_invert)
+{
+	u32 bytes_per_pixel;
+	unsigned char *ptr;
+
+        bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+        ptr = base + y * linelen + x * bytes_per_pixel;
 
 	if (do_invert)
 	{
@@ -424,204 +809,177 @@ void fb_point (struct fb_info *info, short x, short y, u32 color, char do_invert
 }
 
 
-void fb_hline (struct fb_info *info, short x0, short x1, short y, u32 color)
+void fb_point (struct fb_info *info, short x, short y, u32 color, char do_invert)
 {
-	u32 pixel, bytes_per_pixel, offset;
-	unsigned char *ptr;
-	int i;
+	short xres, yres;
 
-	if (!info)
+	if (!info || !info->screen_base)
+		return;
+	xres = info->var.xres;
+	yres = info->var.yres;
+	if (x < 0 || y < 0 || x >= xres || y >= yres)
 		return;
+	/*----------*/
 
-	if (x0 > x1) {
-		short tmp = x0;
-		x0 = x1;
-		x1 = tmp;
-	}
+	__fb_point (info, fbui_screen (info), info->fix.line_length,
+		x, y, color, do_invert);
+	fbui_shadow_damage (info, x, y, x, y);
+}
 
-	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
-	offset = y * info->fix.line_length + x0 * bytes_per_pixel;
-	ptr = ((unsigned char*)info->screen_base);
-	if (!ptr) 
-		return;
-	ptr += offset;
 
-	i= x1-x0+1;
-	pixel = pixel_from_rgb (info, color);
+static inline void __fb_span (unsigned char *ptr, short n, u32 pixel, 
+	u32 bytes_per_pixel)
+{
 	switch (bytes_per_pixel) {
-	case 4: {
-		register unsigned long* ptr2 = (unsigned long*) ptr;
-		register u32 pix = pixel;
-		while (i) {
-			if (i > 8) {
-				/* useful on older processors */
-				fb_writel (pix, ptr2); ptr2++;
-				fb_writel (pix, ptr2); ptr2++;
-				fb_writel (pix, ptr2); ptr2++;
-				fb_writel (pix, ptr2); ptr2++;
-				fb_writel (pix, ptr2); ptr2++;
-				fb_writel (pix, ptr2); ptr2++;
-				fb_writel (pix, ptr2); ptr2++;
-				fb_writel (pix, ptr2); ptr2++;
-				i -= 8;
-			} else {
-				fb_writel (pix, ptr2); ptr2++;
-				i--;
-			}
+	case 4:
+		while (n--) {
+			fb_writel (pixel, ptr);
+			ptr += 4;
 		}
 		break;
-	}
-
-	case 3: {
-		u32 r = 0xff & pixel; 
-		u32 g = 0xff & (pixel >> 8); 
-		u32 b = 0xff & (pixel >> 16);
-		register u32 long1,long2,long3;
-		register unsigned char third = x0 % 3;
-
-		long1 = r | (g<<8) | (b<<16) | (r<<24);
-		long2 = g | (b<<8) | (r<<16) | (g<<24);
-		long3 = b | (r<<8) | (g<<16) | (b<<24);
-		while (i) {
-			if (!third && i>=4) {
-				unsigned long *ptr2 = (unsigned long*) ptr;
-				while (i>=12) {
-					/* useful on older processors */
-					fb_writel (long1, ptr2); ptr2++;
-					fb_writel (long2, ptr2); ptr2++;
-					fb_writel (long3, ptr2); ptr2++;
-					fb_writel (long1, ptr2); ptr2++;
-					fb_writel (long2, ptr2); ptr2++;
-					fb_writel (long3, ptr2); ptr2++;
-					fb_writel (long1, ptr2); ptr2++;
-					fb_writel (long2, ptr2); ptr2++;
-					fb_writel (long3, ptr2); ptr2++;
-					i -= 12;
-					ptr += 36;
-				}
-				while (i>=4) {
-					fb_writel (long1, ptr2); ptr2++;
-					fb_writel (long2, ptr2); ptr2++;
-					fb_writel (long3, ptr2); ptr2++;
-					i -= 4;
-					ptr += 12;
-				}
-			} else {
-				u32 c = pixel;
-				fb_writeb (c, ptr); ptr++; c >>= 8;
-				fb_writeb (c, ptr); ptr++; c >>= 8;
-				fb_writeb (c, ptr); ptr++;
-				i--;
-				third++;
-				if (third==3) third=0;
-			}
+	case 3:
+		while (n--) {
+			fb_writeb (pixel, ptr);
+			fb_writeb (pixel >> 8, ptr+1);
+			fb_writeb (pixel >> 16, ptr+2);
+			ptr += 3;
 		}
 		break;
-	}
-
-	case 2: {
-		u32 c32 = (pixel & 0xffff) | (pixel << 16);
-		while (i) {
-			if (i>=2 && !(3 & (u32)ptr)) {
-				if (i>=16) {
-					u32 *ptr2 = (u32*)ptr;
-					/* useful on older processors */
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					ptr += 32;
-					i -= 16;
-				}
-				if (i>=2) {
-					fb_writel (c32, ptr);
-					ptr += 4;
-					i -= 2;
-				}
-			} else {
-				u32 c = pixel;
-				fb_writeb (c, ptr); ptr++; c >>= 8;
-				fb_writeb (c, ptr); ptr++; 
-				i--;
-			}
+	case 2:
+		while (n--) {
+			fb_writew (pixel, ptr);
+			ptr += 2;
 		}
 		break;
-	}
-
-	case 1: {
-		u32 c32;
-		pixel &= 0xff;
-		c32 = pixel | (pixel<<8) | (pixel<<16) || (pixel<<24);
-		while (i) {
-			if (!(3 & (u32)ptr)) {
-				if (i>=32) {
-					u32 *ptr2 = (u32 *)ptr;
-					/* useful on older processors */
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					fb_writel (c32, ptr2); ptr2++;
-					ptr += 32;
-					i -= 32;
-				}
-				if (i>=4) {
-					fb_writel (c32, ptr);
-					ptr += 4;
-					i -= 4;
-				}
-			} else {
-				fb_writel (pixel, ptr); ptr++;
-				i--;
-			}
+	case 1:
+		while (n--) {
+			fb_writeb (pixel, ptr);
+			ptr++;
 		}
 		break;
 	}
-
-	}/*switch*/
 }
 
 
-void fb_vline (struct fb_info *info, short x, short y0, short y1, u32 color)
+/* Fills a rectangle with a native pixel value. Each row is a head
+ * of single pixels up to a word boundary, a run of whole machine
+ * words holding the pixel pattern, and a tail of single pixels.
+ * At 24 bpp, three 32 bit words make a pattern of four pixels.
+ */
+static void __fb_fill (struct fb_info *info, unsigned char *base, u32 linelen,
+	short x0, short y0, short x1, short y1, u32 pixel)
 {
-	u32 pixel, linelen, bytes_per_pixel, offset;
+	u32 bytes_per_pixel;
 	unsigned char *ptr;
-	short i;
-	short xres,yres;
-
-	if (!info)
-		return;
-	xres = info->var.xres;
-	if (x < 0 || x >= xres)
-		return;
-	if (y0 > y1) {
-		short tmp = y0;
-		y0 = y1;
-		y1 = tmp;
-	}
-	if (y1 < 0)
-		return;
-	yres = info->var.yres;
-	if (y0 >= yres)
-		return;
-	if (y0 < 0)
-		y0 = 0;
-	if (y1 >= yres)
-		y1 = yres-1;
-	/*----------*/
+	unsigned long pattern;
+	int n;
+	short y;
 
-	linelen = info->fix.line_length;
 	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
-	offset = y0 * linelen + x * bytes_per_pixel;
-	ptr = info->screen_base;
-	ptr += offset;
+
+	if (bytes_per_pixel == 3) {
+		u32 r = 0xff & pixel;
+		u32 g = 0xff & (pixel >> 8);
+		u32 b = 0xff & (pixel >> 16);
+		u32 long1 = r | (g<<8) | (b<<16) | (r<<24);
+		u32 long2 = g | (b<<8) | (r<<16) | (g<<24);
+		u32 long3 = b | (r<<8) | (g<<16) | (b<<24);
+
+		for (y=y0; y <= y1; y++) {
+			ptr = base + y * linelen + x0 * 3;
+			n = x1 - x0 + 1;
+
+			while (n && (3 & (unsigned long) ptr)) {
+				__fb_span (ptr, 1, pixel, 3);
+				ptr += 3;
+				n--;
+			}
+			while (n >= 4) {
+				fb_writel (long1, ptr);
+				fb_writel (long2, ptr+4);
+				fb_writel (long3, ptr+8);
+				ptr += 12;
+				n -= 4;
+			}
+			__fb_span (ptr, n, pixel, 3);
+		}
+		return;
+	}
+
+	pattern = pixel;
+	if (bytes_per_pixel == 1)
+		pattern = (pattern & 0xff) * 0x01010101UL;
+	else if (bytes_per_pixel == 2)
+		pattern = (pattern & 0xffff) * 0x00010001UL;
+#if BITS_PER_LONG == 64
+	pattern |= pattern << 32;
+#endif
+
+	for (y=y0; y <= y1; y++) {
+		ptr = base + y * linelen + x0 * bytes_per_pixel;
+		n = x1 - x0 + 1;
+
+		while (n && ((sizeof (long) - 1) & (unsigned long) ptr)) {
+			__fb_span (ptr, 1, pixel, bytes_per_pixel);
+			ptr += bytes_per_pixel;
+			n--;
+		}
+
+		n *= bytes_per_pixel;
+		while (n >= 4 * sizeof (long)) {
+			fb_writeword (pattern, ptr);
+			fb_writeword (pattern, ptr + sizeof (long));
+			fb_writeword (pattern, ptr + 2 * sizeof (long));
+			fb_writeword (pattern, ptr + 3 * sizeof (long));
+			ptr += 4 * sizeof (long);
+			n -= 4 * sizeof (long);
+		}
+		while (n >= sizeof (long)) {
+			fb_writeword (pattern, ptr);
+			ptr += sizeof (long);
+			n -= sizeof (long);
+		}
+
+		__fb_span (ptr, n / bytes_per_pixel, pixel, bytes_per_pixel);
+	}
+}
+
+
+static void __fb_hline (struct fb_info *info, unsigned char *base, u32 linelen,
+	short x0, short x1, short y, u32 color)
+{
+	if (x0 > x1) {
+		short tmp = x0;
+		x0 = x1;
+		x1 = tmp;
+	}
+
+	__fb_fill (info, base, linelen, x0, y, x1, y,
+		pixel_from_rgb (info, color));
+}
+
+
+void fb_hline (struct fb_info *info, short x0, short x1, short y, u32 color)
+{
+	if (!info || !info->screen_base)
+		return;
+	/*----------*/
+
+	__fb_hline (info, fbui_screen (info), info->fix.line_length,
+		x0, x1, y, color);
+	fbui_shadow_damage (info, x0 < x1 ? x0 : x1, y, x0 < x1 ? x1 : x0, y);
+}
+
+
+static void __fb_vline (struct fb_info *info, unsigned char *base, u32 linelen,
+	short x, short y0, short y1, u32 color)
+{
+	u32 pixel, bytes_per_pixel;
+	unsigned char *ptr;
+	short i;
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	ptr = base + y0 * linelen + x * bytes_per_pixel;
 
 	i = y1-y0+1;
 	pixel = pixel_from_rgb (info, color);
@@ -659,28 +1017,306 @@ void fb_vline (struct fb_info *info, short x, short y0, short y1, u32 color)
 		}
 		break;
 	}
+}
+
+
+void fb_vline (struct fb_info *info, short x, short y0, short y1, u32 color)
+{
+	short xres,yres;
+
+	if (!info || !info->screen_base)
+		return;
+	xres = info->var.xres;
+	if (x < 0 || x >= xres)
+		return;
+	if (y0 > y1) {
+		short tmp = y0;
+		y0 = y1;
+		y1 = tmp;
+	}
+	if (y1 < 0)
+		return;
+	yres = info->var.yres;
+	if (y0 >= yres)
+		return;
+	if (y0 < 0)
+		y0 = 0;
+	if (y1 >= yres)
+		y1 = yres-1;
+	/*----------*/
+
+	__fb_vline (info, fbui_screen (info), info->fix.line_length,
+		x, y0, y1, color);
+	fbui_shadow_damage (info, x, y0, x, y1);
+}
+
+
+/* Bresenham line in native pixel format, limited to the box
+ * cx0,cy0 - cx1,cy1. The first and last steps inside the box are 
+ * computed directly, so the loops below do no clipping; shallow 
+ * lines are drawn as horizontal runs. Coordinates must be within 
+ * +/-8191 so that the arithmetic stays within 32 bits.
+ */
+static void __fb_line (struct fb_info *info, unsigned char *base, u32 linelen,
+	short x0, short y0, short x1, short y1, 
+	short cx0, short cy0, short cx1, short cy1, u32 pixel, char do_invert)
+{
+	int dx, dy, D, d, e, ka, kb, ma, mb, m, count;
+	int a0, b0, sb, steep;
+	int stepa, stepb;
+	u32 bytes_per_pixel;
+	unsigned char *ptr;
+
+	dx = x1 > x0 ? x1 - x0 : x0 - x1;
+	dy = y1 > y0 ? y1 - y0 : y0 - y1;
+	steep = dy > dx;
+
+	/* Always step forward along the major axis */
+	if ((!steep && x0 > x1) || (steep && y0 > y1)) {
+		short tmp;
+		tmp = x0; x0 = x1; x1 = tmp;
+		tmp = y0; y0 = y1; y1 = tmp;
+	}
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	if (!steep) {
+		a0 = x0; b0 = y0; D = dx; d = dy;
+		sb = y1 >= y0 ? 1 : -1;
+		ka = cx0 - a0; kb = cx1 - a0;
+		ma = sb > 0 ? cy0 - b0 : b0 - cy1;
+		mb = sb > 0 ? cy1 - b0 : b0 - cy0;
+		stepa = bytes_per_pixel;
+		stepb = sb * (int) linelen;
+	} else {
+		a0 = y0; b0 = x0; D = dy; d = dx;
+		sb = x1 >= x0 ? 1 : -1;
+		ka = cy0 - a0; kb = cy1 - a0;
+		ma = sb > 0 ? cx0 - b0 : b0 - cx1;
+		mb = sb > 0 ? cx1 - b0 : b0 - cx0;
+		stepa = linelen;
+		stepb = sb * (int) bytes_per_pixel;
+	}
+	if (!D)
+		return;
+
+	/* Step k of the line is m_k = (2dk + D) / 2D along the minor axis */
+	if (ka < 0)
+		ka = 0;
+	if (kb > D)
+		kb = D;
+	if (ma < 0)
+		ma = 0;
+	if (mb > d)
+		mb = d;
+	if (ka > kb || ma > mb)
+		return;
+	if (d) {
+		if (ma > 0 && ka < (m = (2*D*ma - D + 2*d - 1) / (2*d)))
+			ka = m;
+		if (kb > (m = (2*D*(mb+1) - D - 1) / (2*d)))
+			kb = m;
+		if (ka > kb)
+			return;
+	}
+
+	m = (2*d*ka + D) / (2*D);
+	e = 2*d - D + 2*d*ka - 2*D*m;
+	count = kb - ka + 1;
+
+	if (!steep)
+		ptr = base + (b0 + sb*m) * linelen + (a0 + ka) * bytes_per_pixel;
+	else
+		ptr = base + (a0 + ka) * linelen + (b0 + sb*m) * bytes_per_pixel;
+
+	if (!steep && !do_invert) {
+		unsigned char *run = ptr;
+		short n = 0;
+
+		while (count--) {
+			n++;
+			ptr += stepa;
+			if (e >= 0) {
+				__fb_span (run, n, pixel, bytes_per_pixel);
+				ptr += stepb;
+				run = ptr;
+				n = 0;
+				e -= 2*D;
+			}
+			e += 2*d;
+		}
+		if (n)
+			__fb_span (run, n, pixel, bytes_per_pixel);
+		return;
+	}
+
+	switch (bytes_per_pixel) {
+	case 4:
+		while (count--) {
+			fb_writel (do_invert ? ~fb_readl (ptr) : pixel, ptr);
+			ptr += stepa;
+			if (e >= 0) {
+				ptr += stepb;
+				e -= 2*D;
+			}
+			e += 2*d;
+		}
+		break;
+
+	case 3:
+		while (count--) {
+			if (do_invert) {
+				fb_writeb (0xff ^ fb_readb (ptr), ptr);
+				fb_writeb (0xff ^ fb_readb (ptr+1), ptr+1);
+				fb_writeb (0xff ^ fb_readb (ptr+2), ptr+2);
+			} else {
+				fb_writeb (pixel, ptr);
+				fb_writeb (pixel >> 8, ptr+1);
+				fb_writeb (pixel >> 16, ptr+2);
+			}
+			ptr += stepa;
+			if (e >= 0) {
+				ptr += stepb;
+				e -= 2*D;
+			}
+			e += 2*d;
+		}
+		break;
+
+	case 2:
+		while (count--) {
+			fb_writew (do_invert ? 0xffff ^ fb_readw (ptr) : pixel, ptr);
+			ptr += stepa;
+			if (e >= 0) {
+				ptr += stepb;
+				e -= 2*D;
+			}
+			e += 2*d;
+		}
+		break;
 
-	return;
+	case 1:
+		while (count--) {
+			fb_writeb (do_invert ? 0xff ^ fb_readb (ptr) : pixel, ptr);
+			ptr += stepa;
+			if (e >= 0) {
+				ptr += stepb;
+				e -= 2*D;
+			}
+			e += 2*d;
+		}
+		break;
+	}
 }
 
 
 void fb_clear (struct fb_info *info, u32 color_)
 {
-	u32 color = color_;
-	short y, ylim, xlim;
+	if (!info || !info->screen_base)
+		return;
+	if (info->state != FBINFO_STATE_RUNNING)
+		return;
+	/*----------*/
 
-	if (!info) 
+	__fb_fill (info, fbui_screen (info), info->fix.line_length,
+		0, 0, info->var.xres - 1, info->var.yres - 1,
+		pixel_from_rgb (info, color_));
+	fbui_shadow_damage (info, 0, 0, info->var.xres - 1, info->var.yres - 1);
+}
+
+
+/* Records a damaged area of a window, in window coordinates.
+ * Overlapping areas are merged; once the list is full
+ * everything collapses into one bounding rectangle.
+ */
+static void fbui_add_damage (struct fbui_window *win, 
+	short x0, short y0, short x1, short y1)
+{
+	int i;
+
+	if (!win)
 		return;
-	if (info->state != FBINFO_STATE_RUNNING) 
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 >= win->width)
+		x1 = win->width - 1;
+	if (y1 >= win->height)
+		y1 = win->height - 1;
+	if (x0 > x1 || y0 > y1)
+		return;
+	/*----------*/
+
+	for (i=0; i < win->ndamage; i++) {
+		struct fbui_damage *r = &win->damage[i];
+		if (x1 < r->x0-1 || x0 > r->x1+1 || y1 < r->y0-1 || y0 > r->y1+1)
+			continue;
+		if (r->x0 < x0) x0 = r->x0;
+		if (r->y0 < y0) y0 = r->y0;
+		if (r->x1 > x1) x1 = r->x1;
+		if (r->y1 > y1) y1 = r->y1;
+
+		/* The grown rect may now touch others, so re-add it */
+		win->damage[i] = win->damage[--win->ndamage];
+		fbui_add_damage (win, x0, y0, x1, y1);
+		return;
+	}
+
+	if (win->ndamage == FBUI_MAXDAMAGE) {
+		for (i=0; i < win->ndamage; i++) {
+			if (win->damage[i].x0 < x0) x0 = win->damage[i].x0;
+			if (win->damage[i].y0 < y0) y0 = win->damage[i].y0;
+			if (win->damage[i].x1 > x1) x1 = win->damage[i].x1;
+			if (win->damage[i].y1 > y1) y1 = win->damage[i].y1;
+		}
+		win->ndamage = 0;
+	}
+
+	win->damage[win->ndamage].x0 = x0;
+	win->damage[win->ndamage].y0 = y0;
+	win->damage[win->ndamage].x1 = x1;
+	win->damage[win->ndamage].y1 = y1;
+	win->ndamage++;
+}
+
+
+/* Sends one Expose per damaged area, unless the window can't 
+ * be drawn to now, in which case the damage is kept for later.
+ */
+static void fbui_send_damage (struct fb_info *info, struct fbui_window *win)
+{
+	struct fbui_event ev;
+	int i;
+
+	if (!info || !win)
+		return;
+	if (!fbui_onscreen (info, win))
 		return;
 	/*----------*/
 
-	y = 0;
-	ylim = info->var.yres;
-	xlim = info->var.xres - 1;
+	memset (&ev, 0, sizeof (struct fbui_event));
+	ev.type = FBUI_EVENT_EXPOSE;
+	for (i=0; i < win->ndamage; i++) {
+		ev.x = win->damage[i].x0;
+		ev.y = win->damage[i].y0;
+		ev.width = win->damage[i].x1 - ev.x + 1;
+		ev.height = win->damage[i].y1 - ev.y + 1;
+		fbui_enqueue_event (info, win, &ev);
+	}
+	win->ndamage = 0;
+}
+
+
+/* Exposes the whole window, superseding any recorded damage */
+static void fbui_expose (struct fb_info *info, struct fbui_window *win)
+{
+	if (!info || !win)
+		return;
+	/*----------*/
 
-	while (y < ylim)
-		fb_hline (info, 0, xlim, y++, color);
+	win->ndamage = 0;
+	fbui_add_damage (win, 0, 0, win->width-1, win->height-1);
+	fbui_send_damage (info, win);
 }
 
 
@@ -701,6 +1337,11 @@ int fbui_switch (struct fb_info *info, int cons)
 		return 0;
 	/*----------*/
 
+	/* The console driver sets its own panning after this */
+	if (info->flip_window)
+		fbui_flip_end (info, info->flip_window);
+
+	fbui_hw_pointer (info, 0);
 	info->pointer_active = 0;
 	intercepting_accel = 0;
 	altdown = 0;
@@ -723,7 +1364,7 @@ int fbui_switch (struct fb_info *info, int cons)
 		info->pointer_window [info->currcon] = NULL;
 		up_write (&info->winptrSem);
 
-		fbui_enqueue_event (info, win, &ev, 0);
+		fbui_enqueue_event (info, win, &ev);
 	}
 
 	info->currcon = cons;
@@ -741,7 +1382,8 @@ int fbui_switch (struct fb_info *info, int cons)
 
 	fb_clear (info, info->bgcolor[cons]);
 
-	/* Firstly perform the clears
+	/* Firstly perform the clears, or repaint
+	 * from the backing store where there is one
 	 */
 	i = cons * FBUI_MAXWINDOWSPERVC;
 	lim = i + FBUI_MAXWINDOWSPERVC;
@@ -750,14 +1392,17 @@ int fbui_switch (struct fb_info *info, int cons)
 		struct fbui_window *ptr = 
 			info->windows [i];
 
-		if (ptr && !ptr->is_wm && !ptr->is_hidden)
+		if (!ptr || ptr->is_hidden)
+			continue;
+		if (ptr->backing_store)
+			fbui_restore (info, ptr);
+		else if (!ptr->is_wm)
 			fbui_clear (info, ptr);
 	}
 	up_read (&info->winptrSem);
 
 	/* Secondly sent the expose events
 	 */
-	memset (&ev, 0, sizeof (struct fbui_event));
 	i = cons * FBUI_MAXWINDOWSPERVC;
 	lim = i + FBUI_MAXWINDOWSPERVC;
 	down_read (&info->winptrSem);
@@ -766,13 +1411,11 @@ int fbui_switch (struct fb_info *info, int cons)
 			info->windows [i];
 
 		if (ptr) {
-			ev.type = FBUI_EVENT_EXPOSE;
-
 			ptr->pointer_inside = 0;
 
-			/* No need to expose if hidden */
-			if (!ptr->is_hidden)
-				fbui_enqueue_event (info, ptr, &ev, 0);
+			/* No need to expose if hidden or restored */
+			if (!ptr->is_hidden && !ptr->backing_store)
+				fbui_expose (info, ptr);
 		}
 	}
 	up_read (&info->winptrSem);
@@ -785,12 +1428,13 @@ int fbui_switch (struct fb_info *info, int cons)
 	 */
 	down_read (&info->winptrSem);
 	win = get_pointer_window (info);
+	fbui_pointer_shape (info, fbui_window_shape (info, win));
 	up_read (&info->winptrSem);
 	if (win) {
 		struct fbui_event ev;
 		memset (&ev, 0, sizeof (struct fbui_event));
 		ev.type = FBUI_EVENT_ENTER;
-		fbui_enqueue_event (info, win, &ev, 0);
+		fbui_enqueue_event (info, win, &ev);
 	}
 
 	return 1;
@@ -804,7 +1448,7 @@ static int pointer_in_window (struct fb_info *info, struct fbui_window *win, cha
 
 	if (!info || !win)
 		return 0;
-	if (!info->pointer_active || info->pointer_hidden)
+	if (!info->pointer_active)
 		return 0;
 	/*----------*/
 	if (win->console != info->currcon)
@@ -813,8 +1457,15 @@ static int pointer_in_window (struct fb_info *info, struct fbui_window *win, cha
 		return 0;
 	mx = info->curr_mouse_x;
 	my = info->curr_mouse_y;
-	mx1 = mx + PTRWID - 1;
-	my1 = my + PTRHT - 1;
+	if (!just_tip && info->pointer_shape) {
+		mx -= info->pointer_shape->hot_x;
+		my -= info->pointer_shape->hot_y;
+		mx1 = mx + info->pointer_shape->width - 1;
+		my1 = my + info->pointer_shape->height - 1;
+	} else {
+		mx1 = mx;
+		my1 = my;
+	}
 	x0 = win->x0;
 	y0 = win->y0;
 	x1 = win->x1;
@@ -832,8 +1483,8 @@ static int pointer_in_window (struct fb_info *info, struct fbui_window *win, cha
 }
 
 
-/* XX -- Currently the mouse pointer is a fixed pattern */
-static unsigned long ptrpixels [] = {
+/* The default pointer; others are loaded with FBUI_LOADCURSOR */
+static u32 ptrpixels [] = {
 #define T___ 0xff000000
 #define BORD RGB_BLACK
 #define X___ RGB_WHITE
@@ -856,109 +1507,388 @@ T___,T___,T___,T___,T___,T___,BORD,BORD,T___,T___
 };
 
 
-static void fbui_pointer_save (struct fb_info *info)
+/* Makes a pointer shape from w*h pixels in the form taken by 
+ * fbui_put_rgba. A native copy is kept so that drawing it needs
+ * no conversion, except for pixels that are partly transparent.
+ */
+static struct fbui_cursor *fbui_cursor_alloc (struct fb_info *info,
+	short w, short h, short hot_x, short hot_y, u32 *src, char in_kernel)
 {
-	short j,x,y;
-	unsigned long *p = pointer_saveunder;
+	struct fbui_cursor *c;
+	u32 bytes_per_pixel;
+	short j;
 
-	if (!info)
-		return;
-	/*----------*/
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	c = kmalloc (sizeof (struct fbui_cursor) + 
+		w * h * (4 + bytes_per_pixel), GFP_KERNEL);
+	if (!c)
+		return NULL;
 
-	x = info->mouse_x0;
-	y = info->mouse_y0;
-	j = PTRHT;
-	while (j--) {
-		if (info->fbops->fb_getpixels_rgb) 
-			info->fbops->fb_getpixels_rgb (info, x, y++, PTRWID, p, 1);
-		p += PTRWID;
+	if (in_kernel)
+		memcpy (c->argb, src, w * h * 4);
+	else if (copy_from_user (c->argb, src, w * h * 4)) {
+		kfree (c);
+		return NULL;
 	}
+
+	c->width = w;
+	c->height = h;
+	c->hot_x = hot_x;
+	c->hot_y = hot_y;
+	c->owner = NULL;
+	c->native = (unsigned char*) (c->argb + w * h);
+
+	/* Transparent pixels are never copied from here */
+	for (j=0; j < h; j++)
+		info->rgb_span (info, c->native + j * w * bytes_per_pixel,
+			c->argb + j * w, w);
+	return c;
 }
 
-static void fbui_pointer_restore (struct fb_info *info)
+
+/* The shape shown over a window: its own choice, else the wm's */
+static struct fbui_cursor *fbui_window_shape (struct fb_info *info,
+	struct fbui_window *win)
 {
-	short j,x,y;
-	unsigned long *p = pointer_saveunder;
+	struct fbui_cursor *c;
 
-	if (!info)
-		return;
-	/*----------*/
+	if (!win)
+		win = info->window_managers [info->currcon];
+	if (win && win->cursor > 0 && win->cursor <= FBUI_MAXCURSORS)
+		if ((c = info->cursors [win->cursor - 1]))
+			return c;
 
-	x = info->mouse_x0;
-	y = info->mouse_y0;
-	j = PTRHT;
-	while (j--) {
-		if (info->fbops->fb_putpixels_rgb) 
-			info->fbops->fb_putpixels_rgb (info, x, y++, PTRWID, p, 1);
-		p += PTRWID;
-	}
+	return info->pointer_default;
 }
 
-static void fbui_pointer_draw (struct fb_info *info)
-{
-	short j, x, y;
-	unsigned long *p = ptrpixels;
-
-	if (!info)
-		return;
-	/*----------*/
 
-	x = info->mouse_x0;
-	y = info->mouse_y0;
-	j = PTRHT;
-	while (j--) {
-		if (info->fbops->fb_putpixels_rgb) 
-			info->fbops->fb_putpixels_rgb (info, x, y++, PTRWID, p, 1);
-		p += PTRWID;
+/* Returns the part of the pointer's image that is on the screen: 
+ * its top left x,y there, its size w,h and its offset sx,sy into
+ * the image. The size is 0 if none of it is.
+ */
+static void fbui_pointer_area (struct fb_info *info, short *x, short *y,
+	short *w, short *h, short *sx, short *sy)
+{
+	struct fbui_cursor *c = info->pointer_shape;
+
+	*x = info->mouse_x0 - c->hot_x;
+	*y = info->mouse_y0 - c->hot_y;
+	*w = c->width;
+	*h = c->height;
+	*sx = 0;
+	*sy = 0;
+	if (*x < 0) {
+		*sx = -*x;
+		*w += *x;
+		*x = 0;
+	}
+	if (*y < 0) {
+		*sy = -*y;
+		*h += *y;
+		*y = 0;
 	}
+	if (*x + *w > (short) info->var.xres)
+		*w = (short) info->var.xres - *x;
+	if (*y + *h > (short) info->var.yres)
+		*h = (short) info->var.yres - *y;
+	if (*w < 0 || *h < 0)
+		*w = *h = 0;
 }
 
-static void fbui_enable_pointer (struct fb_info *info)
+
+/* Shows the pointer with the driver's own cursor, or hides it.
+ * The shape is sent when the cursor is first shown or changes
+ * shape, and only the position after that. If the driver refuses,
+ * the software pointer is used from then on.
+ */
+static void fbui_hw_pointer (struct fb_info *info, int enable)
 {
-	if (!info) 
+	static char image [FBUI_CURSORMAX * FBUI_CURSORMAX / 8];
+	static char mask [FBUI_CURSORMAX * FBUI_CURSORMAX / 8];
+	struct fbui_cursor *c;
+	struct fb_cursor cursor;
+	short i, j, pitch;
+	short x, y;
+
+	if (!info || !info->fbops->fb_cursor)
 		return;
-	if (info->pointer_active)
+	if (!info->have_hardware_pointer)
+		return;
+	if (!(c = info->pointer_shape))
 		return;
 	/*----------*/
 
-	fbui_pointer_save (info);
-	fbui_pointer_draw (info);
+	/* The cursor cannot hang off the top or left of the screen */
+	x = info->mouse_x0 - c->hot_x;
+	y = info->mouse_y0 - c->hot_y;
+
+	memset (&cursor, 0, sizeof (struct fb_cursor));
+	cursor.enable = enable;
+	cursor.image.dx = x < 0 ? 0 : x;
+	cursor.image.dy = y < 0 ? 0 : y;
+	cursor.image.width = c->width;
+	cursor.image.height = c->height;
+	cursor.image.depth = 1;
+	cursor.image.data = image;
+	cursor.mask = mask;
+	cursor.hot.x = c->hot_x;
+	cursor.hot.y = c->hot_y;
+	cursor.rop = ROP_COPY;
+
+	if (!enable) {
+		if (!info->hw_pointer_shown)
+			return;
+		cursor.set = FB_CUR_SETCUR;
+		info->fbops->fb_cursor (info, &cursor);
+		info->hw_pointer_shown = 0;
 
-	info->pointer_active = 1;
-	info->pointer_hidden = 0;
+		/* fbcon must set up its own cursor afresh */
+		info->cursor.image.width = 0;
+		info->cursor.image.height = 0;
+		return;
+	}
+
+	if (info->hw_pointer_shown && info->hw_pointer_shape == c)
+		cursor.set = FB_CUR_SETPOS;
+	else {
+		/* Leftmost pixel in the top bit, rows padded to bytes;
+		 * the console colors 15 and 0 are white and black.
+		 * Pixels more than half transparent are left out.
+		 */
+		pitch = (c->width + 7) >> 3;
+		memset (image, 0, pitch * c->height);
+		memset (mask, 0, pitch * c->height);
+		for (j=0; j < c->height; j++) {
+			for (i=0; i < c->width; i++) {
+				u32 v = c->argb [j * c->width + i];
+				char bit = 0x80 >> (i & 7);
+				if (v >= 0x80000000)
+					continue;
+				mask [j*pitch + (i >> 3)] |= bit;
+				if (((v >> 16) & 0xff) + 2 * ((v >> 8) & 0xff) +
+				    (v & 0xff) >= 512)
+					image [j*pitch + (i >> 3)] |= bit;
+			}
+		}
+		cursor.set = FB_CUR_SETALL;
+		cursor.image.fg_color = 15;
+		cursor.image.bg_color = 0;
+	}
+
+	if (info->fbops->fb_cursor (info, &cursor))
+		info->have_hardware_pointer = 0;
+	else {
+		info->hw_pointer_shown = 1;
+		info->hw_pointer_shape = c;
+	}
 }
 
-#if 0
-static void fbui_disable_pointer (struct fb_info *info)
+
+/* The software pointer saves what it covers in the native format,
+ * a row at a time, so that moving it costs a few block copies.
+ */
+static void fbui_pointer_save (struct fb_info *info)
 {
-	if (!info) 
+	u32 bytes_per_pixel;
+	unsigned char *src, *dest = pointer_saveunder;
+	short j, x, y, w, h, sx, sy;
+
+	if (!info || !info->screen_base || !info->pointer_shape)
 		return;
-	if (!info->pointer_active)
+	if (info->have_hardware_pointer)
 		return;
 	/*----------*/
 
-	// fbui_pointer_restore (info, win);
-	info->pointer_active = 0;
-	info->pointer_hidden = 0;
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	fbui_pointer_area (info, &x, &y, &w, &h, &sx, &sy);
+	src = fbui_screen (info) + y * info->fix.line_length
+		+ x * bytes_per_pixel;
+
+	for (j=0; j < h; j++) {
+		memcpy_fromio (dest, src, w * bytes_per_pixel);
+		src += info->fix.line_length;
+		dest += w * bytes_per_pixel;
+	}
 }
-#endif
 
-static void fbui_hide_pointer (struct fb_info *info)
+static void fbui_pointer_restore (struct fb_info *info)
 {
-	if (!info) 
-		return;
-	if (!info->pointer_active)
+	u32 bytes_per_pixel;
+	unsigned char *src = pointer_saveunder, *dest;
+	short j, x, y, w, h, sx, sy;
+
+	if (!info || !info->screen_base || !info->pointer_shape)
 		return;
-	if (info->pointer_hidden)
+	if (info->have_hardware_pointer)
 		return;
 	/*----------*/
 
-	if (!info->have_hardware_pointer) {
-		fbui_pointer_restore (info);
-	}
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	fbui_pointer_area (info, &x, &y, &w, &h, &sx, &sy);
+	if (!w || !h)
+		return;
+	dest = fbui_screen (info) + y * info->fix.line_length
+		+ x * bytes_per_pixel;
+
+	for (j=0; j < h; j++) {
+		memcpy_toio (dest, src, w * bytes_per_pixel);
+		dest += info->fix.line_length;
+		src += w * bytes_per_pixel;
+	}
+	fbui_shadow_damage (info, x, y, x + w - 1, y + h - 1);
+}
+
+/* Opaque runs of the shape are copied from its native form;
+ * only partly transparent pixels are blended.
+ */
+static void fbui_pointer_draw (struct fb_info *info)
+{
+	struct fbui_cursor *c;
+	u32 bytes_per_pixel;
+	unsigned char *dest, *native;
+	u32 *argb;
+	short i, j, k, x, y, w, h, sx, sy;
+
+	if (!info || !(c = info->pointer_shape))
+		return;
+	if (info->have_hardware_pointer) {
+		fbui_hw_pointer (info, 1);
+		if (info->have_hardware_pointer)
+			return;
+		fbui_pointer_save (info);
+	}
+	if (!info->screen_base)
+		return;
+	/*----------*/
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	fbui_pointer_area (info, &x, &y, &w, &h, &sx, &sy);
+	if (!w || !h)
+		return;
+	dest = fbui_screen (info) + y * info->fix.line_length
+		+ x * bytes_per_pixel;
+
+	for (j=0; j < h; j++) {
+		argb = c->argb + (sy + j) * c->width + sx;
+		native = c->native + 
+			((sy + j) * c->width + sx) * bytes_per_pixel;
+
+		for (i=0; i < w; i = k) {
+			u32 a = argb [i] >> 24;
+			for (k=i+1; k < w && (argb [k] >> 24) == a; k++)
+				;
+			if (!a)
+				memcpy_toio (dest + i * bytes_per_pixel,
+					native + i * bytes_per_pixel,
+					(k - i) * bytes_per_pixel);
+			else if (a != 255)
+				__fb_blend_span (info, dest + i * bytes_per_pixel,
+					argb + i, 0, k - i);
+		}
+		dest += info->fix.line_length;
+	}
+	fbui_shadow_damage (info, x, y, x + w - 1, y + h - 1);
+}
+
+
+/* Copies only the pointer's area of the shadow to the screen. This
+ * is all the input handler and the pointer timer do, since a full
+ * flush can be a whole screen; the shadow timer does the rest.
+ */
+static void fbui_shadow_flush_pointer (struct fb_info *info)
+{
+	struct fbui_damage r;
+	short x, y, w, h, sx, sy;
+
+	if (!info || !info->shadow || !info->screen_base)
+		return;
+	if (info->state != FBINFO_STATE_RUNNING)
+		return;
+	if (!info->pointer_shape || info->have_hardware_pointer)
+		return;
+	/*----------*/
+
+	fbui_pointer_area (info, &x, &y, &w, &h, &sx, &sy);
+	if (!w || !h)
+		return;
+	r.x0 = x;
+	r.y0 = y;
+	r.x1 = x + w - 1;
+	r.y1 = y + h - 1;
+	fbui_shadow_copy (info, &r);
+}
+
+
+/* Changes the pointer's shape, redrawing it if it is showing */
+static void fbui_pointer_shape (struct fb_info *info, struct fbui_cursor *c)
+{
+	char showing;
+
+	if (!info || !c)
+		return;
+	if (c == info->pointer_shape)
+		return;
+	/*----------*/
+
+	showing = info->pointer_active && !info->pointer_hidden;
+	if (showing)
+		fbui_pointer_restore (info);
+	info->pointer_shape = c;
+	if (showing) {
+		fbui_pointer_save (info);
+		fbui_pointer_draw (info);
+	}
+}
+
+static void fbui_enable_pointer (struct fb_info *info)
+{
+	if (!info) 
+		return;
+	if (info->pointer_active)
+		return;
+	/*----------*/
+
+	fbui_pointer_save (info);
+	fbui_pointer_draw (info);
+
+	info->pointer_active = 1;
+	info->pointer_hidden = 0;
+}
+
+#if 0
+static void fbui_disable_pointer (struct fb_info *info)
+{
+	if (!info) 
+		return;
+	if (!info->pointer_active)
+		return;
+	/*----------*/
+
+	// fbui_pointer_restore (info, win);
+	info->pointer_active = 0;
+	info->pointer_hidden = 0;
+}
+#endif
+
+static void fbui_hide_pointer (struct fb_info *info)
+{
+	if (!info) 
+		return;
+	if (!info->pointer_active)
+		return;
+	if (info->pointer_hidden)
+		return;
+	/*----------*/
+
+	if (!info->have_hardware_pointer) {
+		fbui_pointer_restore (info);
+	}
 	info->pointer_hidden = 1;
 }
 
+/* Drawing only takes the pointer down; it is put back by a timer,
+ * so a client that flushes often does not redraw it each time.
+ */
 static void fbui_unhide_pointer (struct fb_info *info)
 {
 	if (!info) 
@@ -969,17 +1899,216 @@ static void fbui_unhide_pointer (struct fb_info *info)
 		return;
 	/*----------*/
 
-	if (!info->have_hardware_pointer) {
+	if (!timer_pending (&info->pointer_timer))
+		mod_timer (&info->pointer_timer, 
+			jiffies + HZ / FBUI_POINTER_HZ + 1);
+}
+
+/* Puts the pointer back once no window on the console is drawing;
+ * otherwise tries again at the same rate. The check and the drawing
+ * are one step under pointer_lock, which a window takes to start
+ * drawing, so that it either finds the pointer showing and hides
+ * it, or keeps it hidden until it is done.
+ */
+static void fbui_pointer_timer (unsigned long param)
+{
+	struct fb_info *info = (struct fb_info*) param;
+	unsigned long flags;
+	char busy = 0;
+	int i, lim;
+
+	if (!info->pointer_active || !info->pointer_hidden)
+		return;
+	/*----------*/
+
+	if (!down_read_trylock (&info->winptrSem)) {
+		mod_timer (&info->pointer_timer, 
+			jiffies + HZ / FBUI_POINTER_HZ + 1);
+		return;
+	}
+
+	spin_lock_irqsave (&info->pointer_lock, flags);
+	i = info->currcon * FBUI_MAXWINDOWSPERVC;
+	lim = i + FBUI_MAXWINDOWSPERVC;
+	for (; i < lim && !busy; i++)
+		if (info->windows [i] && info->windows [i]->drawing)
+			busy = 1;
+
+	if (!busy && info->pointer_hidden) {
+		info->pointer_hidden = 0;
 		fbui_pointer_save (info);
 		fbui_pointer_draw (info);
 	}
-	info->pointer_hidden = 0;
+	spin_unlock_irqrestore (&info->pointer_lock, flags);
+	up_read (&info->winptrSem);
+
+	if (busy)
+		mod_timer (&info->pointer_timer, 
+			jiffies + HZ / FBUI_POINTER_HZ + 1);
+	else
+		fbui_shadow_flush_pointer (info);
+}
+
+/* Marks a window as drawing; see fbui_pointer_timer. pointer_overlaps
+ * is only asked after this, so it sees any pointer the timer showed.
+ */
+static void fbui_drawing_begin (struct fb_info *info, struct fbui_window *win)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave (&info->pointer_lock, flags);
+	win->drawing = 1;
+	spin_unlock_irqrestore (&info->pointer_lock, flags);
+}
+
+
+/* Screen coordinates */
+static int pointer_overlaps (struct fb_info *info, 
+	short x0, short y0, short x1, short y1)
+{
+	short mx, my;
+
+	if (!info || !info->pointer_shape)
+		return 0;
+	if (info->have_hardware_pointer)
+		return 0;
+	if (!info->pointer_active || info->pointer_hidden)
+		return 0;
+	/*----------*/
+
+	mx = info->mouse_x0 - info->pointer_shape->hot_x;
+	my = info->mouse_y0 - info->pointer_shape->hot_y;
+	if (x1 < mx || x0 > mx + info->pointer_shape->width - 1)
+		return 0;
+	if (y1 < my || y0 > my + info->pointer_shape->height - 1)
+		return 0;
+	return 1;
+}
+
+
+/* Copies a window-relative rectangle of the backing store 
+ * to the screen, if the window is currently visible.
+ */
+static int __fbui_backing_show (struct fb_info *info, struct fbui_window *win,
+	short x0, short y0, short x1, short y1)
+{
+	u32 bytes_per_pixel, n;
+	unsigned char *src, *dest;
+	int i;
+
+	if (!info || !win)
+		return FBUI_ERR_NULLPTR;
+	if (!win->backing_store || !info->screen_base)
+		return FBUI_SUCCESS;
+	if (info->state != FBINFO_STATE_RUNNING) 
+		return FBUI_ERR_NOTRUNNING;
+	if (!fbui_onscreen (info, win))
+		return FBUI_SUCCESS;
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 >= win->width)
+		x1 = win->width - 1;
+	if (y1 >= win->height)
+		y1 = win->height - 1;
+	if (x0 > x1 || y0 > y1)
+		return FBUI_SUCCESS;
+	/*----------*/
+
+	if (pointer_overlaps (info, win->x0 + x0, win->y0 + y0, 
+	    win->x0 + x1, win->y0 + y1))
+		fbui_hide_pointer (info);
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+
+	for (i=0; i < win->nclip; i++) {
+		short a=x0, b=x1, c=y0, d=y1;
+		if (!fbui_clip (win, i, &a, &c, &b, &d))
+			continue;
+
+		n = (b - a + 1) * bytes_per_pixel;
+		src = win->backing_store + c * win->backing_linelen 
+			+ a * bytes_per_pixel;
+		dest = fbui_screen (info) + (win->y0 + c) * info->fix.line_length 
+			+ (win->x0 + a) * bytes_per_pixel;
+		fbui_shadow_damage (info, win->x0 + a, win->y0 + c,
+			win->x0 + b, win->y0 + d);
+
+		while (c++ <= d) {
+			memcpy_toio (dest, src, n);
+			src += win->backing_linelen;
+			dest += info->fix.line_length;
+		}
+	}
+
+	return FBUI_SUCCESS;
+}
+
+
+/* A double-buffered window's drawing is shown only on present */
+static int fbui_backing_show (struct fb_info *info, struct fbui_window *win,
+	short x0, short y0, short x1, short y1)
+{
+	if (win && win->flipping)
+		return FBUI_SUCCESS;
+
+	return __fbui_backing_show (info, win, x0, y0, x1, y1);
+}
+
+
+/* Repaints a window entirely from its backing store */
+static void fbui_restore (struct fb_info *info, struct fbui_window *win)
+{
+	if (!info || !win || !win->backing_store)
+		return;
+	if (win == info->flip_window)
+		return;
+	/*----------*/
+
+	__fbui_backing_show (info, win, 0, 0, win->width-1, win->height-1);
+	fbui_unhide_pointer (info);
+}
+
+
+/* (Re)allocates the backing store to the window's current size.
+ * If memory is short the window just falls back to Expose events.
+ */
+static void fbui_alloc_backing (struct fb_info *info, struct fbui_window *win)
+{
+	u32 bytes_per_pixel;
+	short j;
+
+	if (!info || !win)
+		return;
+	if (!win->want_backing)
+		return;
+	/*----------*/
+
+	if (win->backing_store) {
+		vfree (win->backing_store);
+		win->backing_store = NULL;
+	}
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	win->backing_linelen = (win->width * bytes_per_pixel + 3) & ~3;
+	win->backing_store = vmalloc (win->backing_linelen * win->height);
+	if (!win->backing_store) {
+		printk (KERN_INFO "fbui: no memory for backing store of window %d\n", 
+			win->id);
+		return;
+	}
+
+	for (j=0; j < win->height; j++)
+		__fb_hline (info, win->backing_store, win->backing_linelen,
+			0, win->width-1, j, win->bgcolor);
 }
 
 
+/* Returns the topmost window under the pointer's tip */
 static struct fbui_window *get_pointer_window (struct fb_info *info)
 {
-	struct fbui_window *win=NULL;
+	struct fbui_window *win, *top=NULL;
 	int i,lim;
 	int cons;
 
@@ -992,14 +2121,13 @@ static struct fbui_window *get_pointer_window (struct fb_info *info)
 	lim = i + FBUI_MAXWINDOWSPERVC;
 	while (i < lim) {
 		win = info->windows [i];
-		if (win && !win->is_wm && pointer_in_window (info,win,1))
-			break;
+		if (win && !win->is_wm && pointer_in_window (info,win,1) &&
+		    (!top || win->z > top->z))
+			top = win;
 
 		i++;
 	}
-	if (i >= lim)
-		return NULL;
-	return win;
+	return top;
 }
 
 
@@ -1132,7 +2260,7 @@ void input_handler (u32 param, struct input_event *ev)
 					memset (&ev, 0, sizeof (struct fbui_event));
 					ev.type = FBUI_EVENT_ACCEL;
 					ev.key = ia;
-					fbui_enqueue_event (info, match, &ev, 1);
+					fbui_enqueue_event (info, match, &ev);
 				}
 
 				intercepting_accel = 1;
@@ -1173,7 +2301,7 @@ void input_handler (u32 param, struct input_event *ev)
 							break;
 						}
 						ev.key |= tmp;
-						fbui_enqueue_event (info, win, &ev, 1);
+						fbui_enqueue_event (info, win, &ev);
 					}
 				}
 				else
@@ -1187,7 +2315,7 @@ void input_handler (u32 param, struct input_event *ev)
 
 						ev.type = FBUI_EVENT_KEY;
 						ev.key = (code << 2) | (value & 3);
-						fbui_enqueue_event (info, recipient, &ev, 1);
+						fbui_enqueue_event (info, recipient, &ev);
 					} 
 #if 0
 					else
@@ -1240,7 +2368,7 @@ void input_handler (u32 param, struct input_event *ev)
 		if (got_rel_x && got_rel_y) {
 			int cons = info->currcon;
 
-			if (!info->pointer_active || info->pointer_hidden)
+			if (!info->pointer_active)
 				return;
 
 			/* Even if the new coords cannot affect the
@@ -1275,7 +2403,7 @@ void input_handler (u32 param, struct input_event *ev)
 					struct fbui_event ev;
 					memset (&ev, 0, sizeof (struct fbui_event));
 					ev.type = FBUI_EVENT_LEAVE;
-					fbui_enqueue_event (info, oldwin, &ev, 1);
+					fbui_enqueue_event (info, oldwin, &ev);
 
 					oldwin->pointer_inside = 0;
 					info->pointer_window [cons] = NULL;
@@ -1287,21 +2415,31 @@ void input_handler (u32 param, struct input_event *ev)
 					struct fbui_event ev;
 					memset (&ev, 0, sizeof (struct fbui_event));
 					ev.type = FBUI_EVENT_ENTER;
-					fbui_enqueue_event (info, win, &ev, 1);
+					fbui_enqueue_event (info, win, &ev);
 
 					win->pointer_inside = 1;
 					info->pointer_window [cons] = win;
 				}
 
-				/* If possible draw the pointer */
-				if (!win || !drawing) {
+				/* If possible draw the pointer, in the
+				 * shape chosen by the window under it.
+				 * While drawing has it hidden, it just
+				 * moves; the pointer timer shows it. */
+				if (info->pointer_hidden) {
+					info->mouse_x0 = incoming_x;
+					info->mouse_y0 = incoming_y;
+					info->pointer_shape = 
+						fbui_window_shape (info, win);
+				} else if (!win || !drawing) {
 					fbui_pointer_restore (info);
+					fbui_shadow_flush_pointer (info);
 					info->mouse_x0 = incoming_x;
 					info->mouse_y0 = incoming_y;
-					info->mouse_x1 = info->mouse_x0 + PTRWID - 1;
-					info->mouse_y1 = info->mouse_y0 + PTRHT - 1;
+					info->pointer_shape = 
+						fbui_window_shape (info, win);
 					fbui_pointer_save (info);
 					fbui_pointer_draw (info);
+					fbui_shadow_flush_pointer (info);
 				}
 
 				/* generate Motion for appropriate window */
@@ -1313,7 +2451,7 @@ void input_handler (u32 param, struct input_event *ev)
 					ev.type = FBUI_EVENT_MOTION;
 					ev.x = info->mouse_x0 - win->x0;
 					ev.y = info->mouse_y0 - win->y0;
-					fbui_enqueue_event (info, win, &ev, 1);
+					fbui_enqueue_event (info, win, &ev);
 				}
 
 				/* generate Motion for the window that has pointer focus*/
@@ -1324,7 +2462,7 @@ void input_handler (u32 param, struct input_event *ev)
 					ev.type = FBUI_EVENT_MOTION;
 					ev.x = info->mouse_x0 - pf->x0;
 					ev.y = info->mouse_y0 - pf->y0;
-					fbui_enqueue_event (info, pf, &ev, 1);
+					fbui_enqueue_event (info, pf, &ev);
 				}
 
 				wm = info->window_managers [cons];
@@ -1334,7 +2472,7 @@ void input_handler (u32 param, struct input_event *ev)
 					ev.type = FBUI_EVENT_MOTION;
 					ev.x = info->mouse_x0;
 					ev.y = info->mouse_y0;
-					fbui_enqueue_event (info, wm, &ev, 1);
+					fbui_enqueue_event (info, wm, &ev);
 				}
 				up_read (&info->winptrSem);
 			} 
@@ -1383,11 +2521,18 @@ int fbui_init (struct fb_info *info)
 	info->mouse_y0 = info->var.yres >> 1;
 	info->curr_mouse_x = info->mouse_x0;
 	info->curr_mouse_y = info->mouse_y0;
-	info->mouse_x1 = info->mouse_x0 + PTRWID - 1;
-	info->mouse_y1 = info->mouse_y0 + PTRHT - 1;
 	info->pointer_active = 0;
 
-	info->have_hardware_pointer = 0;
+	/* A driver with a cursor of its own (soft_cursor only draws
+	 * into the framebuffer, as our pointer does) shows the pointer.
+	 */
+	info->have_hardware_pointer = info->fbops->fb_cursor != NULL;
+#ifdef CONFIG_FB_SOFT_CURSOR
+	if (info->fbops->fb_cursor == soft_cursor)
+		info->have_hardware_pointer = 0;
+#endif
+	info->hw_pointer_shown = 0;
+	info->hw_pointer_shape = NULL;
 
 	init_rwsem (&info->cutpaste_sem);
 	info->cutpaste_buffer = NULL;
@@ -1403,6 +2548,42 @@ int fbui_init (struct fb_info *info)
 	    info->bluesize == 8 && info->redshift == 16 &&
 	    info->greenshift == 8 && !info->blueshift);
 
+	fbui_set_pixel_format (info);
+	fbui_init_bitmasks ();
+
+	/* Pointer shapes are kept in the native format */
+	for (i=0; i < FBUI_MAXCURSORS; i++)
+		info->cursors [i] = NULL;
+	info->pointer_default = fbui_cursor_alloc (info, PTRWID, PTRHT, 
+		0, 0, ptrpixels, 1);
+	info->pointer_shape = info->pointer_default;
+
+	info->shadow = NULL;
+	info->nshadow_dirty = 0;
+	spin_lock_init (&info->shadow_lock);
+	init_timer (&info->shadow_timer);
+	info->shadow_timer.function = fbui_shadow_timer;
+	info->shadow_timer.data = (unsigned long) info;
+	init_timer (&info->pointer_timer);
+	info->pointer_timer.function = fbui_pointer_timer;
+	info->pointer_timer.data = (unsigned long) info;
+	spin_lock_init (&info->pointer_lock);
+	info->flip_window = NULL;
+	info->front_offset = 0;
+	info->back_offset = 0;
+#ifdef CONFIG_FB_UI_SHADOW
+	/* Only the generic drawing routines know about the shadow */
+	if (info->fbops->fb_hline == fb_hline && info->screen_base &&
+	    info->var.bits_per_pixel >= 8) {
+		u32 size = info->fix.line_length * info->var.yres;
+		info->shadow = vmalloc (size);
+		if (info->shadow)
+			memcpy_fromio (info->shadow, info->screen_base, size);
+		else
+			printk (KERN_INFO "fbui: no memory for shadow framebuffer\n");
+	}
+#endif
+
 	intercepting_accel = 0;
 	altdown = 0;
 
@@ -1438,69 +2619,209 @@ static inline struct fbui_window *fbui_lookup_win (struct fb_info *info, int win
 
 
 
-static int fbui_overlap_check (struct fb_info *info, 
-                               short x0, short y0, short x1, short y1,
-                               int cons, struct fbui_window *self)
+/* Removes a window-relative rectangle from a clip list,
+ * returning the new list. Each rectangle that meets it is
+ * replaced by up to four pieces: above, below, left and right.
+ */
+static struct fbui_cliprect *fbui_clip_subtract (struct fbui_cliprect *list,
+	short *np, short x0, short y0, short x1, short y1)
 {
-	struct fbui_window *ptr;
-	struct rw_semaphore *sem;
-	int i,lim;
+	struct fbui_cliprect *nu, *r;
+	short i, n = *np, m = 0;
 
-	if (!info) 
-		return -1;
-	if (cons < 0 || cons >= FBUI_MAXCONSOLES)
-		return -1;
+	if (!list || !n)
+		return list;
 	/*----------*/
 
-	sem = &info->winptrSem;
-	down_read (sem);
-	i = cons * FBUI_MAXWINDOWSPERVC;
-	lim = i + FBUI_MAXWINDOWSPERVC;
-	while (i < lim) {
-		ptr = info->windows [i];
-	
-		if (ptr && !ptr->is_hidden && ptr->console == cons && !ptr->is_wm
-		    && ptr != self)
-		{
-			short x2, y2, x3, y3;
-
-			x2 = ptr->x0;
-			x3 = ptr->x1;
-			y2 = ptr->y0;
-			y3 = ptr->y1;
-
-			if ((x2 >= x0 && x2 <= x1) ||
-			    (x3 >= x0 && x3 <= x1)) {
-				if ((y2 >= y0 && y2 <= y1) ||
-				    (y3 >= y0 && y3 <= y1)) {
-					up_read (sem);
-					return 1;
-				}
-			}
+	nu = kmalloc (4 * n * sizeof (struct fbui_cliprect), GFP_KERNEL);
+	if (!nu) {
+		printk (KERN_INFO "fbui: no memory for clip list\n");
+		return list;
+	}
+
+	for (i=0; i < n; i++) {
+		short ya, yb;
+
+		r = &list [i];
+		if (x1 < r->x0 || x0 > r->x1 || y1 < r->y0 || y0 > r->y1) {
+			nu [m++] = *r;
+			continue;
+		}
+
+		ya = y0 > r->y0 ? y0 : r->y0;
+		yb = y1 < r->y1 ? y1 : r->y1;
+		if (r->y0 < y0) {
+			nu [m] = *r;
+			nu [m++].y1 = y0 - 1;
+		}
+		if (r->y1 > y1) {
+			nu [m] = *r;
+			nu [m++].y0 = y1 + 1;
+		}
+		if (r->x0 < x0) {
+			nu [m].x0 = r->x0;
+			nu [m].x1 = x0 - 1;
+			nu [m].y0 = ya;
+			nu [m++].y1 = yb;
+		}
+		if (r->x1 > x1) {
+			nu [m].x0 = x1 + 1;
+			nu [m].x1 = r->x1;
+			nu [m].y0 = ya;
+			nu [m++].y1 = yb;
 		}
-		i++;
 	}
-	up_read (sem);
 
-	return 0;
+	kfree (list);
+	*np = m;
+	return nu;
 }
 
 
-static void restore_vc (struct fb_info *info, int cons)
+/* Recomputes the visible region of every window on a console.
+ * A window is covered by each visible window above it; the wm
+ * is covered by all of them. This runs only on geometry and
+ * stacking changes, so drawing never has to consider other
+ * windows. The caller must not hold any window semaphore.
+ */
+static void fbui_update_clips (struct fb_info *info, int cons)
 {
+	struct fbui_window *wins [FBUI_MAXWINDOWSPERVC];
+	int i, j, n, lim;
+
+	if (!info)
+		return;
 	if (cons < 0 || cons >= FBUI_MAXCONSOLES)
 		return;
 	/*----------*/
 
-	if (cons != info->currcon) {
-		vc_cons[cons].d->vc_tty = info->ttysave[cons];
-		vt_cons[cons]->vc_mode = KD_TEXT;
-	} else {
-		acquire_console_sem();
-		vc_cons[cons].d->vc_tty = info->ttysave[cons];
-		vt_cons[cons]->vc_mode = KD_TEXT;
-		do_unblank_screen(1);
-		redraw_screen (cons,0);
+	n = 0;
+	i = cons * FBUI_MAXWINDOWSPERVC;
+	lim = i + FBUI_MAXWINDOWSPERVC;
+	down_read (&info->winptrSem);
+	for ( ; i < lim; i++) {
+		if (info->windows [i])
+			wins [n++] = info->windows [i];
+	}
+	up_read (&info->winptrSem);
+
+	for (i=0; i < n; i++) {
+		struct fbui_window *win = wins [i];
+		struct fbui_cliprect *list = NULL, *old;
+		struct semaphore *sem;
+		short count = 0;
+
+		if (!win->is_hidden && 
+		    (list = kmalloc (sizeof (struct fbui_cliprect), GFP_KERNEL))) {
+			list->x0 = 0;
+			list->y0 = 0;
+			list->x1 = win->width - 1;
+			list->y1 = win->height - 1;
+			count = 1;
+		}
+
+		for (j=0; j < n && count; j++) {
+			struct fbui_window *above = wins [j];
+
+			if (above == win || above->is_hidden || above->is_wm)
+				continue;
+			if (!win->is_wm && above->z <= win->z)
+				continue;
+
+			list = fbui_clip_subtract (list, &count,
+				above->x0 - win->x0, above->y0 - win->y0,
+				above->x1 - win->x0, above->y1 - win->y0);
+		}
+
+		sem = &info->windowSems [win->id];
+		down (sem);
+		old = win->clip;
+		win->clip = list;
+		win->nclip = count;
+		up (sem);
+
+		if (old)
+			kfree (old);
+	}
+}
+
+
+/* Puts a window at the top of its console's stacking order */
+static void fbui_raise_z (struct fb_info *info, struct fbui_window *win)
+{
+	if (!info || !win)
+		return;
+	/*----------*/
+
+	down_write (&info->winptrSem);
+	win->z = ++info->ztop [win->console];
+	up_write (&info->winptrSem);
+}
+
+
+/* Reports a screen area that has been uncovered to each window
+ * now visible there, other than the given one. Windows with a
+ * backing store are simply repainted.
+ */
+static void fbui_damage_screen (struct fb_info *info, int cons,
+	struct fbui_window *except, short x0, short y0, short x1, short y1)
+{
+	struct fbui_window *wins [FBUI_MAXWINDOWSPERVC];
+	int i, n, lim;
+
+	if (!info)
+		return;
+	if (cons < 0 || cons >= FBUI_MAXCONSOLES)
+		return;
+	/*----------*/
+
+	n = 0;
+	i = cons * FBUI_MAXWINDOWSPERVC;
+	lim = i + FBUI_MAXWINDOWSPERVC;
+	down_read (&info->winptrSem);
+	for ( ; i < lim; i++) {
+		struct fbui_window *win = info->windows [i];
+		if (win && win != except && !win->is_hidden &&
+		    x1 >= win->x0 && x0 <= win->x1 && 
+		    y1 >= win->y0 && y0 <= win->y1)
+			wins [n++] = win;
+	}
+	up_read (&info->winptrSem);
+
+	for (i=0; i < n; i++) {
+		struct fbui_window *win = wins [i];
+
+		if (win->backing_store) {
+			struct semaphore *sem = &info->windowSems [win->id];
+			down (sem);
+			fbui_backing_show (info, win, x0 - win->x0, y0 - win->y0,
+				x1 - win->x0, y1 - win->y0);
+			fbui_unhide_pointer (info);
+			up (sem);
+		} else {
+			fbui_add_damage (win, x0 - win->x0, y0 - win->y0, 
+				x1 - win->x0, y1 - win->y0);
+			fbui_send_damage (info, win);
+		}
+	}
+}
+
+
+static void restore_vc (struct fb_info *info, int cons)
+{
+	if (cons < 0 || cons >= FBUI_MAXCONSOLES)
+		return;
+	/*----------*/
+
+	if (cons != info->currcon) {
+		vc_cons[cons].d->vc_tty = info->ttysave[cons];
+		vt_cons[cons]->vc_mode = KD_TEXT;
+	} else {
+		acquire_console_sem();
+		vc_cons[cons].d->vc_tty = info->ttysave[cons];
+		vt_cons[cons]->vc_mode = KD_TEXT;
+		do_unblank_screen(1);
+		redraw_screen (cons,0);
 		release_console_sem();
 	}
 }
@@ -1523,7 +2844,7 @@ static void fbui_winptrs_change (struct fb_info *info, int cons)
 		struct fbui_event ev;
 		memset (&ev, 0, sizeof (struct fbui_event));
 		ev.type = FBUI_EVENT_WINCHANGE;
-		fbui_enqueue_event (info, ptr, &ev, 0);
+		fbui_enqueue_event (info, ptr, &ev);
 	}
 }
 
@@ -1625,17 +2946,39 @@ static int fbui_remove_win (struct fb_info *info, short win_id, int force)
 		else
 			pre->nwindows--;
 
-		if (pre->nwindows <= 0)
+		if (pre->nwindows <= 0) {
+			fbui_free_cursors (info, pre);
 			free_processentry (info,pre);
+		}
 		else
 			printk(KERN_INFO "fbui_remove_win: processentry %d has #wins=%d\n",pre->index,
 				pre->nwindows);
 	}
 
+	if (win == info->flip_window)
+		fbui_flip_end (info, win);
+	if (win->backing_store) {
+		vfree (win->backing_store);
+		win->backing_store = NULL;
+	}
+	if (win->fontcache)
+		vfree (win->fontcache);
+	if (win->bounce)
+		kfree (win->bounce);
+	fbui_shared_put (win->ringmem);
+
 	/* Clear window to display's bgcolor */
 	win->bgcolor = info->bgcolor[cons];
-	if (!win->is_wm)
+	if (!win->is_wm) {
 		fbui_clear (info, win);
+		if (!win->is_hidden) {
+			fbui_update_clips (info, cons);
+			fbui_damage_screen (info, cons, NULL, win->x0, win->y0, 
+				win->x1, win->y1);
+		}
+	}
+	if (win->clip)
+		kfree (win->clip);
 	kfree(win);
 
 	/* console empty? if so, restore textmode
@@ -1747,12 +3090,13 @@ static inline struct fbui_window *
 
 	nu->is_hidden = hidden;
 	nu->need_placement = autoplacement;
+	fbui_raise_z (info, nu);
 
 	if (!autoplacement && !hidden) {
 		struct fbui_event ev;
 		memset (&ev, 0, sizeof (struct fbui_event));
 		ev.type = FBUI_EVENT_EXPOSE;
-		fbui_enqueue_event (info, nu, &ev, 0);
+		fbui_enqueue_event (info, nu, &ev);
 	}
 
 	fbui_winptrs_change (info,cons);
@@ -1816,6 +3160,8 @@ int fbui_open (struct fb_info *info, struct fbui_openparams *p)
 		return FBUI_ERR_BADPARAM;
 	if (p->initially_hidden & 0xfe)
 		return FBUI_ERR_BADPARAM;
+	if (p->backing_store & 0xfe)
+		return FBUI_ERR_BADPARAM;
 	if (p->program_type < 0 || p->program_type >= FBUI_PROGTYPE_LAST)
 		return FBUI_ERR_BADPARAM;
 	tmp1 = p->x0;
@@ -1888,12 +3234,6 @@ int fbui_open (struct fb_info *info, struct fbui_openparams *p)
 			auto_placed = 0;
 		if (wm && !wm->doing_autopos)
 			auto_placed = 0;
-
-		if (!auto_placed && !initially_hidden) {
-			if (fbui_overlap_check (info, p->x0, p->y0, p->x1, p->y1, 
-						cons, NULL))
-				return FBUI_ERR_OVERLAP;
-		}
 	} 
 
 	win = fbui_add_win (info, cons, auto_placed, 
@@ -1929,6 +3269,10 @@ int fbui_open (struct fb_info *info, struct fbui_openparams *p)
 		intercepting_accel = 0;
 	}
 
+	/* Needed before the geometry is set, for the backing store */
+	win->bgcolor = p->bgcolor;
+	win->want_backing = p->backing_store;
+
 	if (!auto_placed && !initially_hidden && !p->req_control)
 		fbui_set_geometry (info, win, p->x0,p->y0,p->x1,p->y1);
 	else {
@@ -1939,9 +3283,13 @@ int fbui_open (struct fb_info *info, struct fbui_openparams *p)
 		win->y1 = p->y1;
 		win->width = p->x1 - p->x0 + 1;
 		win->height = p->y1 - p->y0 + 1;
+
+		/* An auto-placed window is sized later by the wm */
+		if (!auto_placed)
+			fbui_alloc_backing (info, win);
 	}
 
-	win->bgcolor = p->bgcolor;
+	fbui_update_clips (info, win->console);
 
 	if (!win->is_wm && !auto_placed && !initially_hidden)
 		fbui_clear (info, win);
@@ -1983,19 +3331,22 @@ int fbui_close (struct fb_info *info, short id)
 int fbui_redraw (struct fb_info *info, struct fbui_window *self, 
 		 struct fbui_window *win)
 {
-	struct fbui_event ev;
-
 	if (!info || !self || !win) 
 		return 0;
 	if (!self->is_wm)
 		return FBUI_ERR_NOTWM;
 	/*----------*/
 
-	fbui_clear (info, win);
+	if (win->backing_store) {
+		struct semaphore *sem = &info->windowSems [win->id];
+		down (sem);
+		fbui_restore (info, win);
+		up (sem);
+		return FBUI_SUCCESS;
+	}
 
-	memset (&ev, 0, sizeof (struct fbui_event));
-	ev.type = FBUI_EVENT_EXPOSE;
-	fbui_enqueue_event (info, win, &ev, 0);
+	fbui_clear (info, win);
+	fbui_expose (info, win);
 
 	return FBUI_SUCCESS;
 }
@@ -2030,10 +3381,8 @@ static int fbui_clean (struct fb_info *info, int cons)
 		if (pre->in_use) {
 			if (!process_exists (pre->pid)) {
 				printk (KERN_INFO "fbui_clean: removing zombie process entry %d\n", i);
-				pre->in_use = 0;
-				pre->waiting = 0;
-				pre->pid = 0;
-				pre->nwindows = 0;
+				fbui_free_cursors (info, pre);
+				__free_processentry (info, pre);
 			}
 		}
 		i++;
@@ -2213,7 +3562,9 @@ int fbui_move_resize (struct fb_info *info, struct fbui_window *self,
 {
 	char result=FBUI_SUCCESS;
 	short x1, y1;
+	short oldx0, oldy0, oldw, oldh;
 	struct semaphore *sem;
+	struct fbui_event ev;
 
 	if (!info || !self || !win)
 		return 0;
@@ -2226,41 +3577,44 @@ int fbui_move_resize (struct fb_info *info, struct fbui_window *self,
 
 	sem = &info->windowSems [win->id];
 	down (sem);
+	oldx0 = win->x0;
+	oldy0 = win->y0;
+	oldw = win->width;
+	oldh = win->height;
+	result = fbui_set_geometry (info, win, x, y, x1, y1);
+	up (sem);
 
-	/* If the window is not hidden, verify no overlap.
- 	 * If hidden, we don't care.
-	 */
-	if (!win->is_hidden)
-		result = fbui_overlap_check (info, x, y, x1, y1, self->console, win);
-
-	if (!result) {
-		result = fbui_set_geometry (info, win, x, y, x1, y1);
-
-		if (!result) {
-			struct fbui_event ev;
+	if (result) {
+		printk (KERN_INFO "set geometry failed -- %s\n",win->name);
+		return result;
+	}
 
-			fbui_clear (info, win);
+	fbui_update_clips (info, self->console);
 
-			memset (&ev, 0, sizeof (struct fbui_event));
-			ev.type = FBUI_EVENT_MOVE_RESIZE;
-			ev.x = x;
-			ev.y = y;
-			ev.width = x1-x+1;
-			ev.height = y1-y+1;
-			fbui_enqueue_event (info, win, &ev, 0);
-
-			/*ev.type = FBUI_EVENT_EXPOSE;
-			fbui_enqueue_event (info, win, &ev, 0);
-			*/
-
-			win->need_placement = 0;
-		}
-		else
-			printk (KERN_INFO "set geometry failed -- %s\n",win->name);
-	} else
-		printk (KERN_INFO "overlap check failed -- %s\n",win->name);
+	down (sem);
+	/* A pure move keeps the backing store's contents */
+	if (win->backing_store && 
+	    oldw == win->width && oldh == win->height)
+		fbui_restore (info, win);
+	else
+		fbui_clear (info, win);
 	up (sem);
-	return result;
+
+	memset (&ev, 0, sizeof (struct fbui_event));
+	ev.type = FBUI_EVENT_MOVE_RESIZE;
+	ev.x = x;
+	ev.y = y;
+	ev.width = x1-x+1;
+	ev.height = y1-y+1;
+	fbui_enqueue_event (info, win, &ev);
+
+	/* The area vacated by a visible, placed window */
+	if (!win->is_hidden && !win->need_placement)
+		fbui_damage_screen (info, self->console, win, oldx0, oldy0,
+			oldx0 + oldw - 1, oldy0 + oldh - 1);
+
+	win->need_placement = 0;
+	return FBUI_SUCCESS;
 }
 
 
@@ -2297,16 +3651,23 @@ int fbui_hide (struct fb_info *info, struct fbui_window *self,
 			 * let it decide whether to perform a window clear.
 			 */
 			u32 c = win->bgcolor;
+			unsigned char *bs = win->backing_store;
 			win->bgcolor = info->bgcolor [cons];
+			win->backing_store = NULL; /* clear screen, not backing */
 			fbui_clear (info, win); /* clear to display bgcolor */
+			win->backing_store = bs;
 			win->bgcolor = c;
 		}
 		win->is_hidden = 1;
 		up (sem);
 
+		fbui_update_clips (info, cons);
+		fbui_damage_screen (info, cons, NULL, win->x0, win->y0, 
+			win->x1, win->y1);
+
 		memset (&ev, 0, sizeof (struct fbui_event));
 		ev.type = FBUI_EVENT_HIDE;
-		fbui_enqueue_event (info, win, &ev, 0);
+		fbui_enqueue_event (info, win, &ev);
 
 		down_read (&info->winptrSem);
 		win2 = info->pointer_window [info->currcon];
@@ -2315,7 +3676,7 @@ int fbui_hide (struct fb_info *info, struct fbui_window *self,
 		if (win2 == win) {
 			memset (&ev, 0, sizeof (struct fbui_event));
 			ev.type = FBUI_EVENT_LEAVE;
-			fbui_enqueue_event (info, win, &ev, 0);
+			fbui_enqueue_event (info, win, &ev);
 		}
 	}
 
@@ -2345,23 +3706,28 @@ int fbui_unhide (struct fb_info *info, struct fbui_window *self,
 		return FBUI_SUCCESS;
 	/*----------*/
 
-	/* Rule: Don't allow unhide if the window will overlap.
-	 */
-	if (fbui_overlap_check (info, win->x0, win->y0, win->x1, win->y1, 
-				cons, win))
-		return FBUI_ERR_OVERLAP;
+	/* An unhidden window comes up on top */
+	fbui_raise_z (info, win);
 
 	sem = &info->windowSems [win->id];
 	down (sem);
 	win->is_hidden = 0;
-	fbui_clear (info, win);
+	up (sem);
+
+	fbui_update_clips (info, cons);
+
+	down (sem);
+	if (win->backing_store)
+		fbui_restore (info, win);
+	else
+		fbui_clear (info, win);
 	up (sem);
 
 	memset (&ev, 0, sizeof (struct fbui_event));
 	ev.type = FBUI_EVENT_UNHIDE;
-	fbui_enqueue_event (info, win, &ev, 0);
-	ev.type = FBUI_EVENT_EXPOSE;
-	fbui_enqueue_event (info, win, &ev, 0);
+	fbui_enqueue_event (info, win, &ev);
+	if (!win->backing_store)
+		fbui_expose (info, win);
 	
 	down_read (&info->winptrSem);
 	win2 = get_pointer_window (info);
@@ -2369,13 +3735,158 @@ int fbui_unhide (struct fb_info *info, struct fbui_window *self,
 	if (win2 == win) {
 		memset (&ev, 0, sizeof (struct fbui_event));
 		ev.type = FBUI_EVENT_ENTER;
-		fbui_enqueue_event (info, win, &ev, 0);
+		fbui_enqueue_event (info, win, &ev);
+	}
+
+	return FBUI_SUCCESS;
+}
+
+
+/* Brings a window to the top of the stacking order;
+ * whatever it had covered is repainted.
+ */
+int fbui_raise (struct fb_info *info, struct fbui_window *self, 
+                struct fbui_window *win)
+{
+	struct semaphore *sem;
+	int cons;
+
+	if (!info || !self || !win)
+		return FBUI_ERR_NULLPTR;
+	if (!self->is_wm)
+		return FBUI_ERR_NOTWM;
+	if (self == win)
+		return FBUI_ERR_BADPARAM;
+	cons = self->console;
+	if (cons != win->console)
+		return FBUI_ERR_BADPARAM;
+	if (win->z == info->ztop [cons])
+		return FBUI_SUCCESS;
+	/*----------*/
+
+	fbui_raise_z (info, win);
+	if (win->is_hidden)
+		return FBUI_SUCCESS;
+
+	fbui_update_clips (info, cons);
+
+	if (win->backing_store) {
+		sem = &info->windowSems [win->id];
+		down (sem);
+		fbui_restore (info, win);
+		up (sem);
+	} else
+		fbui_expose (info, win);
+
+	return FBUI_SUCCESS;
+}
+
+
+/* Loads a pointer shape for a window's process to use, 
+ * and returns its handle.
+ */
+static int fbui_load_cursor (struct fb_info *info, struct fbui_window *win,
+	short w, short h, short hot_x, short hot_y, u32 *src)
+{
+	struct fbui_cursor *c;
+	int i;
+
+	if (!info || !win || !src)
+		return FBUI_ERR_NULLPTR;
+	if (w <= 0 || h <= 0 || w > FBUI_CURSORMAX || h > FBUI_CURSORMAX)
+		return FBUI_ERR_BADPARAM;
+	if (hot_x < 0 || hot_y < 0 || hot_x >= w || hot_y >= h)
+		return FBUI_ERR_BADPARAM;
+	if (!access_ok (VERIFY_READ, src, w * h * 4))
+		return FBUI_ERR_BADADDR;
+	/*----------*/
+
+	if (!(c = fbui_cursor_alloc (info, w, h, hot_x, hot_y, src, 0)))
+		return FBUI_ERR_NOMEM;
+	c->owner = win->processentry;
+
+	down_write (&info->winptrSem);
+	for (i=0; i < FBUI_MAXCURSORS; i++) {
+		if (!info->cursors [i]) {
+			info->cursors [i] = c;
+			break;
+		}
+	}
+	up_write (&info->winptrSem);
+
+	if (i == FBUI_MAXCURSORS) {
+		kfree (c);
+		return FBUI_ERR_NOMEM;
+	}
+	return i + 1;
+}
+
+
+/* Chooses the pointer shape for a window; 0 means the default.
+ * The pointer takes it at once if it is over the window.
+ */
+static int fbui_set_cursor (struct fb_info *info, struct fbui_window *win,
+	short handle)
+{
+	struct fbui_window *ptrwin;
+	struct fbui_cursor *c;
+
+	if (!info || !win)
+		return FBUI_ERR_NULLPTR;
+	if (handle < 0 || handle > FBUI_MAXCURSORS)
+		return FBUI_ERR_BADPARAM;
+	/*----------*/
+
+	down_write (&info->winptrSem);
+	if (handle) {
+		c = info->cursors [handle - 1];
+		if (!c || c->owner != win->processentry) {
+			up_write (&info->winptrSem);
+			return FBUI_ERR_BADPARAM;
+		}
+	}
+	win->cursor = handle;
+
+	if (win->console == info->currcon) {
+		ptrwin = get_pointer_window (info);
+		if (!ptrwin || !ptrwin->drawing)
+			fbui_pointer_shape (info, fbui_window_shape (info, ptrwin));
 	}
+	up_write (&info->winptrSem);
 
+	fbui_shadow_flush (info);
 	return FBUI_SUCCESS;
 }
 
 
+/* Frees the shapes a process loaded, once its last window is gone */
+static void fbui_free_cursors (struct fb_info *info, 
+	struct fbui_processentry *pre)
+{
+	struct fbui_cursor *c;
+	int i;
+
+	if (!info || !pre)
+		return;
+	/*----------*/
+
+	down_write (&info->winptrSem);
+	for (i=0; i < FBUI_MAXCURSORS; i++) {
+		c = info->cursors [i];
+		if (!c || c->owner != pre)
+			continue;
+
+		info->cursors [i] = NULL;
+		if (info->pointer_shape == c)
+			fbui_pointer_shape (info, info->pointer_default);
+		if (info->hw_pointer_shape == c)
+			info->hw_pointer_shape = NULL;
+		kfree (c);
+	}
+	up_write (&info->winptrSem);
+}
+
+
 static struct fbui_processentry *alloc_processentry (struct fb_info *info, 
 						     int pid, int cons)
 {
@@ -2393,18 +3904,23 @@ static struct fbui_processentry *alloc_processentry (struct fb_info *info,
 	while (i < FBUI_MAXCONSOLES * FBUI_MAXWINDOWSPERVC) {
 		pre = &info->processentries[i];
 		if (!pre->in_use) {
+			/* A new ring, since the last owner may still 
+			 * have the old one mapped */
+			pre->evmem = fbui_shared_alloc (FBUI_EVENTRING_SIZE);
+			if (!pre->evmem)
+				break;
+			pre->evring = pre->evmem->addr;
+			pre->evring->size = FBUI_MAXEVENTSPERPROCESS;
+
 			pre->index = i;
 			pre->waiting = 0;
 			pre->pid = pid;
 			pre->console = cons;
 			pre->nwindows = 0;
 			pre->events_head = 0;
-			pre->events_tail = 0;
-			pre->events_pending = 0;
 			init_waitqueue_head(&pre->waitqueue);
 			pre->window_num = -1;
 			pre->queuelock = SPIN_LOCK_UNLOCKED;
-			init_MUTEX (&pre->queuesem);
 			pre->in_use = 1;
 			up (sem);
 			return pre;
@@ -2415,57 +3931,317 @@ static struct fbui_processentry *alloc_processentry (struct fb_info *info,
 	return NULL;
 }
 
-static void free_processentry (struct fb_info *info, struct fbui_processentry *pre)
+/* The caller holds preSem */
+static void __free_processentry (struct fb_info *info, 
+	struct fbui_processentry *pre)
 {
-	struct semaphore *sem;
+	struct fbui_shared *sh;
+	unsigned long flags;
+
 	if (!pre)
 		return;
 	/*----------*/
 
-	sem = &info->preSem;
-	down (sem);
 	pre->in_use = 0;
 	pre->waiting = 0;
 	pre->pid = 0;
 	pre->nwindows = 0;
+
+	/* Producers check for the ring under the lock. It is freed
+	 * once the process has unmapped it too. */
+	spin_lock_irqsave (&pre->queuelock, flags);
+	sh = pre->evmem;
+	pre->evmem = NULL;
+	pre->evring = NULL;
 	pre->events_head = 0;
-	pre->events_tail = 0;
-	pre->events_pending = 0;
-	up (sem);
+	spin_unlock_irqrestore (&pre->queuelock, flags);
+
+	fbui_shared_put (sh);
+
+	/* Any poller must find out that its windows are gone */
+	wake_up_interruptible (&pre->waitqueue);
 }
 
+static void free_processentry (struct fb_info *info, struct fbui_processentry *pre)
+{
+	if (!info || !pre)
+		return;
+	/*----------*/
 
+	down (&info->preSem);
+	__free_processentry (info, pre);
+	up (&info->preSem);
+}
 
 
-int fbui_control (struct fb_info *info, struct fbui_ctrlparams *ctl)
+/* Makes the fb device usable with poll/select: it is readable
+ * when an event is queued for any window of the calling process.
+ * A process with no windows is an ordinary fbdev client and gets
+ * what the device gave before it had a poll method.
+ */
+unsigned int fbui_poll (struct fb_info *info, struct file *file, 
+	poll_table *wait)
 {
-	struct fbui_window *self=NULL;
-	struct fbui_window *win=NULL;
-	struct fbui_processentry *pre=NULL;
-	int cons = -1;
-	char cmd;
-	short id;
-	short x, y;
-	short width, height;
-	struct fbui_event *event;
-	unsigned char *pointer;
-	u32 cutlen;
+	struct fbui_processentry *pre;
 
-	if (!info || !ctl)
-		return FBUI_ERR_NULLPTR;
+	if (!info)
+		return POLLERR;
 	/*----------*/
 
-	cmd = ctl->op;
-	x = ctl->x;
-	y = ctl->y;
-	width = ctl->width;
-	height = ctl->height;
-	id = ctl->id;
-	event = ctl->event;
-	pointer = ctl->pointer;
-	cutlen = ctl->cutpaste_length;
+	down (&info->preSem);
+	pre = lookup_processentry_by_pid (info, current->pid);
+	up (&info->preSem);
+	if (!pre)
+		return DEFAULT_POLLMASK;
 
-	if (id < 0)
+	poll_wait (file, &pre->waitqueue, wait);
+
+	/* fbui_enqueue_event only wakes the queue if waiting is set */
+	pre->waiting = 1;
+	mb();
+
+	if (!pre->in_use || pre->pid != current->pid)
+		return POLLERR;
+	if (fbui_events_pending (pre))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+
+
+
+/* Page flipping: a window that has the whole screen, on a driver
+ * that can pan to a second page in its virtual resolution, draws
+ * into the page not being shown, and a present pans to it. Any
+ * other window draws into its backing store, and a present copies
+ * that to the screen. Either way nothing is seen half drawn.
+ */
+static int fbui_can_pan (struct fb_info *info, struct fbui_window *win)
+{
+	if (!info->fbops->fb_pan_display || !info->fix.ypanstep)
+		return 0;
+	if (info->var.yres % info->fix.ypanstep)
+		return 0;
+	if (info->var.yres_virtual < 2 * info->var.yres)
+		return 0;
+	if (info->var.xoffset || info->var.yoffset)
+		return 0;
+	if (!info->screen_base || info->shadow || info->flip_window)
+		return 0;
+	if (win->x0 || win->y0 || win->width != info->var.xres ||
+	    win->height != info->var.yres)
+		return 0;
+	return 1;
+}
+
+
+/* The caller holds the window's semaphore */
+static int fbui_flip_begin (struct fb_info *info, struct fbui_window *win)
+{
+	u32 page;
+
+	if (!info || !win)
+		return FBUI_ERR_NULLPTR;
+	if (info->state != FBINFO_STATE_RUNNING)
+		return FBUI_ERR_NOTRUNNING;
+	if (win->need_placement)
+		return FBUI_ERR_NOTPLACED;
+	if (win->flipping)
+		return FBUI_SUCCESS;
+	/*----------*/
+
+	win->flip_want_backing = win->want_backing;
+
+	if (fbui_can_pan (info, win)) {
+		if (win->backing_store) {
+			vfree (win->backing_store);
+			win->backing_store = NULL;
+		}
+
+		/* Start the back page out as a copy of the front */
+		page = info->var.yres * info->fix.line_length;
+		fbui_copy_within ((unsigned char*) info->screen_base + page,
+			(unsigned char*) info->screen_base, page);
+
+		info->flip_window = win;
+		info->front_offset = 0;
+		info->back_offset = page;
+		win->backing_store = (unsigned char*) info->screen_base + page;
+		win->backing_linelen = info->fix.line_length;
+		win->flipping = 1;
+		return FBUI_SUCCESS;
+	}
+
+	/* Otherwise the backing store is the back buffer */
+	if (!win->backing_store) {
+		win->want_backing = 1;
+		fbui_alloc_backing (info, win);
+		if (!win->backing_store) {
+			win->want_backing = win->flip_want_backing;
+			return FBUI_ERR_NOMEM;
+		}
+	}
+	win->flipping = 1;
+	return FBUI_SUCCESS;
+}
+
+
+/* Puts the window back to drawing straight onto the screen. If it
+ * was panning, what is shown is moved to the first page, where
+ * the console driver and the other windows expect it.
+ */
+static void fbui_flip_end (struct fb_info *info, struct fbui_window *win)
+{
+	struct fb_var_screeninfo var;
+	u32 bytes_per_pixel;
+	short j;
+
+	if (!info || !win || !win->flipping)
+		return;
+	/*----------*/
+
+	win->flipping = 0;
+	win->want_backing = win->flip_want_backing;
+
+	if (win != info->flip_window) {
+		fbui_backing_show (info, win, 0, 0, win->width-1, win->height-1);
+
+		/* The store was only there to be the back buffer */
+		if (!win->want_backing) {
+			vfree (win->backing_store);
+			win->backing_store = NULL;
+		}
+		return;
+	}
+
+	if (info->front_offset) {
+		fbui_copy_within ((unsigned char*) info->screen_base,
+			(unsigned char*) info->screen_base + info->front_offset,
+			info->var.yres * info->fix.line_length);
+
+		var = info->var;
+		var.xoffset = 0;
+		var.yoffset = 0;
+		var.activate = FB_ACTIVATE_VBL;
+		if (!info->fbops->fb_pan_display (&var, info))
+			info->var.yoffset = 0;
+		info->front_offset = 0;
+	}
+	info->back_offset = 0;
+	info->flip_window = NULL;
+
+	win->backing_store = NULL;
+	if (win->want_backing) {
+		fbui_alloc_backing (info, win);
+		if (!win->backing_store)
+			return;
+
+		bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+		for (j=0; j < win->height; j++)
+			memcpy_fromio (win->backing_store + j * win->backing_linelen,
+				info->screen_base + (win->y0 + j) * info->fix.line_length
+				+ win->x0 * bytes_per_pixel,
+				win->width * bytes_per_pixel);
+	}
+}
+
+
+/* Shows everything drawn since the last present. A panning window
+ * that has since been partly covered is copied to the screen
+ * like any other, until it is uncovered again.
+ */
+static int fbui_present (struct fb_info *info, struct fbui_window *win)
+{
+	struct fb_var_screeninfo var;
+	char initial_hide;
+	int result = FBUI_SUCCESS;
+	u32 tmp;
+
+	if (!info || !win)
+		return FBUI_ERR_NULLPTR;
+	if (info->state != FBINFO_STATE_RUNNING)
+		return FBUI_ERR_NOTRUNNING;
+	if (!win->flipping)
+		return FBUI_ERR_NOTFLIPPING;
+	/*----------*/
+
+	down (&info->windowSems [win->id]);
+	fbui_drawing_begin (info, win);
+
+	/* Commands queued before the present belong to this frame */
+	if (win->ring)
+		result = fbui_ring_drain (info, win);
+
+	initial_hide = info->pointer_hidden;
+
+	if (win == info->flip_window && fbui_onscreen (info, win) &&
+	    win->nclip == 1 && !win->clip[0].x0 && !win->clip[0].y0 &&
+	    win->clip[0].x1 == win->width - 1 &&
+	    win->clip[0].y1 == win->height - 1) {
+		var = info->var;
+		var.xoffset = 0;
+		var.yoffset = info->back_offset / info->fix.line_length;
+		var.activate = FB_ACTIVATE_VBL;
+
+		/* The pointer moves to the new page with the flip */
+		if (pointer_overlaps (info, 0, 0, win->width-1, win->height-1))
+			fbui_hide_pointer (info);
+
+		if (info->fbops->fb_pan_display (&var, info))
+			__fbui_backing_show (info, win, 
+				0, 0, win->width-1, win->height-1);
+		else {
+			info->var.xoffset = var.xoffset;
+			info->var.yoffset = var.yoffset;
+			tmp = info->front_offset;
+			info->front_offset = info->back_offset;
+			info->back_offset = tmp;
+			win->backing_store = (unsigned char*) info->screen_base 
+				+ info->back_offset;
+		}
+	} else
+		__fbui_backing_show (info, win, 0, 0, win->width-1, win->height-1);
+
+	if (!initial_hide && info->pointer_hidden)
+		fbui_unhide_pointer (info);
+	fbui_shadow_flush (info);
+
+	win->drawing = 0;
+	up (&info->windowSems [win->id]);
+	return result;
+}
+
+
+int fbui_control (struct fb_info *info, struct fbui_ctrlparams *ctl)
+{
+	struct fbui_window *self=NULL;
+	struct fbui_window *win=NULL;
+	struct fbui_processentry *pre=NULL;
+	int cons = -1;
+	char cmd;
+	short id;
+	short x, y;
+	short width, height;
+	struct fbui_event *event;
+	unsigned char *pointer;
+	u32 cutlen;
+	int result;
+
+	if (!info || !ctl)
+		return FBUI_ERR_NULLPTR;
+	/*----------*/
+
+	cmd = ctl->op;
+	x = ctl->x;
+	y = ctl->y;
+	width = ctl->width;
+	height = ctl->height;
+	id = ctl->id;
+	event = ctl->event;
+	pointer = ctl->pointer;
+	cutlen = ctl->cutpaste_length;
+
+	if (id < 0)
 		return FBUI_ERR_BADPARAM;
 
 	if (!(self = fbui_lookup_win (info, id)))
@@ -2514,6 +4290,9 @@ int fbui_control (struct fb_info *info, struct fbui_ctrlparams *ctl)
 	case FBUI_UNHIDE:
 		return fbui_unhide (info, self, win);
 
+	case FBUI_RAISE:
+		return fbui_raise (info, self, win);
+
 	case FBUI_WININFO:
 		return fbui_window_info (info, cons, ctl->info, ctl->ninfo);
 
@@ -2580,9 +4359,42 @@ int fbui_control (struct fb_info *info, struct fbui_ctrlparams *ctl)
 		if (copy_from_user ((char*) &self->font, pointer, FBUI_FONTSIZE))
 			return FBUI_ERR_BADADDR;
 
+		/* Upload the glyphs now, rather than on first use */
+		down (&info->windowSems [self->id]);
+		result = fbui_load_font (info, self, &self->font);
+		up (&info->windowSems [self->id]);
+		if (result)
+			return result;
+
 		self->font_valid = 1;
 		return FBUI_SUCCESS;
 
+	case FBUI_DOUBLEBUFFER:
+		down (&info->windowSems [self->id]);
+		if (x)
+			result = fbui_flip_begin (info, self);
+		else {
+			fbui_flip_end (info, self);
+			result = FBUI_SUCCESS;
+		}
+		up (&info->windowSems [self->id]);
+		return result;
+
+	case FBUI_PRESENT:
+		return fbui_present (info, self);
+
+	case FBUI_GETCAPS:
+		return FBUI_CMD_VERSION | FBUI_CAP_WIDE | FBUI_CAP_INLINE |
+			FBUI_CAP_RING | FBUI_CAP_DOUBLEBUFFER | FBUI_CAP_BITBLIT |
+			FBUI_CAP_PUTIMAGE | FBUI_CAP_CURSOR;
+
+	case FBUI_LOADCURSOR:
+		return fbui_load_cursor (info, self, width, height, x, y,
+			(u32*) pointer);
+
+	case FBUI_SETCURSOR:
+		return fbui_set_cursor (info, self, x);
+
 	case FBUI_POLLEVENT:
 	case FBUI_WAITEVENT: {
 		struct fbui_event ev;
@@ -2614,7 +4426,7 @@ int fbui_control (struct fb_info *info, struct fbui_ctrlparams *ctl)
 
 		pre->waiting = 1;
 		wait_event_interruptible (pre->waitqueue, 
-					  pre->events_pending > 0);
+					  fbui_events_pending (pre));
 
 		if (fbui_dequeue_event (info, pre, &ev)) {
 			if (copy_to_user (event, &ev, sizeof(struct fbui_event)))
@@ -2627,6 +4439,42 @@ printk (KERN_INFO "XXXXXXXXXX process (pid %d) woken up but no event pending! (p
 		}
 	}
 
+	case FBUI_POLLEVENTS:
+	case FBUI_WAITEVENTS: {
+		struct fbui_event evs [FBUI_MAXEVENTSPERBATCH];
+		int n, max = ctl->nevents;
+
+		if (!event)
+			return FBUI_ERR_NULLPTR;
+		if (max <= 0)
+			return FBUI_ERR_BADPARAM;
+		if (max > FBUI_MAXEVENTSPERBATCH)
+			max = FBUI_MAXEVENTSPERBATCH;
+		if (!access_ok (VERIFY_WRITE, (void*)event, max * sizeof(struct fbui_event)))
+			return -EFAULT;
+
+		pre->wait_event_mask = x;
+
+		if (!(n = fbui_dequeue_events (info, pre, evs, max))) {
+			if (cmd == FBUI_POLLEVENTS) {
+				pre->waiting = 0;
+				return FBUI_ERR_NOEVENT;
+			}
+
+			pre->waiting = 1;
+			wait_event_interruptible (pre->waitqueue, 
+						  fbui_events_pending (pre));
+
+			if (!(n = fbui_dequeue_events (info, pre, evs, max)))
+				return FBUI_ERR_NOEVENT;
+		}
+
+		/* Returns the number of events */
+		if (copy_to_user (event, evs, n * sizeof(struct fbui_event)))
+			return -EFAULT;
+		return n;
+	}
+
 	case FBUI_READPOINT:
 		if (!self->is_wm)
 			return RGB_NOCOLOR;
@@ -2741,9 +4589,282 @@ static char cmdinfo[] =
 32+128+ 5,      /* put pixels RGB 3-byte        x,y,ptr lo,hi,len */
 192+    4,      /* clear area   x0,y0,x1,y1*/
 32+128+ 9,      /* tinyblit	x,y,color lo,hi,bgcolor lo,hi,width, bitmap lo,hi */
+32+128+ 5,      /* put pixels RGBA	x,y,ptr lo,hi,len */
+32+192+ 6,      /* blend area   x0,y0,x1,y1,color lo,hi*/
+32+192+10,      /* bitblit      x,y,width,height,bitmap lo,hi,fg lo,hi,bg lo,hi */
+128+    3,      /* put pixels RGB inline        x,y,len, then len pixels */
+128+    3,      /* put pixels RGBA inline       x,y,len, then len pixels */
+32+192+ 8,      /* put image    x,y,w,h,ptr lo,hi,stride,format */
 };
 
 
+/* Returns how many user pointers a command carries. With FBUI_WIDE
+ * set in the command word, each of them takes four words, not two.
+ */
+static inline short fbui_cmd_pointers (unsigned short cmd)
+{
+	switch (cmd) {
+	case FBUI_STRING:
+		return 2;
+	case FBUI_PUT:
+	case FBUI_PUTRGB:
+	case FBUI_PUTRGB3:
+	case FBUI_PUTRGBA:
+	case FBUI_BITBLIT:
+	case FBUI_PUTIMAGE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+
+/* Fetches a user pointer from the parameter words, low word first.
+ * A wide pointer that does not fit in a long here cannot be valid.
+ */
+static unsigned long fbui_get_pointer (unsigned short *ary, 
+	unsigned short *ix, char wide)
+{
+	unsigned long addr;
+	u32 high;
+
+	addr = ary[*ix+1];
+	addr <<= 16;
+	addr |= ary[*ix];
+	*ix += 2;
+
+	if (wide) {
+		high = ary[*ix+1];
+		high <<= 16;
+		high |= ary[*ix];
+		*ix += 2;
+#if BITS_PER_LONG == 64
+		addr |= ((unsigned long) high) << 32;
+#else
+		if (high)
+			addr = ~0UL;
+#endif
+	}
+
+	return addr;
+}
+
+
+/* Executes one queued command, whose parameter words 
+ * have already been fetched into ary.
+ */
+static int fbui_exec_cmd (struct fb_info *info, struct fbui_window *win,
+	unsigned short cmd, unsigned short *ary, char wide)
+{
+	int result = FBUI_SUCCESS;
+	short a=0, b=0, c=0, d=0, wid=0, ht=0;
+	unsigned long ptr=0;
+	unsigned long addr=0;
+	unsigned char flags;
+	unsigned short ix;
+	u32 param32=0;
+
+	flags = cmdinfo[cmd];
+	ix = 0;
+	if (flags & 128) {
+		a = ary[ix++];
+		b = ary[ix++];
+	}
+	if (flags & 64) {
+		c = ary[ix++];
+		d = ary[ix++];
+	}
+	if (flags & 32) {
+		if (fbui_cmd_pointers (cmd))
+			addr = fbui_get_pointer (ary, &ix, wide);
+		else {
+			param32 = ary[ix+1];
+			param32 <<= 16;
+			param32 |= ary[ix];
+			ix+=2;
+		}
+	}
+
+	switch(cmd) {
+	case FBUI_CLEAR:
+		result = fbui_clear (info,win);
+		break;
+
+	case FBUI_POINT: 
+		result = fbui_draw_point (info,win, a,b,param32);
+		break;
+
+	case FBUI_INVERTLINE: 
+		win->do_invert = 1;
+		result = fbui_draw_line (info,win, a,b,c,d,0);
+		win->do_invert = 0;
+		break;
+
+	case FBUI_LINE: 
+		result = fbui_draw_line (info,win, a,b,c,d,param32);
+		break;
+
+	case FBUI_HLINE: 
+		c = ary[ix++];
+		result = fbui_draw_hline (info,win,a,b,c,param32);
+		break;
+
+	case FBUI_TINYBLIT: {
+		u32 bits;
+		u32 bgcolor;
+		short width;
+
+		/* a = x
+		 * b = y
+		 * param32 = fgcolor
+	 	 */
+		bgcolor = ary[ix+1];
+		bgcolor <<= 16;
+		bgcolor |= ary[ix];
+		ix += 2;
+
+		width = ary[ix++];
+
+		bits = ary[ix+1];
+		bits <<= 16;
+		bits |= ary[ix];
+		ix += 2;
+
+/* printk(KERN_INFO "FBUI_TINYBLIT: x=%d y=%d width=%d fgcolor=%08lx bgcolor=%08lx bits=%08lx\n", a,b,width,param32,bgcolor,bits); */
+
+		result = fbui_tinyblit (info,win,a,b,width,param32,bgcolor,bits);
+		break;
+	}
+
+	case FBUI_VLINE: 
+		c = ary[ix++];
+		result = fbui_draw_vline (info,win,c,a,b,param32);
+		break;
+
+	case FBUI_RECT: 
+		result = fbui_draw_rect (info,win,a,b,c,d,param32);
+		break;
+
+	case FBUI_FILLAREA: 
+		result = fbui_fill_area (info,win,a,b,c,d,param32);
+		break;
+
+	case FBUI_CLEARAREA:
+		result = fbui_clear_area (info,win,a,b,c,d);
+		break;
+
+	case FBUI_PUT:
+		wid = ary[ix++];
+		result= fbui_put (info,win, a,b,wid, (unsigned char*)addr);
+		break;
+
+	case FBUI_PUTRGB: 
+		wid = ary[ix++];
+		result= fbui_put_rgb (info,win,a,b,wid, (u32*)addr, 0);
+		break;
+
+	case FBUI_PUTRGB3:
+		wid = ary[ix++];
+		result= fbui_put_rgb3 (info,win, a,b,wid, (unsigned char*)addr);
+		break;
+
+	case FBUI_PUTRGBA:
+		wid = ary[ix++];
+		result= fbui_put_rgba (info,win, a,b,wid, (u32*)addr, 0);
+		break;
+
+	case FBUI_BLENDAREA:
+		result = fbui_blend_area (info,win,a,b,c,d,param32);
+		break;
+
+	case FBUI_PUTIMAGE:
+		wid = ary[ix++];
+		ht = ary[ix++];
+		result = fbui_put_image (info,win,a,b,c,d,(unsigned char*)addr,
+			wid,ht);
+		break;
+
+	case FBUI_BITBLIT: {
+		u32 fg, bg;
+
+		/* a,b = x,y
+		 * c,d = width,height
+		 * addr = bitmap
+		 */
+		fg = ary[ix+1];
+		fg <<= 16;
+		fg |= ary[ix];
+		ix += 2;
+
+		bg = ary[ix+1];
+		bg <<= 16;
+		bg |= ary[ix];
+		ix += 2;
+
+		result = fbui_bitblit (info,win,a,b,c,d,(unsigned char*)addr,fg,bg);
+		break;
+	}
+
+	case FBUI_COPYAREA:
+		wid = ary[ix++];
+		ht = ary[ix++];
+		result = fbui_copy_area (info,win,a,b, wid,ht,c,d);
+		break;
+
+	case FBUI_STRING: {
+		struct fbui_font *font = &win->font;
+		u32 color;
+		wid = ary[ix++];
+
+		ptr = fbui_get_pointer (ary, &ix, wide);
+
+		if (!ptr) {
+			result = FBUI_ERR_NULLPTR;
+			return result;
+		}
+
+		color = ary[ix+1];
+		color <<= 16;
+		color |= ary[ix];
+		ix += 2;
+
+		if (!addr) {
+			if (!win->font_valid) {
+				result = FBUI_ERR_NOFONT;
+				return result;
+			}
+		} else {
+			if (!access_ok (VERIFY_READ, (void*)addr, FBUI_FONTSIZE)) {
+				result = FBUI_ERR_BADADDR;
+				return result;
+			}
+			if (copy_from_user ((char*)font,(char*)addr,FBUI_FONTSIZE)) {
+				result = FBUI_ERR_BADADDR;
+				return result;
+			}
+
+			win->font_valid = 1;
+		}
+
+		if (!access_ok (VERIFY_READ, (void*)ptr, wid)) {
+			result = FBUI_ERR_BADADDR;
+			return result;
+		}
+		result = fbui_draw_string (info,win,font,a,b,
+			(unsigned char*) ptr, color);
+
+		/* The width is of no use in a batch */
+		if (result > 0)
+			result = FBUI_SUCCESS;
+		break;
+	  }
+
+	} /* switch */
+
+	return result;
+}
+
+
 /* This routine executes commands which can be 
  * safely ignored when a window is hidden, suspended, or
  * not in the foreground console.
@@ -2770,24 +4891,21 @@ int fbui_exec (struct fb_info *info, short win_id, short n, unsigned char *arg)
 		return FBUI_ERR_BADWIN;
 	if (win->pid != current->pid)
                 return FBUI_ERR_BADWIN;
-	if (win->is_hidden)
+	if (win->is_hidden && !win->backing_store)
 		return FBUI_SUCCESS;
 
 	down (&info->windowSems [win->id]);
-	win->drawing = 1;
+	fbui_drawing_begin (info, win);
 
 	initial_hide = info->pointer_hidden;
 
-	while (!result && arg < argmax && !win->is_hidden)
+	while (!result && arg < argmax && 
+	       (!win->is_hidden || win->backing_store))
 	{
 		unsigned short ary [20];
-		short len;
-		short a=0, b=0, c=0, d=0, wid=0, ht=0;
-		u32 ptr=0;
 		unsigned short cmd;
-		unsigned char flags;
-		unsigned short ix;
-		u32 param32=0;
+		short len;
+		char wide;
 
 		if (get_user (cmd, arg)) {
 			result = FBUI_ERR_BADADDR;
@@ -2795,13 +4913,17 @@ int fbui_exec (struct fb_info *info, short win_id, short n, unsigned char *arg)
 		}
 		arg += 2;
 
-		if (cmd > sizeof (cmdinfo)) {
+		wide = (cmd & FBUI_WIDE) ? 1 : 0;
+		cmd &= ~FBUI_WIDE;
+		if (cmd >= sizeof (cmdinfo)) {
 			result = FBUI_ERR_INVALIDCMD;
 			break;
 		}
 		
-		flags = cmdinfo[cmd];
-		if ((len = 2 * (flags & 31))) {
+		len = cmdinfo[cmd] & 31;
+		if (wide)
+			len += 2 * fbui_cmd_pointers (cmd);
+		if ((len *= 2)) {
 			if (copy_from_user (ary, arg, len)) {
 				result = FBUI_ERR_BADADDR;
 				break;
@@ -2809,193 +4931,205 @@ int fbui_exec (struct fb_info *info, short win_id, short n, unsigned char *arg)
 		}
 		arg += len;
 
-		ix = 0;
-		if (flags & 128) {
-			a = ary[ix++];
-			b = ary[ix++];
-		}
-		if (flags & 64) {
-			c = ary[ix++];
-			d = ary[ix++];
-		}
-		if (flags & 32) {
-			param32 = ary[ix+1];
-			param32 <<= 16;
-			param32 |= ary[ix];
-			ix+=2;
+		/* Inline pixels follow the command, 32 bits each */
+		if (cmd == FBUI_PUTRGBINLINE || cmd == FBUI_PUTRGBAINLINE) {
+			short n = ary[2];
+			if (n < 0 || arg + 4 * n > argmax) {
+				result = FBUI_ERR_INVALIDCMD;
+				break;
+			}
+			if (cmd == FBUI_PUTRGBINLINE)
+				result = fbui_put_rgb (info, win, ary[0], ary[1], 
+					n, (u32*) arg, 0);
+			else
+				result = fbui_put_rgba (info, win, ary[0], ary[1], 
+					n, (u32*) arg, 0);
+			arg += 4 * n;
+			continue;
 		}
 
-		switch(cmd) {
-		case FBUI_CLEAR:
-			result = fbui_clear (info,win);
-			if (result)
-				goto finished;
-			break;
+		result = fbui_exec_cmd (info, win, cmd, ary, wide);
+	}
 
-		case FBUI_POINT: 
-			result = fbui_draw_point (info,win, a,b,param32);
-			if (result)
-				goto finished;
-			break;
+	if (!initial_hide && info->pointer_hidden)
+		fbui_unhide_pointer (info);
+	fbui_shadow_flush (info);
 
-		case FBUI_INVERTLINE: 
-			win->do_invert = 1;
-			result = fbui_draw_line (info,win, a,b,c,d,0);
-			win->do_invert = 0;
-			if (result)
-				goto finished;
-			break;
+	win->drawing = 0;
+	up (&info->windowSems [win->id]);
+	return result;
+}
 
-		case FBUI_LINE: 
-			result = fbui_draw_line (info,win, a,b,c,d,param32);
-			if (result)
-				goto finished;
-			break;
 
-		case FBUI_HLINE: 
-			c = ary[ix++];
-			result = fbui_draw_hline (info,win,a,b,c,param32);
-			if (result)
-				goto finished;
-			break;
+/* Puts pixels that came inline in the command ring. If they are
+ * contiguous and aligned there, they are drawn in place; otherwise
+ * they are gathered into the bounce buffer, or failing that into
+ * a span on the stack, since they may wrap around.
+ */
+static int fbui_ring_put (struct fb_info *info, struct fbui_window *win,
+	unsigned short cmd, short x, short y, short n, u32 pos)
+{
+	u32 buf [FBUI_SPANLEN];
+	unsigned short *p = win->ring->data + (pos & (FBUI_RING_WORDS-1));
+	u32 *src = buf;
+	int result = FBUI_SUCCESS;
+	short i, k;
+
+	if ((pos & (FBUI_RING_WORDS-1)) + 2*n <= FBUI_RING_WORDS &&
+	    !(3 & (unsigned long) p))
+		src = (u32*) p;
+	else if ((p = (unsigned short*) fbui_bounce (win, 4*n))) {
+		for (i=0; i < 2*n; i++)
+			p[i] = win->ring->data [pos++ & (FBUI_RING_WORDS-1)];
+		src = (u32*) p;
+	}
 
-		case FBUI_TINYBLIT: {
-			u32 bits;
-			u32 bgcolor;
-			short width;
+	while (!result && n > 0) {
+		k = n;
+		if (src == buf) {
+			k = n < FBUI_SPANLEN ? n : FBUI_SPANLEN;
+			p = (unsigned short*) buf;
+			for (i=0; i < 2*k; i++)
+				p[i] = win->ring->data [pos++ & (FBUI_RING_WORDS-1)];
+		}
 
-			/* a = x
-			 * b = y
-			 * param32 = fgcolor
-		 	 */
-			bgcolor = ary[ix+1];
-			bgcolor <<= 16;
-			bgcolor |= ary[ix];
-			ix += 2;
+		if (cmd == FBUI_PUTRGBINLINE)
+			result = fbui_put_rgb (info, win, x, y, k, src, 1);
+		else
+			result = fbui_put_rgba (info, win, x, y, k, src, 1);
+		x += k;
+		n -= k;
+	}
 
-			width = ary[ix++];
+	return result;
+}
 
-			bits = ary[ix+1];
-			bits <<= 16;
-			bits |= ary[ix];
-			ix += 2;
 
-/* printk(KERN_INFO "FBUI_TINYBLIT: x=%d y=%d width=%d fgcolor=%08lx bgcolor=%08lx bits=%08lx\n", a,b,width,param32,bgcolor,bits); */
+/* Executes whatever the client has put in its command ring.
+ * This has to run in the client's context, since commands
+ * may carry user pointers. The caller holds the window's semaphore.
+ */
+static int fbui_ring_drain (struct fb_info *info, struct fbui_window *win)
+{
+	struct fbui_ring *ring;
+	int result = FBUI_SUCCESS;
+	u32 head, tail;
 
-			result = fbui_tinyblit (info,win,a,b,width,param32,bgcolor,bits);
-			if (result)
-				goto finished;
-			break;
-		}
+	if (!info || !win || !win->ring)
+		return FBUI_ERR_NULLPTR;
+	/*----------*/
 
-		case FBUI_VLINE: 
-			c = ary[ix++];
-			result = fbui_draw_vline (info,win,c,a,b,param32);
-			if (result)
-				goto finished;
-			break;
+	ring = win->ring;
+	ring->busy = 1;
+	mb();
 
-		case FBUI_RECT: 
-			result = fbui_draw_rect (info,win,a,b,c,d,param32);
-			if (result)
-				goto finished;
-			break;
+	tail = ring->tail;
+	while (1) {
+		head = ring->head;
+		rmb();
 
-		case FBUI_FILLAREA: 
-			result = fbui_fill_area (info,win,a,b,c,d,param32);
-			if (result)
-				goto finished;
-			break;
+		/* A bogus head from the client discards everything */
+		if (head - tail > FBUI_RING_WORDS) {
+			result = FBUI_ERR_BADPARAM;
+			tail = head;
+		}
 
-		case FBUI_CLEARAREA:
-			result = fbui_clear_area (info,win,a,b,c,d);
-			if (result)
-				goto finished;
-			break;
+		while (!result && tail != head) {
+			unsigned short ary [20];
+			unsigned short cmd;
+			short i, n;
+			char wide;
+
+			cmd = ring->data [tail & (FBUI_RING_WORDS-1)];
+			wide = (cmd & FBUI_WIDE) ? 1 : 0;
+			cmd &= ~FBUI_WIDE;
+			if (cmd >= sizeof (cmdinfo)) {
+				result = FBUI_ERR_INVALIDCMD;
+				break;
+			}
+			n = cmdinfo[cmd] & 31;
+			if (wide)
+				n += 2 * fbui_cmd_pointers (cmd);
+			if (head - tail < n + 1) {
+				result = FBUI_ERR_INVALIDCMD;
+				break;
+			}
+			for (i=0; i < n; i++)
+				ary[i] = ring->data [(tail+1+i) & (FBUI_RING_WORDS-1)];
+			tail += n + 1;
+
+			if (cmd == FBUI_PUTRGBINLINE || cmd == FBUI_PUTRGBAINLINE) {
+				short npix = ary[2];
+				if (npix < 0 || head - tail < 2 * npix) {
+					result = FBUI_ERR_INVALIDCMD;
+					break;
+				}
+				if (!win->is_hidden || win->backing_store)
+					result = fbui_ring_put (info, win, cmd, 
+						ary[0], ary[1], npix, tail);
+				tail += 2 * npix;
+				continue;
+			}
 
-		case FBUI_PUT:
-			wid = ary[ix++];
-			result= fbui_put (info,win, a,b,wid, (unsigned char*)param32);
-			if (result)
-				goto finished;
-			break;
+			if (!win->is_hidden || win->backing_store)
+				result = fbui_exec_cmd (info, win, cmd, ary, wide);
+		}
 
-		case FBUI_PUTRGB: 
-			wid = ary[ix++];
-			result= fbui_put_rgb (info,win,a,b,wid, (unsigned long*)param32);
-			if (result)
-				goto finished;
-			break;
+		/* After an error the rest of the batch is dropped */
+		if (result)
+			tail = head;
+		mb();
+		ring->tail = tail;
 
-		case FBUI_PUTRGB3:
-			wid = ary[ix++];
-			result= fbui_put_rgb3 (info,win, a,b,wid, (unsigned char*)param32);
-			if (result)
-				goto finished;
+		/* The client only kicks when it sees busy clear, 
+		 * so recheck for late arrivals after clearing it.
+		 */
+		ring->busy = 0;
+		mb();
+		if (result || ring->head == tail)
 			break;
+		ring->busy = 1;
+		mb();
+	}
 
-		case FBUI_COPYAREA:
-			wid = ary[ix++];
-			ht = ary[ix++];
-			result = fbui_copy_area (info,win,a,b, wid,ht,c,d);
-			if (result)
-				goto finished;
-			break;
+	return result;
+}
 
-		case FBUI_STRING: {
-			struct fbui_font *font = &win->font;
-			u32 color;
-			wid = ary[ix++];
 
-			ptr = ary[ix+1];
-			ptr <<= 16;
-			ptr |= ary[ix];
-			ix += 2;
+/* Doorbell for the command ring.
+ */
+int fbui_kick (struct fb_info *info, short win_id)
+{
+	struct fbui_window *win=NULL;
+	int result;
+	char initial_hide=0;
 
-			if (!ptr) {
-				result = FBUI_ERR_NULLPTR;
-				goto finished;
-			}
+	if (!info)
+		return FBUI_ERR_NULLPTR;
+	if (win_id < 0 || win_id >= (FBUI_MAXWINDOWSPERVC * FBUI_MAXCONSOLES))
+		return FBUI_ERR_BADWIN;
+	if (info->fix.visual != FB_VISUAL_TRUECOLOR && 
+	    info->fix.visual != FB_VISUAL_DIRECTCOLOR) 
+		return FBUI_ERR_WRONGVISUAL;
+	/*----------*/
 
-			color = ary[ix+1];
-			color <<= 16;
-			color |= ary[ix];
-			ix += 2;
+	if (!(win = fbui_lookup_win (info, win_id)))
+		return FBUI_ERR_BADWIN;
+	if (win->pid != current->pid)
+                return FBUI_ERR_BADWIN;
+	if (!win->ring)
+		return FBUI_ERR_NORING;
 
-			if (!param32) {
-				if (!win->font_valid) {
-					result = FBUI_ERR_NOFONT;
-					goto finished;
-				}
-			} else {
-				if (!access_ok (VERIFY_READ, (void*)param32, FBUI_FONTSIZE)) {
-					result = FBUI_ERR_BADADDR;
-					goto finished;
-				}
-				if (copy_from_user ((char*)font,(char*)param32,FBUI_FONTSIZE)) {
-					result = FBUI_ERR_BADADDR;
-					goto finished;
-				}
+	down (&info->windowSems [win->id]);
+	fbui_drawing_begin (info, win);
 
-				win->font_valid = 1;
-			}
+	initial_hide = info->pointer_hidden;
 
-			if (!access_ok (VERIFY_READ, (void*)ptr, wid)) {
-				result = FBUI_ERR_BADADDR;
-				goto finished;
-			}
-			result = fbui_draw_string (info,win,font,a,b,
-				(unsigned char*) ptr, color);
-			if (result)
-				goto finished;
-			break;
-		  }
+	result = fbui_ring_drain (info, win);
 
-		} /* switch */
-	}
-finished:
 	if (!initial_hide && info->pointer_hidden)
 		fbui_unhide_pointer (info);
+	fbui_shadow_flush (info);
 
 	win->drawing = 0;
 	up (&info->windowSems [win->id]);
@@ -3003,6 +5137,172 @@ finished:
 }
 
 
+static struct fbui_shared *fbui_shared_alloc (unsigned long size)
+{
+	struct fbui_shared *sh;
+
+	if (!size)
+		return NULL;
+	/*----------*/
+
+	sh = kmalloc (sizeof (struct fbui_shared), GFP_KERNEL);
+	if (!sh)
+		return NULL;
+	sh->size = PAGE_ALIGN (size);
+	sh->addr = vmalloc (sh->size);
+	if (!sh->addr) {
+		kfree (sh);
+		return NULL;
+	}
+	memset (sh->addr, 0, sh->size);
+	atomic_set (&sh->count, 1);
+	return sh;
+}
+
+static void fbui_shared_put (struct fbui_shared *sh)
+{
+	if (!sh)
+		return;
+	/*----------*/
+
+	if (atomic_dec_and_test (&sh->count)) {
+		vfree (sh->addr);
+		kfree (sh);
+	}
+}
+
+/* Every vma holds a reference, including those made by fork()
+ * or by splitting a mapping */
+static void fbui_shared_open (struct vm_area_struct *vma)
+{
+	struct fbui_shared *sh = vma->vm_private_data;
+
+	atomic_inc (&sh->count);
+}
+
+static void fbui_shared_close (struct vm_area_struct *vma)
+{
+	fbui_shared_put (vma->vm_private_data);
+}
+
+static struct page *fbui_shared_nopage (struct vm_area_struct *vma, 
+	unsigned long address, int *type)
+{
+	struct fbui_shared *sh = vma->vm_private_data;
+	unsigned long offset;
+	struct page *page;
+
+	offset = (vma->vm_pgoff << PAGE_SHIFT) + address - vma->vm_start;
+	if (offset >= sh->size)
+		return NOPAGE_SIGBUS;
+
+	page = vmalloc_to_page ((char*) sh->addr + offset);
+	get_page (page);
+	if (type)
+		*type = VM_FAULT_MINOR;
+	return page;
+}
+
+static struct vm_operations_struct fbui_shared_vmops = {
+	.open = fbui_shared_open,
+	.close = fbui_shared_close,
+	.nopage = fbui_shared_nopage,
+};
+
+/* Gives a new vma its reference. The page offset only picked
+ * the window, so it is rebased to the start of the memory.
+ */
+static void fbui_shared_map (struct fbui_shared *sh, struct vm_area_struct *vma)
+{
+	atomic_inc (&sh->count);
+	vma->vm_ops = &fbui_shared_vmops;
+	vma->vm_private_data = sh;
+	vma->vm_pgoff = 0;
+	vma->vm_flags |= VM_RESERVED;
+}
+
+
+/* Maps the event ring of the caller's process. The page offset
+ * is FBUI_EVENTS_PGOFF + the id of any window the caller owns.
+ */
+static int fbui_mmap_events (struct fb_info *info, struct vm_area_struct *vma)
+{
+	struct fbui_window *win;
+	struct fbui_processentry *pre;
+	struct fbui_shared *sh;
+	unsigned long id, flags;
+
+	if (!info || !vma)
+		return -EINVAL;
+	id = vma->vm_pgoff - FBUI_EVENTS_PGOFF;
+	if (id >= FBUI_MAXWINDOWSPERVC * FBUI_MAXCONSOLES)
+		return -EINVAL;
+	if (vma->vm_end - vma->vm_start > PAGE_ALIGN (FBUI_EVENTRING_SIZE))
+		return -EINVAL;
+	/*----------*/
+
+	if (!(win = fbui_lookup_win (info, id)))
+		return -EINVAL;
+	if (win->pid != current->pid)
+		return -EACCES;
+	if (!(pre = win->processentry))
+		return -EINVAL;
+
+	/* The ring may be going away with the process's last window */
+	spin_lock_irqsave (&pre->queuelock, flags);
+	if ((sh = pre->evmem))
+		fbui_shared_map (sh, vma);
+	spin_unlock_irqrestore (&pre->queuelock, flags);
+	return sh ? 0 : -EINVAL;
+}
+
+
+/* Maps the command ring of a window the caller owns.
+ * The page offset selects the window: FBUI_RING_PGOFF + id.
+ */
+int fbui_mmap (struct fb_info *info, struct file *file, 
+	struct vm_area_struct *vma)
+{
+	struct fbui_window *win;
+	struct fbui_shared *sh;
+	unsigned long id;
+
+	if (!info || !vma)
+		return -EINVAL;
+	if (vma->vm_pgoff < FBUI_RING_PGOFF)
+		return -EINVAL;
+	if (vma->vm_pgoff >= FBUI_EVENTS_PGOFF)
+		return fbui_mmap_events (info, vma);
+	id = vma->vm_pgoff - FBUI_RING_PGOFF;
+	if (id >= FBUI_MAXWINDOWSPERVC * FBUI_MAXCONSOLES)
+		return -EINVAL;
+	if (vma->vm_end - vma->vm_start > PAGE_ALIGN (sizeof (struct fbui_ring)))
+		return -EINVAL;
+	/*----------*/
+
+	if (!(win = fbui_lookup_win (info, id)))
+		return -EINVAL;
+	if (win->pid != current->pid)
+		return -EACCES;
+
+	/* Each window gets a ring of its own, so a previous owner
+	 * of the id can only write to a ring nothing reads. */
+	down (&info->windowSems [id]);
+	if (!(sh = win->ringmem)) {
+		sh = fbui_shared_alloc (sizeof (struct fbui_ring));
+		if (!sh) {
+			up (&info->windowSems [id]);
+			return -ENOMEM;
+		}
+		win->ringmem = sh;
+		win->ring = sh->addr;
+	}
+	fbui_shared_map (sh, vma);
+	up (&info->windowSems [id]);
+	return 0;
+}
+
+
 /* This is provided for completeness sake.
  * The current fbdump actually uses mmap().
  */
@@ -3019,7 +5319,7 @@ u32 fb_read_point (struct fb_info *info, short x, short y)
 
         bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
         offset = y * info->fix.line_length + x * bytes_per_pixel;
-        ptr = offset + ((unsigned char*)info->screen_base);
+        ptr = offset + fbui_screen (info);
 
 	value = 0;
 	switch (bytes_per_pixel) {
@@ -3089,32 +5389,37 @@ short fb_getpixels_rgb (struct fb_info *info, short x, short y, short n,
 static int fbui_draw_point (struct fb_info *info, struct fbui_window *win, 
 		     short x, short y, u32 color)
 {
-	short mx,my;
+	int i;
+
 	if (!info || !win)
 		return FBUI_ERR_NULLPTR;
 	if (info->state != FBINFO_STATE_RUNNING) 
 		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
-		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
 	if (x < 0 || y < 0 || x >= win->width || y >= win->height)
 		return 0;
 	/*----------*/
-	x += win->x0;
-	y += win->y0;
 
-	if (!info->have_hardware_pointer && info->pointer_active && !info->pointer_hidden) {
-		short mx1;
-		short my1;
-		mx = info->mouse_x0;
-		my = info->mouse_y0;
-		mx1 = info->mouse_x1;
-		my1 = info->mouse_y1;
+	if (win->backing_store) {
+		__fb_point (info, win->backing_store, win->backing_linelen,
+			x, y, color, win->do_invert);
+		return fbui_backing_show (info, win, x, y, x, y);
+	}
 
-		if (x >= mx && y >= my && x <= mx1 && y <= my1)
-			fbui_hide_pointer (info);
+	for (i=0; i < win->nclip; i++) {
+		struct fbui_cliprect *r = &win->clip [i];
+		if (x >= r->x0 && x <= r->x1 && y >= r->y0 && y <= r->y1)
+			break;
 	}
+	if (i >= win->nclip)
+		return FBUI_SUCCESS;
+
+	x += win->x0;
+	y += win->y0;
+
+	if (pointer_overlaps (info, x, y, x, y))
+		fbui_hide_pointer (info);
 
 	if (info->fbops->fb_point)
 		info->fbops->fb_point (info, x, y, color, win->do_invert);
@@ -3126,17 +5431,16 @@ static int fbui_draw_point (struct fb_info *info, struct fbui_window *win,
 static int fbui_draw_line (struct fb_info *info, struct fbui_window *win, 
 	short x0, short y0, short x1, short y1, u32 color)
 {
-	int dx, dy, e, j, xchange;
-	char s1, s2;
-	short x, y;
+	u32 pixel, bytes_per_pixel;
+	unsigned char *base;
+	short j;
+	int i;
 
 	if (!info || !win) 
 		return FBUI_ERR_NULLPTR;
 	if (info->state != FBINFO_STATE_RUNNING) 
 		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
-		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
 	if (x0 < 0 && x1 < 0) 
 		return 0;
@@ -3148,6 +5452,9 @@ static int fbui_draw_line (struct fb_info *info, struct fbui_window *win,
 	j = win->height;
 	if (y0 >= j && y1 >= j)
 		return 0;
+	if (x0 < -8191 || x0 > 8191 || x1 < -8191 || x1 > 8191 ||
+	    y0 < -8191 || y0 > 8191 || y1 < -8191 || y1 > 8191)
+		return FBUI_ERR_BADPARAM;
 	/*----------*/
 
 	if (!win->do_invert) {
@@ -3162,164 +5469,377 @@ static int fbui_draw_line (struct fb_info *info, struct fbui_window *win,
 			return fbui_draw_hline (info,win,x0,x1,y0,color);
 		}
 	}
+	else
+	if (x0==x1 && y0==y1)
+		return fbui_draw_point (info,win,x0,y0,color);
 
-	/* Bresenham */
-	s1 = 1;
-	s2 = 1;
-	x = x0;
-	y = y0;
+	pixel = pixel_from_rgb (info, color);
 
-	dx = x1-x0;
-	if (dx < 0) {
-		dx = -dx;
-		s1 = -1;
+	/* The backing store and screen are in the same format,
+	 * so the line is simply drawn into both; a double-buffered
+	 * window's is shown on present.
+	 */
+	if (win->backing_store) {
+		__fb_line (info, win->backing_store, win->backing_linelen,
+			x0, y0, x1, y1, 0, 0, win->width-1, win->height-1,
+			pixel, win->do_invert);
+		if (win->flipping || !fbui_onscreen (info, win))
+			return FBUI_SUCCESS;
 	}
 
-	dy = y1-y0;
-	if (dy < 0) {
-		dy = -dy;
-		s2 = -1;
-	}
+	if (!info->screen_base)
+		return FBUI_SUCCESS;
 
-	xchange = 0;
+	if (pointer_overlaps (info, 
+	    win->x0 + (x0 < x1 ? x0 : x1), win->y0 + (y0 < y1 ? y0 : y1),
+	    win->x0 + (x0 < x1 ? x1 : x0), win->y0 + (y0 < y1 ? y1 : y0)))
+		fbui_hide_pointer (info);
 
-	if (dy>dx) {
-		int tmp = dx;
-		dx = dy;
-		dy = tmp;
-		xchange = 1;
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	base = fbui_screen (info) + win->y0 * info->fix.line_length
+		+ win->x0 * bytes_per_pixel;
+
+	for (i=0; i < win->nclip; i++) {
+		struct fbui_cliprect *r = &win->clip [i];
+		short a = x0 < x1 ? x0 : x1, b = x0 < x1 ? x1 : x0;
+		short c = y0 < y1 ? y0 : y1, d = y0 < y1 ? y1 : y0;
+		if (!fbui_clip (win, i, &a, &c, &b, &d))
+			continue;
+		__fb_line (info, base, info->fix.line_length,
+			x0, y0, x1, y1, r->x0, r->y0, r->x1, r->y1,
+			pixel, win->do_invert);
+		fbui_shadow_damage (info, win->x0 + a, win->y0 + c,
+			win->x0 + b, win->y0 + d);
 	}
 
-	e = (dy<<1) - dx;
-	for (j=0; j <= dx; j++) 
-	{
-		fbui_draw_point (info,win,x,y,color);
-		
-		if (e >= 0) {
-			if (xchange)
-				x += s1;
-			else
-				y += s2;
-			e -= (dx << 1);
+	return FBUI_SUCCESS;
+}
+
+
+/* Pixel masks for four bits of a 1-bit bitmap, leftmost pixel first:
+ * for each pixel size, four pixels are that many 32 bit words.
+ */
+static u32 fbui_bitmasks [4][16][4];
+
+static void fbui_init_bitmasks (void)
+{
+	unsigned char *p;
+	int b, v, k;
+
+	for (b=1; b <= 4; b++) {
+		for (v=0; v < 16; v++) {
+			p = (unsigned char*) fbui_bitmasks [b-1][v];
+			for (k=0; k < 4; k++)
+				memset (p + k * b, (v & (8 >> k)) ? 0xff : 0, b);
 		}
-		if (xchange) 
-			y += s2;
-		else
-			x += s1;
-		e += (dy << 1);
 	}
+}
 
-	return FBUI_SUCCESS;
+
+/* Four copies of a native pixel, laid out as in video memory */
+static void fbui_pattern (u32 *p, u32 pixel, u32 bytes_per_pixel)
+{
+	unsigned char *q = (unsigned char*) p;
+	int k;
+
+	for (k=0; k < 4; k++, q += bytes_per_pixel) {
+		switch (bytes_per_pixel) {
+		case 1: q[0] = pixel; break;
+		case 2: *(u16*) q = pixel; break;
+		case 3: q[0] = pixel; q[1] = pixel >> 8; q[2] = pixel >> 16; break;
+		case 4: *(u32*) q = pixel; break;
+		}
+	}
 }
 
 
-static int fbui_tinyblit (struct fb_info *info, struct fbui_window *win, 
-	short x_, short y, short width_, u32 fg, u32 bg, u32 bitmap_)
+/* Bit i of a 1-bit bitmap, most significant bit first */
+static inline int fb_bit (unsigned char *bits, int i)
 {
-	u32 native_fg=0;
-	u32 native_bg=0;
-	u32 bytes_per_pixel;
-	u32 offset;
-	u32 bitmap = bitmap_;
-	unsigned char *ptr;
-	unsigned char do_bg, width=width_;
-	short x1;
-	short x, x0;
+	return (bits [i >> 3] >> (7 - (i & 7))) & 1;
+}
 
-	if (!info || !win) 
-		return FBUI_ERR_NULLPTR;
-	if (x_ >= win->width) 
-		return 0;
-	if (y < 0 || y >= win->height) 
-		return 0;
-	if (width > 32)
-		width = 32;
-	x0 = win->x0;
-	x1 = x0 + win->width;
-	x = x0 + x_;
-	if (x0 + width <= 0)
-		return 0;
-	/*----------*/
+/* Four bits from bit i; one byte past them must be readable */
+static inline int fb_bits4 (unsigned char *bits, int i)
+{
+	u32 v = (bits [i >> 3] << 8) | bits [(i >> 3) + 1];
+	return (v >> (12 - (i & 7))) & 15;
+}
 
-	y += win->y0;
 
-	if (!info->have_hardware_pointer && info->pointer_active && !info->pointer_hidden) {
-		short x2 = x + width - 1;
-		short mx = info->mouse_x0;
-		short my = info->mouse_y0;
-		short mx1 = info->mouse_x1;
-		short my1 = info->mouse_y1;
-		if (y >= my && y <= my1) {
-			if ((mx >= x && mx <= x2) || (mx1 >= x && mx1 <= x2) ||
-			    (x >= mx && x <= mx1))
-				fbui_hide_pointer (info);
-		}
-	}
+/* Draws n pixels at ptr from bits i onward of a 1-bit bitmap, set
+ * bits in native pixel fg and clear ones in bg, or left alone if
+ * not do_bg. Once ptr is word aligned, each four bits become whole
+ * words merged through a mask from fbui_bitmasks.
+ */
+static void __fb_bitrow (struct fb_info *info, unsigned char *ptr,
+	unsigned char *bits, int i, int n, u32 fg, u32 bg, int do_bg)
+{
+	u32 fgp [4], bgp [4], *m;
+	u32 bytes_per_pixel;
+	int k, v;
 
 	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
-	offset = y * info->fix.line_length + x * bytes_per_pixel;
-	ptr = ((unsigned char*)info->screen_base);
-	ptr += offset;
 
-	bitmap <<= (32 - width);
+	while (n > 0 && (3 & (unsigned long) ptr)) {
+		if (fb_bit (bits, i))
+			__fb_span (ptr, 1, fg, bytes_per_pixel);
+		else if (do_bg)
+			__fb_span (ptr, 1, bg, bytes_per_pixel);
+		ptr += bytes_per_pixel;
+		i++;
+		n--;
+	}
 
-	native_fg = pixel_from_rgb (info, fg);
-	do_bg = !(bg & 0xff000000);
-	if (do_bg)
-		native_bg = pixel_from_rgb (info, bg);
+	if (n >= 4) {
+		fbui_pattern (fgp, fg, bytes_per_pixel);
+		fbui_pattern (bgp, bg, bytes_per_pixel);
+		if (do_bg)
+			for (k=0; k < 4; k++)
+				fgp[k] ^= bgp[k];
+	}
 
-	while (width--) {
-		if (x >= x1)
-			break;
-		if (x >= x0) {
-			u32 c = native_fg;
-			u32 bit = bitmap >> 31;
-			if (!bit)
-				c = native_bg;
-
-			if (bit || (!bit && do_bg))
-			{
-				switch (bytes_per_pixel)
-				{
-				case 1:	fb_writeb (c, ptr); break;
-				case 2:	fb_writew (c, ptr); break;
-				case 4:	fb_writel (c, ptr); break;
-				case 3: 
-					fb_writeb (c, ptr); ptr++; c >>= 8;
-					fb_writeb (c, ptr); ptr++; c >>= 8;
-					fb_writeb (c, ptr);
-					ptr -= 2;
-					break;
-				}
+	while (n >= 4) {
+		v = fb_bits4 (bits, i);
+		m = fbui_bitmasks [bytes_per_pixel - 1][v];
+
+		if (do_bg) {
+			switch (bytes_per_pixel) {
+			case 4:
+				fb_writel (bgp[3] ^ (fgp[3] & m[3]), ptr + 12);
+			case 3:
+				fb_writel (bgp[2] ^ (fgp[2] & m[2]), ptr + 8);
+			case 2:
+				fb_writel (bgp[1] ^ (fgp[1] & m[1]), ptr + 4);
+			case 1:
+				fb_writel (bgp[0] ^ (fgp[0] & m[0]), ptr);
 			}
+		} else if (v == 15) {
+			for (k=0; k < bytes_per_pixel; k++)
+				fb_writel (fgp[k], ptr + 4 * k);
+		} else if (v) {
+			for (k=0; k < 4; k++)
+				if (v & (8 >> k))
+					__fb_span (ptr + k * bytes_per_pixel, 1,
+						fg, bytes_per_pixel);
 		}
 
-		bitmap <<= 1;
-		ptr += bytes_per_pixel;
-		x++;
+		ptr += 4 * bytes_per_pixel;
+		i += 4;
+		n -= 4;
+	}
 
-		if (!do_bg && !bitmap)
-			break;
+	while (n > 0) {
+		if (fb_bit (bits, i))
+			__fb_span (ptr, 1, fg, bytes_per_pixel);
+		else if (do_bg)
+			__fb_span (ptr, 1, bg, bytes_per_pixel);
+		ptr += bytes_per_pixel;
+		i++;
+		n--;
 	}
+}
 
-	return FBUI_SUCCESS;
+
+/* Draws up to 32 bits of a 1-bit bitmap with its left edge at x;
+ * only pixels in [xmin,xlim) are written.
+ */
+static void __fb_tinyblit (struct fb_info *info, unsigned char *base, u32 linelen,
+	short x, short y, short xmin, short xlim, unsigned char width, 
+	u32 fg, u32 bg, u32 bitmap)
+{
+	unsigned char bits [5];
+	u32 bytes_per_pixel;
+	short a, b;
+
+	a = x > xmin ? x : xmin;
+	b = x + width < xlim ? x + width : xlim;
+	if (!width || a >= b)
+		return;
+
+	bitmap <<= (32 - width);
+	bits[0] = bitmap >> 24;
+	bits[1] = bitmap >> 16;
+	bits[2] = bitmap >> 8;
+	bits[3] = bitmap;
+	bits[4] = 0;
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	__fb_bitrow (info, base + y * linelen + a * bytes_per_pixel,
+		bits, a - x, b - a, pixel_from_rgb (info, fg),
+		pixel_from_rgb (info, bg), !(bg & 0xff000000));
 }
 
 
-static int fbui_draw_hline (struct fb_info *info, struct fbui_window *win, 
-	short x0, short x1, short y, u32 color)
+static int fbui_tinyblit (struct fb_info *info, struct fbui_window *win, 
+	short x_, short y, short width_, u32 fg, u32 bg, u32 bitmap)
 {
+	u32 bytes_per_pixel;
+	unsigned char *base;
+	unsigned char width=width_;
+	short x;
 	int i;
-	short mx,my;
-	short mx1,my1;
 
 	if (!info || !win) 
 		return FBUI_ERR_NULLPTR;
-	if (info->state != FBINFO_STATE_RUNNING) 
-		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (x_ >= win->width) 
+		return 0;
+	if (y < 0 || y >= win->height) 
+		return 0;
+	if (width > 32)
+		width = 32;
+	if (x_ + width <= 0)
+		return 0;
+	/*----------*/
+
+	if (win->backing_store) {
+		short x1 = x_ + width - 1;
+		__fb_tinyblit (info, win->backing_store, win->backing_linelen,
+			x_, y, 0, win->width, width, fg, bg, bitmap);
+		if (x1 >= win->width)
+			x1 = win->width - 1;
+		return fbui_backing_show (info, win, x_ < 0 ? 0 : x_, y, x1, y);
+	}
+
+	x = win->x0 + x_;
+
+	if (pointer_overlaps (info, x, win->y0 + y, x + width - 1, win->y0 + y))
+		fbui_hide_pointer (info);
+
+	/* Draw relative to the window's origin so that the
+	 * same clipping applies as for the backing store.
+	 */
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	base = fbui_screen (info) + win->y0 * info->fix.line_length
+		+ win->x0 * bytes_per_pixel;
+
+	for (i=0; i < win->nclip; i++) {
+		short a=x_, b=x_+width-1, c=y, d=y;
+		if (!fbui_clip (win, i, &a, &c, &b, &d))
+			continue;
+		__fb_tinyblit (info, base, info->fix.line_length,
+			x_, y, a, b+1, width, fg, bg, bitmap);
+		fbui_shadow_damage (info, win->x0 + a, win->y0 + y,
+			win->x0 + b, win->y0 + y);
+	}
+
+	return FBUI_SUCCESS;
+}
+
+
+/* Bitmap columns fetched from user space at a time */
+#define FBUI_BITCHUNK (8 * FBUI_SPANLEN)
+
+/* Draws a 1-bit bitmap of any size, whose rows are each padded to
+ * a whole byte, most significant bit leftmost. Set bits are drawn
+ * in fg and clear ones in bg, unless the top byte of bg is nonzero.
+ */
+static int fbui_bitblit (struct fb_info *info, struct fbui_window *win,
+	short x, short y, short width, short height, unsigned char *bits,
+	u32 fg, u32 bg)
+{
+	unsigned char buf [FBUI_BITCHUNK / 8 + 1];
+	u32 bytes_per_pixel, stride, native_fg, native_bg;
+	unsigned char *base;
+	short x0, y0, x1, y1, j, k, m, a, b;
+	int i, do_bg;
+
+	if (!info || !win || !bits)
+		return FBUI_ERR_NULLPTR;
+	if (info->state != FBINFO_STATE_RUNNING)
+		return FBUI_ERR_NOTRUNNING;
+	if (!win->backing_store && !fbui_onscreen (info, win))
+		return FBUI_SUCCESS;
+	if (width <= 0 || height <= 0)
+		return FBUI_SUCCESS;
+	stride = (width + 7) >> 3;
+	if (!access_ok (VERIFY_READ, (void*)bits, stride * height))
+		return FBUI_ERR_BADADDR;
+	if (x >= win->width || y >= win->height || 
+	    x + width <= 0 || y + height <= 0)
+		return FBUI_SUCCESS;
+	/*----------*/
+
+	x0 = x < 0 ? 0 : x;
+	y0 = y < 0 ? 0 : y;
+	x1 = x + width > win->width ? win->width - 1 : x + width - 1;
+	y1 = y + height > win->height ? win->height - 1 : y + height - 1;
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	native_fg = pixel_from_rgb (info, fg);
+	native_bg = pixel_from_rgb (info, bg);
+	do_bg = !(bg & 0xff000000);
+
+	if (win->backing_store)
+		base = win->backing_store;
+	else {
+		if (!info->screen_base)
+			return FBUI_SUCCESS;
+		if (pointer_overlaps (info, win->x0 + x0, win->y0 + y0,
+		    win->x0 + x1, win->y0 + y1))
+			fbui_hide_pointer (info);
+		base = fbui_screen (info) + win->y0 * info->fix.line_length
+			+ win->x0 * bytes_per_pixel;
+	}
+
+	/* Columns go a chunk at a time, each starting on a whole byte */
+	for (j=y0; j <= y1; j++) {
+		unsigned char *src = bits + (j - y) * stride;
+
+		for (k = x0 - ((x0 - x) & 7); k <= x1; k += FBUI_BITCHUNK) {
+			m = x1 - k + 1 < FBUI_BITCHUNK ? x1 - k + 1 : FBUI_BITCHUNK;
+			if (copy_from_user (buf, src + ((k - x) >> 3), 
+			    (m + 7) >> 3))
+				return FBUI_ERR_BADADDR;
+			buf [(m + 7) >> 3] = 0;
+
+			if (win->backing_store) {
+				a = k < x0 ? x0 : k;
+				__fb_bitrow (info, base + j * win->backing_linelen
+					+ a * bytes_per_pixel, buf, a - k, 
+					k + m - a, native_fg, native_bg, do_bg);
+				continue;
+			}
+
+			for (i=0; i < win->nclip; i++) {
+				short c=j, d=j;
+				a = k < x0 ? x0 : k;
+				b = k + m - 1;
+				if (!fbui_clip (win, i, &a, &c, &b, &d))
+					continue;
+				__fb_bitrow (info, base + j * info->fix.line_length
+					+ a * bytes_per_pixel, buf, a - k, 
+					b - a + 1, native_fg, native_bg, do_bg);
+			}
+		}
+	}
+
+	if (win->backing_store)
+		return fbui_backing_show (info, win, x0, y0, x1, y1);
+
+	for (i=0; i < win->nclip; i++) {
+		short a=x0, b=x1, c=y0, d=y1;
+		if (fbui_clip (win, i, &a, &c, &b, &d))
+			fbui_shadow_damage (info, win->x0 + a, win->y0 + c,
+				win->x0 + b, win->y0 + d);
+	}
+
+	return FBUI_SUCCESS;
+}
+
+
+static int fbui_draw_hline (struct fb_info *info, struct fbui_window *win, 
+	short x0, short x1, short y, u32 color)
+{
+	int i;
+
+	if (!info || !win) 
+		return FBUI_ERR_NULLPTR;
+	if (info->state != FBINFO_STATE_RUNNING) 
+		return FBUI_ERR_NOTRUNNING;
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
 	if (x0>x1) { 
 		short tmp=x0; x0=x1; x1=tmp; 
@@ -3335,24 +5855,25 @@ static int fbui_draw_hline (struct fb_info *info, struct fbui_window *win,
 		x1 = i-1;
 	/*----------*/
 
-	x0 += win->x0;
-	x1 += win->x0;
-	y += win->y0;
-
-	if (!info->have_hardware_pointer && info->pointer_active && !info->pointer_hidden) {
-		mx = info->mouse_x0;
-		my = info->mouse_y0;
-		mx1 = info->mouse_x1;
-		my1 = info->mouse_y1;
-		if (y >= my && y <= my1) {
-			if ((mx >= x0 && mx <= x1) || (mx1 >= x0 && mx1 <= x1) ||
-			    (x0 >= mx && x0 <= mx1))
-				fbui_hide_pointer (info);
-		}
+	if (win->backing_store) {
+		__fb_hline (info, win->backing_store, win->backing_linelen,
+			x0, x1, y, color);
+		return fbui_backing_show (info, win, x0, y, x1, y);
 	}
 
-	if (info->fbops->fb_hline)
-		info->fbops->fb_hline (info, x0, x1, y, color);
+	if (!info->fbops->fb_hline)
+		return FBUI_SUCCESS;
+
+	if (pointer_overlaps (info, win->x0 + x0, win->y0 + y, 
+	    win->x0 + x1, win->y0 + y))
+		fbui_hide_pointer (info);
+
+	for (i=0; i < win->nclip; i++) {
+		short a=x0, b=x1, c=y, d=y;
+		if (fbui_clip (win, i, &a, &c, &b, &d))
+			info->fbops->fb_hline (info, win->x0 + a, win->x0 + b,
+				win->y0 + y, color);
+	}
 
 	return FBUI_SUCCESS;
 }
@@ -3362,16 +5883,12 @@ static int fbui_draw_vline (struct fb_info *info, struct fbui_window *win,
 	short x, short y0, short y1, u32 color)
 {
 	short i;
-	short mx,my;
-	short mx1,my1;
 
 	if (!info || !win) 
 		return FBUI_ERR_NULLPTR;
 	if (info->state != FBINFO_STATE_RUNNING) 
 		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
-		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
 	if (y0>y1) { 
 		short tmp=y0; y0=y1; y1=tmp; 
@@ -3387,24 +5904,25 @@ static int fbui_draw_vline (struct fb_info *info, struct fbui_window *win,
 		y1 = i-1;
 	/*----------*/
 
-	x += win->x0;
-	y0 += win->y0;
-	y1 += win->y0;
-
-	if (!info->have_hardware_pointer && info->pointer_active && !info->pointer_hidden) {
-		mx = info->mouse_x0;
-		my = info->mouse_y0;
-		mx1 = info->mouse_x1;
-		my1 = info->mouse_y1;
-		if (x >= mx && x < mx1) {
-			if ((my >= y0 && my <= y1) || (my1 >= y0 && my1 <= y1) ||
-			    (y0 >= my && y0 <= my1))
-				fbui_hide_pointer (info);
-		}
+	if (win->backing_store) {
+		__fb_vline (info, win->backing_store, win->backing_linelen,
+			x, y0, y1, color);
+		return fbui_backing_show (info, win, x, y0, x, y1);
 	}
 
-	if (info->fbops->fb_vline)
-		info->fbops->fb_vline (info, x, y0, y1, color);
+	if (!info->fbops->fb_vline)
+		return FBUI_SUCCESS;
+
+	if (pointer_overlaps (info, win->x0 + x, win->y0 + y0, 
+	    win->x0 + x, win->y0 + y1))
+		fbui_hide_pointer (info);
+
+	for (i=0; i < win->nclip; i++) {
+		short a=x, b=x, c=y0, d=y1;
+		if (fbui_clip (win, i, &a, &c, &b, &d))
+			info->fbops->fb_vline (info, win->x0 + x, win->y0 + c,
+				win->y0 + d, color);
+	}
 
 	return FBUI_SUCCESS;
 }
@@ -3419,9 +5937,7 @@ static int fbui_draw_rect (struct fb_info *info, struct fbui_window *win,
 		return FBUI_ERR_NULLPTR;
 	if (info->state != FBINFO_STATE_RUNNING) 
 		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
-		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
 	/*----------*/
 
@@ -3449,30 +5965,139 @@ static int fbui_clear_area (struct fb_info *info, struct fbui_window *win,
 }
 
 
-static int fbui_fill_area (struct fb_info *info, struct fbui_window *win, 
+static int fbui_fill_area (struct fb_info *info, struct fbui_window *win,
 	short x0, short y0, short x1, short y1, u32 color)
 {
+	u32 bytes_per_pixel, pixel;
+	unsigned char *base;
 	int i;
 
-	if (!info || !win) 
+	if (!info || !win)
 		return FBUI_ERR_NULLPTR;
-	if (info->state != FBINFO_STATE_RUNNING) 
+	if (info->state != FBINFO_STATE_RUNNING)
 		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (x0>x1) {
+		short tmp=x0; x0=x1; x1=tmp;
+	}
+	if (y0>y1) {
+		short tmp=y0; y0=y1; y1=tmp;
+	}
+	if (x1 < 0 || y1 < 0 || x0 >= win->width || y0 >= win->height)
 		return FBUI_SUCCESS;
-	if (x0>x1) { 
-		short tmp=x0; x0=x1; x1=tmp; 
+	/*----------*/
+
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 >= win->width)
+		x1 = win->width - 1;
+	if (y1 >= win->height)
+		y1 = win->height - 1;
+
+	pixel = pixel_from_rgb (info, color);
+
+	if (win->backing_store) {
+		__fb_fill (info, win->backing_store, win->backing_linelen,
+			x0, y0, x1, y1, pixel);
+		return fbui_backing_show (info, win, x0, y0, x1, y1);
 	}
-	if (y0>y1) { 
-		short tmp=y0; y0=y1; y1=tmp; 
+
+	if (!info->screen_base)
+		return FBUI_SUCCESS;
+
+	if (pointer_overlaps (info, win->x0 + x0, win->y0 + y0,
+	    win->x0 + x1, win->y0 + y1))
+		fbui_hide_pointer (info);
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	base = fbui_screen (info) + win->y0 * info->fix.line_length
+		+ win->x0 * bytes_per_pixel;
+
+	for (i=0; i < win->nclip; i++) {
+		short a=x0, b=x1, c=y0, d=y1;
+		if (!fbui_clip (win, i, &a, &c, &b, &d))
+			continue;
+		__fb_fill (info, base, info->fix.line_length,
+			a, c, b, d, pixel);
+		fbui_shadow_damage (info, win->x0 + a, win->y0 + c,
+			win->x0 + b, win->y0 + d);
 	}
+
+	return FBUI_SUCCESS;
+}
+
+
+/* Blends a color over an area; the top byte of the color is
+ * its transparency, from 0 (opaque) to 255 (invisible).
+ */
+static int fbui_blend_area (struct fb_info *info, struct fbui_window *win,
+	short x0, short y0, short x1, short y1, u32 color)
+{
+	u32 bytes_per_pixel;
+	unsigned char *base;
+	short j;
+	int i;
+
+	if (!info || !win)
+		return FBUI_ERR_NULLPTR;
+	if (info->state != FBINFO_STATE_RUNNING)
+		return FBUI_ERR_NOTRUNNING;
+	if (!win->backing_store && !fbui_onscreen (info, win))
+		return FBUI_SUCCESS;
+	if (x0>x1) {
+		short tmp=x0; x0=x1; x1=tmp;
+	}
+	if (y0>y1) {
+		short tmp=y0; y0=y1; y1=tmp;
+	}
+	if (x1 < 0 || y1 < 0 || x0 >= win->width || y0 >= win->height)
+		return FBUI_SUCCESS;
+	if ((color >> 24) == 255)
+		return FBUI_SUCCESS;
 	/*----------*/
 
-	i = y0;
-	while (i <= y1)
-		fbui_draw_hline (info, win, x0, x1, i++, color);
+	if (x0 < 0)
+		x0 = 0;
+	if (y0 < 0)
+		y0 = 0;
+	if (x1 >= win->width)
+		x1 = win->width - 1;
+	if (y1 >= win->height)
+		y1 = win->height - 1;
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+
+	if (win->backing_store) {
+		base = win->backing_store + x0 * bytes_per_pixel;
+		for (j=y0; j <= y1; j++)
+			__fb_blend_span (info, base + j * win->backing_linelen,
+				NULL, color, x1 - x0 + 1);
+		return fbui_backing_show (info, win, x0, y0, x1, y1);
+	}
+
+	if (!info->screen_base)
+		return FBUI_SUCCESS;
+
+	if (pointer_overlaps (info, win->x0 + x0, win->y0 + y0,
+	    win->x0 + x1, win->y0 + y1))
+		fbui_hide_pointer (info);
+
+	base = fbui_screen (info) + win->y0 * info->fix.line_length
+		+ win->x0 * bytes_per_pixel;
+
+	for (i=0; i < win->nclip; i++) {
+		short a=x0, b=x1, c=y0, d=y1;
+		if (!fbui_clip (win, i, &a, &c, &b, &d))
+			continue;
+		for (j=c; j <= d; j++)
+			__fb_blend_span (info, base + j * info->fix.line_length
+				+ a * bytes_per_pixel, NULL, color, b - a + 1);
+		fbui_shadow_damage (info, win->x0 + a, win->y0 + c,
+			win->x0 + b, win->y0 + d);
+	}
 
 	return FBUI_SUCCESS;
 }
@@ -3484,9 +6109,7 @@ int fbui_clear (struct fb_info *info, struct fbui_window *win)
 		return FBUI_ERR_NULLPTR;
 	if (info->state != FBINFO_STATE_RUNNING) 
 		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
-		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
 	if (win->is_wm)
 		return FBUI_SUCCESS;
@@ -3505,10 +6128,173 @@ int fbui_clear (struct fb_info *info, struct fbui_window *win)
 }
 
 
-static unsigned char leftshift[4] = {
-	24, 16, 8, 0
-};
+/* Index of a character in a font's arrays;
+ * our PCF fonts move [128,159] to the end.
+ */
+static inline int fbui_font_index (struct fbui_font *font, unsigned char ch)
+{
+	ch -= font->first_char;
+	if (ch >= 128 && ch < 160) {
+		ch &= 31;
+		ch |= 240;
+	}
+	else if (ch >= 160)
+		ch -= 32;
+	return ch;
+}
+
+
+/* Makes the window's glyph cache hold the given font, copying the
+ * metrics and bitmaps in from user space once, so that drawing text
+ * needs no further user accesses. Rows are stored as 32 bit words.
+ */
+static int fbui_load_font (struct fb_info *info, struct fbui_window *win,
+	struct fbui_font *font)
+{
+	struct fontdata {
+		unsigned char lefts [256], heights [256], widths [256];
+		unsigned char bitwidths [256], descents [256];
+		unsigned char *bitmaps [256];
+		unsigned char rowbuf [4 * 256];
+	} *m;
+	struct fbui_fontcache *nu;
+	u32 *rows;
+	int ch, c, n, j, total;
+
+	if (!info || !win || !font)
+		return FBUI_ERR_NULLPTR;
+	if (win->fontcache &&
+	    !memcmp (&win->fontcache->font, font, sizeof (struct fbui_font)))
+		return FBUI_SUCCESS;
+	if (font->first_char > font->last_char)
+		return FBUI_ERR_BADPARAM;
+	/*----------*/
 
+	n = 0;
+	for (ch = font->first_char; ch <= font->last_char; ch++) {
+		c = fbui_font_index (font, ch);
+		if (c >= n)
+			n = c + 1;
+	}
+
+	if (!(m = kmalloc (sizeof (struct fontdata), GFP_KERNEL)))
+		return FBUI_ERR_NOMEM;
+
+	if (copy_from_user (m->lefts, font->lefts, n) ||
+	    copy_from_user (m->heights, font->heights, n) ||
+	    copy_from_user (m->widths, font->widths, n) ||
+	    copy_from_user (m->bitwidths, font->bitwidths, n) ||
+	    copy_from_user (m->descents, font->descents, n) ||
+	    copy_from_user (m->bitmaps, font->bitmaps, n * sizeof (char*))) {
+		kfree (m);
+		return FBUI_ERR_BADADDR;
+	}
+
+	total = 0;
+	for (c=0; c < n; c++) {
+		if (!m->bitmaps[c] || !m->bitwidths[c] || m->bitwidths[c] > 32
+		    || !m->heights[c] || !m->widths[c])
+			m->widths[c] = 0;
+		else
+			total += m->heights[c];
+	}
+
+	nu = vmalloc (sizeof (struct fbui_fontcache) + total * sizeof (u32));
+	if (!nu) {
+		kfree (m);
+		return FBUI_ERR_NOMEM;
+	}
+	memset (nu, 0, sizeof (struct fbui_fontcache));
+	nu->font = *font;
+
+	rows = nu->rows;
+	for (ch = font->first_char; ch <= font->last_char; ch++) {
+		struct fbui_glyph *g = &nu->glyphs [ch];
+		int bytes_per_row;
+
+		c = fbui_font_index (font, ch);
+		if (!m->widths[c])
+			continue;
+
+		bytes_per_row = (m->bitwidths[c] + 7) / 8;
+		if (copy_from_user (m->rowbuf, m->bitmaps[c],
+		    bytes_per_row * m->heights[c])) {
+			vfree (nu);
+			kfree (m);
+			return FBUI_ERR_BADADDR;
+		}
+
+		g->width = m->widths[c];
+		g->bitwidth = m->bitwidths[c];
+		g->height = m->heights[c];
+		g->left = m->lefts[c];
+		g->descent = m->descents[c];
+		g->rows = rows;
+
+		for (j=0; j < g->height; j++) {
+			unsigned char *p = m->rowbuf + j * bytes_per_row;
+			u32 bits = 0;
+			int k;
+
+			for (k=0; k < bytes_per_row; k++)
+				bits = (bits << 8) | *p++;
+			*rows++ = bits << (32 - 8 * bytes_per_row);
+		}
+	}
+	kfree (m);
+
+	if (win->fontcache)
+		vfree (win->fontcache);
+	win->fontcache = nu;
+	return FBUI_SUCCESS;
+}
+
+
+/* Draws the set bits of a cached glyph with its top left at x,y,
+ * limited to the box cx0,cy0 - cx1,cy1.
+ */
+static void __fb_glyph (struct fb_info *info, unsigned char *base, u32 linelen,
+	struct fbui_glyph *g, short x, short y,
+	short cx0, short cy0, short cx1, short cy1, u32 pixel)
+{
+	u32 bytes_per_pixel, mask;
+	short i0, i1, j, j1;
+
+	j = cy0 > y ? cy0 - y : 0;
+	j1 = cy1 - y < g->height - 1 ? cy1 - y : g->height - 1;
+	i0 = cx0 > x ? cx0 - x : 0;
+	i1 = cx1 - x < g->bitwidth - 1 ? cx1 - x : g->bitwidth - 1;
+	if (j > j1 || i0 > i1)
+		return;
+
+	mask = 0xffffffff >> i0;
+	if (i1 < 31)
+		mask &= ~(0xffffffff >> (i1 + 1));
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+
+	for ( ; j <= j1; j++) {
+		u32 bits = (g->rows [j] & mask) << i0;
+		unsigned char *ptr = base + (y + j) * linelen
+			+ (x + i0) * bytes_per_pixel;
+
+		while (bits) {
+			if (bits & 0x80000000) {
+				switch (bytes_per_pixel) {
+				case 1:	fb_writeb (pixel, ptr); break;
+				case 2:	fb_writew (pixel, ptr); break;
+				case 4:	fb_writel (pixel, ptr); break;
+				case 3:
+					fb_writeb (pixel, ptr);
+					fb_writeb (pixel >> 8, ptr+1);
+					fb_writeb (pixel >> 16, ptr+2);
+					break;
+				}
+			}
+			bits <<= 1;
+			ptr += bytes_per_pixel;
+		}
+	}
+}
 
 
 /* Returns width of string if > 0, else an error code
@@ -3517,125 +6303,95 @@ static int fbui_draw_string (struct fb_info *info, struct fbui_window *win,
 	struct fbui_font *font,
 	short x, short y, unsigned char *str, u32 color)
 {
-	unsigned char *bitmap, bitwidth, bitheight;
-	short ytop, total_width = 0;
-	short j;
+	struct fbui_fontcache *fc;
+	unsigned char buf [64];
+	unsigned char *base;
+	u32 pixel, bytes_per_pixel;
+	short total_width = 0;
+	short dx0 = 32767, dy0 = 32767, dx1 = -32768, dy1 = -32768;
+	int n, k, i, result, onscreen;
 
 	if (!info || !win || !font || !str)
 		return FBUI_ERR_NULLPTR;
-	if (win->console != info->currcon)
-		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
-	if (info->state != FBINFO_STATE_RUNNING) 
+	if (info->state != FBINFO_STATE_RUNNING)
 		return FBUI_ERR_NOTRUNNING;
-	if (x >= win->width) 
+	if (x >= win->width)
 		return 0;
 	if (y + (font->ascent + font->descent) <= 0)
 		return 0;
-	if (y >= win->height) 
+	if (y >= win->height)
 		return 0;
 	/*----------*/
 
-	while (x < win->width)
-	{
-		char left, descent;
-		unsigned char ch;
-		unsigned char width;
+	if ((result = fbui_load_font (info, win, font)))
+		return result;
+	fc = win->fontcache;
 
-		if (get_user (ch, str))
-			return FBUI_ERR_BADADDR;
-		if (!ch)
-			break;
-		str++;
-
-		if (ch < font->first_char || ch > font->last_char)
-			continue;
-
-		ch -= font->first_char;
-		if (ch >= 128 && ch < 160) {	
-			/* our PCF Fonts move [128,159] to end */
-			ch &= 31;
-			ch |= 240;
-		} 
-		else if (ch >= 160)
-			ch -= 32;
-
-		if (get_user (bitmap, &font->bitmaps[ch])
-		 || get_user (bitwidth, &font->bitwidths[ch])
-		 || get_user (bitheight, &font->heights[ch])
-		 || get_user (width, &font->widths[ch])
-		 || get_user (left, &font->lefts[ch])
-		 || get_user (descent, &font->descents[ch]))
+	pixel = pixel_from_rgb (info, color);
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	base = fbui_screen (info) + win->y0 * info->fix.line_length
+		+ win->x0 * bytes_per_pixel;
+	onscreen = !win->flipping && fbui_onscreen (info, win) && 
+		info->screen_base;
+
+	/* The string is fetched a piece at a time */
+	while (x < win->width) {
+		n = strncpy_from_user ((char*) buf, 
+			(const char __user*) str, sizeof (buf));
+		if (n < 0)
 			return FBUI_ERR_BADADDR;
+		str += n;
+
+		for (k=0; k < n && x < win->width; k++) {
+			struct fbui_glyph *g = &fc->glyphs [buf[k]];
+			short gx, gy;
+
+			if (!g->width)
+				continue;
+
+			gx = x + g->left;
+			gy = y + fc->font.ascent + g->descent - g->height;
+
+			if (win->backing_store)
+				__fb_glyph (info, win->backing_store,
+					win->backing_linelen, g, gx, gy,
+					0, 0, win->width-1, win->height-1, pixel);
+
+			if (onscreen) {
+				if (pointer_overlaps (info, win->x0 + gx, win->y0 + gy,
+				    win->x0 + gx + g->bitwidth - 1,
+				    win->y0 + gy + g->height - 1))
+					fbui_hide_pointer (info);
+
+				for (i=0; i < win->nclip; i++) {
+					struct fbui_cliprect *r = &win->clip [i];
+					__fb_glyph (info, base, info->fix.line_length,
+						g, gx, gy, r->x0, r->y0, r->x1, r->y1,
+						pixel);
+				}
 
-		if (!bitmap || !bitwidth || !bitheight || !width)
-			continue;
-
-		ytop = font->ascent + descent;
-		ytop -= bitheight;
-
-		/* Draw loop */
-		j = 0;
-		while (j < bitheight) 
-		{
-			unsigned long bits;
-			short current_x;
-			short current_y = y + j + ytop;
-			unsigned char datum;
-			unsigned char bytes_per_row;
-
-			bytes_per_row = (bitwidth+7)/8;
-			if (current_y < 0) {
-				bitmap += bytes_per_row;
-				goto ds_inner_skip;
-			}
-			if (current_y >= win->height)
-				break;
-
-			current_x = x + left;
-			bits = 0;
-
-			switch (bytes_per_row) {
-			case 4:
-				if (get_user (datum, bitmap))
-					return FBUI_ERR_BADADDR;
-				bitmap++;
-				bits |= datum;
-			case 3:
-				bits <<= 8;
-				if (get_user (datum, bitmap))
-					return FBUI_ERR_BADADDR;
-				bitmap++;
-				bits |= datum;
-			case 2:
-				bits <<= 8;
-				if (get_user (datum, bitmap))
-					return FBUI_ERR_BADADDR;
-				bitmap++;
-				bits |= datum;
-			case 1:
-				bits <<= 8;
-				if (get_user (datum, bitmap))
-					return FBUI_ERR_BADADDR;
-				bitmap++;
-				bits |= datum;
+				if (gx < dx0) dx0 = gx;
+				if (gy < dy0) dy0 = gy;
+				if (gx + g->bitwidth - 1 > dx1) dx1 = gx + g->bitwidth - 1;
+				if (gy + g->height - 1 > dy1) dy1 = gy + g->height - 1;
 			}
 
-			bits <<= leftshift [bytes_per_row-1];
-
-			fbui_tinyblit (info, win, current_x, current_y, bitwidth, 
-				color, RGB_NOCOLOR, 
-				bits);
-
-ds_inner_skip:
-			j++;
+			x += g->width;
+			total_width += g->width;
 		}
 
-		x += width;
-		total_width += width;
+		if (n < sizeof (buf))
+			break;
+	}
 
-	} /* char loop */
+	for (i=0; i < win->nclip && dx0 <= dx1; i++) {
+		short a=dx0, b=dx1, c=dy0, d=dy1;
+		if (fbui_clip (win, i, &a, &c, &b, &d))
+			fbui_shadow_damage (info, win->x0 + a, win->y0 + c,
+				win->x0 + b, win->y0 + d);
+	}
 
 	return total_width;
 }
@@ -3672,6 +6428,13 @@ static int fbui_set_geometry (struct fb_info *info, struct fbui_window *win,
 		y1=yres-1;
 	/*----------*/
 
+	/* Page flipping needs the window to stay where it is */
+	if (win->flipping) {
+		down (&info->windowSems [win->id]);
+		fbui_flip_end (info, win);
+		up (&info->windowSems [win->id]);
+	}
+
 	w = x1-x0+1;
 	h = y1-y0+1;
 	if (win->max_width && w > win->max_width)
@@ -3683,6 +6446,12 @@ static int fbui_set_geometry (struct fb_info *info, struct fbui_window *win,
 	win->y0 = y0;
 	win->x1 = x0 + w - 1;
 	win->y1 = y0 + h - 1;
+	if (win->want_backing && 
+	    (!win->backing_store || w != win->width || h != win->height)) {
+		win->width = w;
+		win->height = h;
+		fbui_alloc_backing (info, win);
+	}
 	win->width = w;
 	win->height = h;
 /* printk (KERN_INFO "fbui_set_geometry: %s (id=%d) is now at %d %d %d %d , wh = %d %d\n",win->name,win->id,x0,y0,x0+w-1,y0+h-1,w,h); */
@@ -3691,19 +6460,70 @@ static int fbui_set_geometry (struct fb_info *info, struct fbui_window *win,
 }
 
 
-/* Each pixel is 4 bytes, with 4th being transparency (!=0 => 100% transparent)
+/* Returns the window's bounce buffer, grown to at least size bytes,
+ * or NULL if memory is short. A put copies its clipped scanline of
+ * client pixels in here once, so that the converter and each clip
+ * rectangle read kernel memory. The caller holds the window's semaphore.
+ */
+static unsigned char *fbui_bounce (struct fbui_window *win, u32 size)
+{
+	unsigned char *p;
+
+	if (!win || !size)
+		return NULL;
+	/*----------*/
+
+	if (win->bounce_size < size) {
+		size = PAGE_ALIGN(size);
+		if (!(p = kmalloc (size, GFP_KERNEL)))
+			return NULL;
+		if (win->bounce)
+			kfree (win->bounce);
+		win->bounce = p;
+		win->bounce_size = size;
+	}
+	return win->bounce;
+}
+
+
+/* Each pixel is 4 bytes, with 4th being transparency (!=0 => 100% transparent).
+ * Pixels from user space are fetched a piece at a time.
  */
+static void __fb_putpixels_rgb (struct fb_info *info, unsigned char *base,
+	u32 linelen, short x, short y, short n, unsigned long *src, char in_kernel)
+{
+	u32 bytes_per_pixel;
+	unsigned char *ptr;
+	u32 *src2;
+	u32 buf [FBUI_SPANLEN];
+	int k;
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	ptr = base + y * linelen + x * bytes_per_pixel;
+	src2 = (u32*) src;
+
+	if (in_kernel) {
+		info->rgb_span (info, ptr, src2, n);
+		return;
+	}
+
+	while (n > 0) {
+		k = n < FBUI_SPANLEN ? n : FBUI_SPANLEN;
+		if (copy_from_user (buf, src2, k * 4))
+			return;
+		info->rgb_span (info, ptr, buf, k);
+		ptr += k * bytes_per_pixel;
+		src2 += k;
+		n -= k;
+	}
+}
+
 void fb_putpixels_rgb (struct fb_info *info, short x, short y,
 	short n, unsigned long *src, char in_kernel)
 {
-        int offset;
-        u32 bytes_per_pixel;
-        unsigned char *ptr;
-	int i;
-	u32 *src2;
 	short xres, yres;
 
-	if (!info || !src || n<=0) 
+	if (!info || !src || n<=0 || !info->screen_base) 
 		return;
 	if (n <= 0 || y < 0)
 		return;
@@ -3723,183 +6543,164 @@ void fb_putpixels_rgb (struct fb_info *info, short x, short y,
 		n = xres - x;
 	/*----------*/
 
-        bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
-        offset = y * info->fix.line_length + x * bytes_per_pixel;
-        ptr = info->screen_base;
-	if (!ptr) {
-		return;
-	}
-        ptr += offset;
-	
-	src2 = (u32*) src;
-	i=n;
-	while (i > 0) {
-		u32 value;
-		if (in_kernel) {
-			value = *src2++;
-		} else {
-			if (get_user(value, src2)) 
-				return;
-			src2++;
-		}
-
-		/* XX real transparency is for later */
-		if (!(0xff000000 & value)) {
-			value = pixel_from_rgb (info, value);
-
-			switch (bytes_per_pixel)
-			{
-			case 4:
-				fb_writel (value, ptr);
-				ptr += 4;
-				break;
+	__fb_putpixels_rgb (info, fbui_screen (info), info->fix.line_length,
+		x, y, n, src, in_kernel);
+	fbui_shadow_damage (info, x, y, x + n - 1, y);
+}
 
-			case 3:
-				fb_writeb (value, ptr); ptr++; value >>= 8;
-				fb_writeb (value, ptr); ptr++; value >>= 8;
-				fb_writeb (value, ptr); ptr++;
-				break;
+static void __fb_putpixels_native (struct fb_info *info, unsigned char *base,
+	u32 linelen, short x, short y, short n, unsigned char *src, char in_kernel)
+{
+	unsigned char buf [4 * FBUI_SPANLEN];
+	u32 bytes_per_pixel;
+	unsigned char *ptr;
+	int k, length;
 
-			case 2:
-				fb_writew (value, ptr); 
-				ptr += 2;
-				break;
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	ptr = base + y * linelen + x * bytes_per_pixel;
+	length = n * bytes_per_pixel;
 
-			case 1:
-				fb_writeb (value, ptr); 
-				*ptr++ = value;
-				break;
+	if (in_kernel) {
+		memcpy_toio (ptr, src, length);
+		return;
+	}
 
-			default:
-				break;
-			}
-		} else {
-			ptr += bytes_per_pixel;
-		}
-		i--;
+	while (length > 0) {
+		k = length < sizeof (buf) ? length : sizeof (buf);
+		if (copy_from_user (buf, src, k))
+			return;
+		memcpy_toio (ptr, buf, k);
+		ptr += k;
+		src += k;
+		length -= k;
 	}
 }
 
 void fb_putpixels_native (struct fb_info *info, short x,short y,
 	short n, unsigned char *src, char in_kernel)
 {
-        short bytes_per_pixel;
-	u32 offset;
-        unsigned char *ptr;
-	int i;
-
-	if (!info || !src || n<=0) 
+	if (!info || !src || n<=0 || !info->screen_base) 
 		return;
 	/*----------*/
 
-        bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
-        offset = y * info->fix.line_length + x * bytes_per_pixel;
-        ptr = info->screen_base;
-	if (!ptr) 
+	__fb_putpixels_native (info, fbui_screen (info), info->fix.line_length,
+		x, y, n, src, in_kernel);
+	fbui_shadow_damage (info, x, y, x + n - 1, y);
+}
+
+static void __fb_putpixels_rgb3 (struct fb_info *info, unsigned char *base,
+	u32 linelen, short x, short y, short n, unsigned char *src, char in_kernel)
+{
+	u32 bytes_per_pixel;
+	unsigned char *ptr;
+	unsigned char buf [3 * FBUI_SPANLEN];
+	int k;
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	ptr = base + y * linelen + x * bytes_per_pixel;
+
+	if (in_kernel) {
+		info->rgb3_span (info, ptr, src, n);
 		return;
-        ptr += offset;
+	}
 
-	n *= bytes_per_pixel;
-	i=n;
-	while (i > 0) {
-		unsigned char value;
-		if (in_kernel) {
-			value = *src++;
-		} else {
-			if (get_user(value, src)) 
-				return;
-			src++;
-		}
-		fb_writeb (value, ptr); 
-		ptr++;
-		i--;
+	while (n > 0) {
+		k = n < FBUI_SPANLEN ? n : FBUI_SPANLEN;
+		if (copy_from_user (buf, src, k * 3))
+			return;
+		info->rgb3_span (info, ptr, buf, k);
+		ptr += k * bytes_per_pixel;
+		src += 3 * k;
+		n -= k;
 	}
 }
 
 void fb_putpixels_rgb3 (struct fb_info *info, short x,short y,
 	short n, unsigned char *src, char in_kernel)
 {
-        u32 bytes_per_pixel;
-	u8 *src2;
-        int offset;
-        unsigned char *ptr;
-	int i;
-
-	if (!info || !src || n<=0) 
+	if (!info || !src || n<=0 || !info->screen_base) 
 		return;
-	/*----------*/
-
-        bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
-        offset = y * info->fix.line_length + x * bytes_per_pixel;
-        ptr = info->screen_base;
-	if (!ptr)
-		return;
-
-        ptr += offset;
-	
-	src2 = (u8*) src;
-	i=n;
-	while (i > 0) {
-		u32 value;
-		u32 r,g,b;
-		u8 byte;
-		if (in_kernel) {
-			r = *src2++;
-			g = *src2++;
-			b = *src2++;
-		} else {
-			if (get_user(byte, src2)) {
-				return;
-			}
-			src2++;
-			r = byte;
-			if (get_user(byte, src2)) {
-				return;
-			}
-			g = byte;
-			src2++;
-			if (get_user(byte, src2)) {
-				return;
-			}
-			b = byte;
-			src2++;
-		}
+	/*----------*/
 
-		r >>= (8 - info->var.red.length);
-		g >>= (8 - info->var.green.length);
-		b >>= (8 - info->var.blue.length);
-		r <<= info->var.red.offset;
-		g <<= info->var.green.offset;
-		b <<= info->var.blue.offset;
-		value = r | g | b;
+	__fb_putpixels_rgb3 (info, fbui_screen (info), info->fix.line_length,
+		x, y, n, src, in_kernel);
+	fbui_shadow_damage (info, x, y, x + n - 1, y);
+}
 
-		switch (bytes_per_pixel)
-		{
-		case 4:
-			fb_writel (value, ptr);
-			ptr += 4;
-			break;
 
-		case 3:
-			fb_writeb (value, ptr); ptr++; value >>= 8;
-			fb_writeb (value, ptr); ptr++; value >>= 8;
-			fb_writeb (value, ptr); ptr++;
-			break;
+/* Blends source channel s over destination channel d, with s
+ * weighted by a/255, rounding as for a true division by 255.
+ */
+static inline u32 blend8 (u32 d, u32 s, u32 a)
+{
+	u32 t = d * (255 - a) + s * a + 128;
+	return (t + (t >> 8)) >> 8;
+}
 
-		case 2:
-			fb_writew (value, ptr); 
-			ptr += 2;
-			break;
 
-		case 1:
-			fb_writeb (value, ptr); 
-			*ptr++ = value;
-			break;
+/* Blends n RGB pixels over the surface at ptr. The top byte of each
+ * is its transparency: 0 is opaque and 255 invisible. If src is NULL,
+ * every pixel is color. Each piece of the span is read from the
+ * surface in one go, blended in kernel memory and written back,
+ * so video memory sees one burst of reads and one of writes.
+ */
+static void __fb_blend_span (struct fb_info *info, unsigned char *ptr,
+	u32 *src, u32 color, int n)
+{
+	unsigned char buf [4 * FBUI_SPANLEN];
+	u32 bytes_per_pixel;
+	int i, k;
 
-		default:
-			break;
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+
+	while (n > 0) {
+		unsigned char *p = buf;
+
+		k = n < FBUI_SPANLEN ? n : FBUI_SPANLEN;
+		memcpy_fromio (buf, ptr, k * bytes_per_pixel);
+
+		if (info->mode24) {
+			/* Channels are whole bytes: b, g, r */
+			for (i=0; i < k; i++, p += bytes_per_pixel) {
+				u32 v = src ? src [i] : color;
+				u32 a = 255 - (v >> 24);
+				p[0] = blend8 (p[0], v & 0xff, a);
+				p[1] = blend8 (p[1], (v >> 8) & 0xff, a);
+				p[2] = blend8 (p[2], (v >> 16) & 0xff, a);
+			}
+		} else {
+			for (i=0; i < k; i++, p += bytes_per_pixel) {
+				u32 v = src ? src [i] : color;
+				u32 a = 255 - (v >> 24);
+				u32 d = 0;
+
+				if (!a)
+					continue;
+				switch (bytes_per_pixel) {
+				case 1: d = p[0]; break;
+				case 2: d = *(u16*) p; break;
+				case 3: d = p[0] | (p[1] << 8) | (p[2] << 16); break;
+				case 4: d = *(u32*) p; break;
+				}
+				d = pixel_to_rgb (info, d);
+				d = (blend8 (d >> 16, (v >> 16) & 0xff, a) << 16) |
+				    (blend8 ((d >> 8) & 0xff, (v >> 8) & 0xff, a) << 8) |
+				    blend8 (d & 0xff, v & 0xff, a);
+				d = pixel_from_rgb (info, d);
+				switch (bytes_per_pixel) {
+				case 1: p[0] = d; break;
+				case 2: *(u16*) p = d; break;
+				case 3: p[0] = d; p[1] = d >> 8; p[2] = d >> 16; break;
+				case 4: *(u32*) p = d; break;
+				}
+			}
 		}
-		i--;
+
+		memcpy_toio (ptr, buf, k * bytes_per_pixel);
+		ptr += k * bytes_per_pixel;
+		if (src)
+			src += k;
+		n -= k;
 	}
 }
 
@@ -3909,16 +6710,15 @@ static int fbui_put (struct fb_info *info, struct fbui_window *win,
 {
 	u32 length;
 	int bytes_per_pixel;
-	short mx,my;
+	unsigned char *buf;
+	char in_kernel = 0;
 	int i;
 
 	if (!info || !win || !src) 
 		return FBUI_ERR_NULLPTR;
 	if (info->state != FBINFO_STATE_RUNNING) 
 		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
-		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
 
         bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
@@ -3945,51 +6745,57 @@ static int fbui_put (struct fb_info *info, struct fbui_window *win,
 		return FBUI_ERR_BIGENDIAN;
 	/*----------*/
 
-	x += win->x0;
-	y += win->y0;
+	if ((buf = fbui_bounce (win, n * bytes_per_pixel))) {
+		if (copy_from_user (buf, src, n * bytes_per_pixel))
+			return FBUI_ERR_BADADDR;
+		src = buf;
+		in_kernel = 1;
+	}
 
-	if (!info->have_hardware_pointer && info->pointer_active && !info->pointer_hidden) {
-		short mx1,my1;
-		mx = info->mouse_x0;
-		my = info->mouse_y0;
-		mx1 = info->mouse_x1;
-		my1 = info->mouse_y1;
-		if (y >= my && y <= my1) {
-			if ((mx >= x && mx < x+n) || (mx1 >= x && mx1 < x+n)) 
-				fbui_hide_pointer (info);
-		}
+	if (win->backing_store) {
+		__fb_putpixels_native (info, win->backing_store, win->backing_linelen,
+			x, y, n, src, in_kernel);
+		return fbui_backing_show (info, win, x, y, x+n-1, y);
 	}
 
-	if (info->fbops->fb_putpixels_native)
-		info->fbops->fb_putpixels_native (info, x, y, n, src, 0);
+	if (!info->fbops->fb_putpixels_native)
+		return FBUI_SUCCESS;
+
+	if (pointer_overlaps (info, win->x0 + x, win->y0 + y, 
+	    win->x0 + x + n - 1, win->y0 + y))
+		fbui_hide_pointer (info);
+
+	for (i=0; i < win->nclip; i++) {
+		short a=x, b=x+n-1, c=y, d=y;
+		if (fbui_clip (win, i, &a, &c, &b, &d))
+			info->fbops->fb_putpixels_native (info, win->x0 + a, win->y0 + y,
+				b - a + 1, src + (a - x) * bytes_per_pixel, in_kernel);
+	}
 
 	return FBUI_SUCCESS;
 }
 
 
-/* Source data are supposed to be ulong aligned, 
- * and stored as RGBxRGBx... where x is unused.
+/* Source data are 32 bit pixels,
+ * stored as RGBxRGBx... where x is unused.
  *
  * XX perhaps later, transparency would be nice.
  */
 static int fbui_put_rgb (struct fb_info *info, struct fbui_window *win, 
-	short x, short y,short n, unsigned long *src)
+	short x, short y,short n, u32 *src, char in_kernel)
 {
 	u32 length;
-	short mx,my;
-	short mx1,my1;
+	unsigned char *buf;
 	int i;
 
 	if (!info || !win || !src) 
 		return FBUI_ERR_NULLPTR;
 	if (info->state != FBINFO_STATE_RUNNING) 
 		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
-		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
 	length = n << 2; 
-	if (!access_ok (VERIFY_READ,(void*)src, length)) 
+	if (!in_kernel && !access_ok (VERIFY_READ,(void*)src, length)) 
 		return FBUI_ERR_BADADDR;
 	if (x >= win->width || y<0 || y >= win->height || (x+n-1) < 0)
 		return 0;
@@ -4010,22 +6816,32 @@ static int fbui_put_rgb (struct fb_info *info, struct fbui_window *win,
 		return FBUI_ERR_BIGENDIAN;
 	/*----------*/
 
-	x += win->x0;
-	y += win->y0;
+	if (!in_kernel && (buf = fbui_bounce (win, n * 4))) {
+		if (copy_from_user (buf, src, n * 4))
+			return FBUI_ERR_BADADDR;
+		src = (u32*) buf;
+		in_kernel = 1;
+	}
 
-	if (!info->have_hardware_pointer && info->pointer_active && !info->pointer_hidden) {
-		mx = info->mouse_x0;
-		my = info->mouse_y0;
-		mx1 = info->mouse_x1;
-		my1 = info->mouse_y1;
-		if (y >= my && y <= my1) {
-			if ((mx >= x && mx < x+n) || (mx1 >= x && mx1 <= x+n))
-				fbui_hide_pointer (info);
-		}
+	if (win->backing_store) {
+		__fb_putpixels_rgb (info, win->backing_store, win->backing_linelen,
+			x, y, n, (unsigned long*) src, in_kernel);
+		return fbui_backing_show (info, win, x, y, x+n-1, y);
 	}
 
-	if (info->fbops->fb_putpixels_rgb)
-		info->fbops->fb_putpixels_rgb (info, x, y, n, src, 0);
+	if (!info->fbops->fb_putpixels_rgb)
+		return FBUI_SUCCESS;
+
+	if (pointer_overlaps (info, win->x0 + x, win->y0 + y, 
+	    win->x0 + x + n - 1, win->y0 + y))
+		fbui_hide_pointer (info);
+
+	for (i=0; i < win->nclip; i++) {
+		short a=x, b=x+n-1, c=y, d=y;
+		if (fbui_clip (win, i, &a, &c, &b, &d))
+			info->fbops->fb_putpixels_rgb (info, win->x0 + a, win->y0 + y,
+				b - a + 1, (unsigned long*) (src + (a - x)), in_kernel);
+	}
 
 	return FBUI_SUCCESS;
 }
@@ -4039,15 +6855,15 @@ static int fbui_put_rgb3 (struct fb_info *info, struct fbui_window *win,
 	short x,short y, short n, unsigned char *src)
 {
         u32 length;
+	unsigned char *buf;
+	char in_kernel = 0;
 	int i;
 
 	if (!info || !win || !src) 
 		return FBUI_ERR_NULLPTR;
 	if (info->state != FBINFO_STATE_RUNNING) 
 		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
-		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
 	if (!src) 
 		return FBUI_ERR_NULLPTR;
@@ -4074,219 +6890,463 @@ static int fbui_put_rgb3 (struct fb_info *info, struct fbui_window *win,
 		return FBUI_ERR_BIGENDIAN;
 	/*----------*/
 
-	x += win->x0;
-	y += win->y0;
+	if ((buf = fbui_bounce (win, n * 3))) {
+		if (copy_from_user (buf, src, n * 3))
+			return FBUI_ERR_BADADDR;
+		src = buf;
+		in_kernel = 1;
+	}
+
+	if (win->backing_store) {
+		__fb_putpixels_rgb3 (info, win->backing_store, win->backing_linelen,
+			x, y, n, src, in_kernel);
+		return fbui_backing_show (info, win, x, y, x+n-1, y);
+	}
+
+	if (!info->fbops->fb_putpixels_rgb3)
+		return FBUI_SUCCESS;
+
+	if (pointer_overlaps (info, win->x0 + x, win->y0 + y, 
+	    win->x0 + x + n - 1, win->y0 + y))
+		fbui_hide_pointer (info);
+
+	for (i=0; i < win->nclip; i++) {
+		short a=x, b=x+n-1, c=y, d=y;
+		if (fbui_clip (win, i, &a, &c, &b, &d))
+			info->fbops->fb_putpixels_rgb3 (info, win->x0 + a, win->y0 + y,
+				b - a + 1, src + (a - x) * 3, in_kernel);
+	}
+
+	return FBUI_SUCCESS;
+}
+
+
+
+/* Like fbui_put_rgb, but the top byte of each pixel is a
+ * transparency level from 0 (opaque) to 255 (invisible) and
+ * the pixels are blended with what is already in the window.
+ */
+static int fbui_put_rgba (struct fb_info *info, struct fbui_window *win,
+	short x, short y, short n, u32 *src, char in_kernel)
+{
+	u32 buf [FBUI_SPANLEN];
+	u32 bytes_per_pixel;
+	unsigned char *base, *bounce;
+	u32 *span;
+	short k, m;
+	int i;
+
+	if (!info || !win || !src)
+		return FBUI_ERR_NULLPTR;
+	if (info->state != FBINFO_STATE_RUNNING)
+		return FBUI_ERR_NOTRUNNING;
+	if (!win->backing_store && !fbui_onscreen (info, win))
+		return FBUI_SUCCESS;
+	if (!in_kernel && !access_ok (VERIFY_READ, (void*)src, n << 2))
+		return FBUI_ERR_BADADDR;
+	if (x >= win->width || y<0 || y >= win->height || (x+n-1) < 0)
+		return 0;
+	if (x < 0) {
+		n += x;
+		src -= x;
+		x = 0;
+	}
+	if (x+n > win->width)
+		n = win->width - x;
+	if (info->var.red.length > 8 ||
+	    info->var.green.length > 8 ||
+	    info->var.blue.length > 8)
+		return FBUI_ERR_BIGENDIAN;
+	/*----------*/
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+
+	if (!in_kernel && (bounce = fbui_bounce (win, n * 4))) {
+		if (copy_from_user (bounce, src, n * 4))
+			return FBUI_ERR_BADADDR;
+		src = (u32*) bounce;
+		in_kernel = 1;
+	}
 
-	if (!info->have_hardware_pointer && info->pointer_active && !info->pointer_hidden) {
-		short mx,my;
-		short mx1, my1;
-		mx = info->mouse_x0;
-		my = info->mouse_y0;
-		mx1 = info->mouse_x1;
-		my1 = info->mouse_y1;
-		if (y >= my && y <= my1) {
-			if ((mx >= x && mx < x+n) || (mx1 >= x && mx1 <= x+n))
-				fbui_hide_pointer (info);
+	if (win->backing_store) {
+		base = win->backing_store + y * win->backing_linelen
+			+ x * bytes_per_pixel;
+		for (k=0; k < n; k += m) {
+			m = n - k < FBUI_SPANLEN ? n - k : FBUI_SPANLEN;
+			span = src + k;
+			if (!in_kernel) {
+				if (copy_from_user (buf, span, m * 4))
+					return FBUI_ERR_BADADDR;
+				span = buf;
+			}
+			__fb_blend_span (info, base + k * bytes_per_pixel,
+				span, 0, m);
 		}
+		return fbui_backing_show (info, win, x, y, x+n-1, y);
 	}
 
-	if (info->fbops->fb_putpixels_rgb3)
-		info->fbops->fb_putpixels_rgb3 (info, x, y, n, src, 0);
+	if (!info->screen_base)
+		return FBUI_SUCCESS;
+
+	if (pointer_overlaps (info, win->x0 + x, win->y0 + y,
+	    win->x0 + x + n - 1, win->y0 + y))
+		fbui_hide_pointer (info);
+
+	base = fbui_screen (info) + (win->y0 + y) * info->fix.line_length
+		+ win->x0 * bytes_per_pixel;
+
+	for (k=0; k < n; k += m) {
+		m = n - k < FBUI_SPANLEN ? n - k : FBUI_SPANLEN;
+		span = src + k;
+		if (!in_kernel) {
+			if (copy_from_user (buf, span, m * 4))
+				return FBUI_ERR_BADADDR;
+			span = buf;
+		}
+
+		for (i=0; i < win->nclip; i++) {
+			short a=x+k, b=x+k+m-1, c=y, d=y;
+			if (!fbui_clip (win, i, &a, &c, &b, &d))
+				continue;
+			__fb_blend_span (info, base + a * bytes_per_pixel,
+				span + (a - x - k), 0, b - a + 1);
+			fbui_shadow_damage (info, win->x0 + a, win->y0 + y,
+				win->x0 + b, win->y0 + y);
+		}
+	}
 
 	return FBUI_SUCCESS;
 }
 
 
+/* Copies one row of a client image into buf, in a form that 
+ * __fb_image_row can store: RGB24 and native rows as they are,
+ * XRGB32 rows with the top bytes cleared and grayscale rows 
+ * widened to 32 bit RGB. buf must hold w 32 bit pixels plus,
+ * for grayscale, w more bytes.
+ */
+static int fbui_image_row (unsigned char *buf, unsigned char *src,
+	short w, u16 format, u32 bytes_per_pixel)
+{
+	u32 *p = (u32*) buf;
+	unsigned char *g;
+	short i;
+
+	switch (format) {
+	case FBUI_IMAGE_RGB24:
+		return copy_from_user (buf, src, 3 * w) ? FBUI_ERR_BADADDR : 0;
+
+	case FBUI_IMAGE_NATIVE:
+		return copy_from_user (buf, src, w * bytes_per_pixel) ? 
+			FBUI_ERR_BADADDR : 0;
+
+	case FBUI_IMAGE_XRGB32:
+		if (copy_from_user (buf, src, 4 * w))
+			return FBUI_ERR_BADADDR;
+		for (i=0; i < w; i++)
+			p[i] &= 0xffffff;
+		return 0;
+
+	case FBUI_IMAGE_GRAY8:
+		g = buf + 4 * w;
+		if (copy_from_user (g, src, w))
+			return FBUI_ERR_BADADDR;
+		for (i=0; i < w; i++)
+			p[i] = g[i] * 0x10101;
+		return 0;
+	}
+	return FBUI_ERR_BADPARAM;
+}
+
+
+/* Stores n pixels of a row prepared by fbui_image_row at ptr.
+ */
+static inline void __fb_image_row (struct fb_info *info, unsigned char *ptr,
+	unsigned char *buf, short n, u16 format, u32 bytes_per_pixel)
+{
+	switch (format) {
+	case FBUI_IMAGE_RGB24:
+		info->rgb3_span (info, ptr, buf, n);
+		break;
+	case FBUI_IMAGE_NATIVE:
+		memcpy_toio (ptr, buf, n * bytes_per_pixel);
+		break;
+	default:
+		info->rgb_span (info, ptr, (u32*) buf, n);
+	}
+}
+
+
+/* Puts a w by h image whose rows are stride bytes apart in client
+ * memory, in one of the FBUI_IMAGE_* formats. It is clipped to the
+ * window once, and each row is copied in once and then stored for
+ * each visible piece of it.
+ */
+static int fbui_put_image (struct fb_info *info, struct fbui_window *win,
+	short x, short y, short w, short h, unsigned char *src,
+	u16 stride, u16 format)
+{
+	u32 bytes_per_pixel, src_bpp, row_bpp;
+	unsigned char *base, *buf;
+	int i, j, result;
+
+	if (!info || !win || !src)
+		return FBUI_ERR_NULLPTR;
+	if (info->state != FBINFO_STATE_RUNNING)
+		return FBUI_ERR_NOTRUNNING;
+	if (!win->backing_store && !fbui_onscreen (info, win))
+		return FBUI_SUCCESS;
+	if (w <= 0 || h <= 0)
+		return FBUI_SUCCESS;
+
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	switch (format) {
+	case FBUI_IMAGE_RGB24:	src_bpp = 3; break;
+	case FBUI_IMAGE_XRGB32:	src_bpp = 4; break;
+	case FBUI_IMAGE_NATIVE:	src_bpp = bytes_per_pixel; break;
+	case FBUI_IMAGE_GRAY8:	src_bpp = 1; break;
+	default:
+		return FBUI_ERR_BADPARAM;
+	}
+	if (stride < w * src_bpp)
+		return FBUI_ERR_BADPARAM;
+	if (!access_ok (VERIFY_READ, (void*)src, (h - 1) * stride + w * src_bpp))
+		return FBUI_ERR_BADADDR;
+	if (x >= win->width || y >= win->height || x + w <= 0 || y + h <= 0)
+		return FBUI_SUCCESS;
+	if (info->var.red.length > 8 ||
+	    info->var.green.length > 8 ||
+	    info->var.blue.length > 8)
+		return FBUI_ERR_BIGENDIAN;
+	/*----------*/
+
+	if (x < 0) {
+		src += -x * src_bpp;
+		w += x;
+		x = 0;
+	}
+	if (y < 0) {
+		src += -y * stride;
+		h += y;
+		y = 0;
+	}
+	if (x + w > win->width)
+		w = win->width - x;
+	if (y + h > win->height)
+		h = win->height - y;
+
+	if (!(buf = fbui_bounce (win, 5 * w)))
+		return FBUI_ERR_NOMEM;
+
+	if (win->backing_store) {
+		base = win->backing_store + x * bytes_per_pixel;
+		for (j=y; j < y + h; j++, src += stride) {
+			if ((result = fbui_image_row (buf, src, w, format, 
+			    bytes_per_pixel)))
+				return result;
+			__fb_image_row (info, base + j * win->backing_linelen,
+				buf, w, format, bytes_per_pixel);
+		}
+		return fbui_backing_show (info, win, x, y, x+w-1, y+h-1);
+	}
+
+	if (!info->screen_base)
+		return FBUI_SUCCESS;
+
+	if (pointer_overlaps (info, win->x0 + x, win->y0 + y,
+	    win->x0 + x + w - 1, win->y0 + y + h - 1))
+		fbui_hide_pointer (info);
+
+	base = fbui_screen (info) + win->y0 * info->fix.line_length
+		+ win->x0 * bytes_per_pixel;
+	row_bpp = format == FBUI_IMAGE_GRAY8 ? 4 : src_bpp;
+
+	for (j=y; j < y + h; j++, src += stride) {
+		if ((result = fbui_image_row (buf, src, w, format, 
+		    bytes_per_pixel)))
+			return result;
+
+		for (i=0; i < win->nclip; i++) {
+			short a=x, b=x+w-1, c=j, d=j;
+			if (!fbui_clip (win, i, &a, &c, &b, &d))
+				continue;
+			__fb_image_row (info, base + j * info->fix.line_length
+				+ a * bytes_per_pixel,
+				buf + (a - x) * row_bpp,
+				b - a + 1, format, bytes_per_pixel);
+		}
+	}
+
+	fbui_shadow_damage (info, win->x0 + x, win->y0 + y,
+		win->x0 + x + w - 1, win->y0 + y + h - 1);
+	return FBUI_SUCCESS;
+}
+
 
+/* Moves n bytes of video memory. Where source and destination are
+ * apart and equally aligned, whole words are moved directly, or
+ * 32 bit words if they are only that much aligned. Otherwise each
+ * piece is read into kernel memory in one burst and written in
+ * another, taking pieces from whichever end keeps an overlap safe.
+ */
 static void fbui_copy_within (unsigned char *dest, unsigned char *src, u32 n)
 {
-	int dif = dest < src ? src - dest : dest - src;
-	while (n) {
-		if (dif >= 4 && n >= 64 && !(3 & (u32)src) && !(3 & (u32)dest)){
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			fb_writel (fb_readl (src), dest); src+=4; dest+=4;
-			n -= 64;
-		} else {
+	unsigned char buf [4 * FBUI_SPANLEN];
+	u32 k;
+
+	if ((dest + n <= src || src + n <= dest) &&
+	    !((sizeof (long) - 1) & ((unsigned long) src ^ (unsigned long) dest))) {
+		while (n && ((sizeof (long) - 1) & (unsigned long) src)) {
+			fb_writeb (fb_readb (src), dest); src++; dest++;
+			n--;
+		}
+		while (n >= 4 * sizeof (long)) {
+			unsigned long a = fb_readword (src);
+			unsigned long b = fb_readword (src + sizeof (long));
+			unsigned long c = fb_readword (src + 2 * sizeof (long));
+			unsigned long d = fb_readword (src + 3 * sizeof (long));
+			fb_writeword (a, dest);
+			fb_writeword (b, dest + sizeof (long));
+			fb_writeword (c, dest + 2 * sizeof (long));
+			fb_writeword (d, dest + 3 * sizeof (long));
+			src += 4 * sizeof (long);
+			dest += 4 * sizeof (long);
+			n -= 4 * sizeof (long);
+		}
+		while (n >= sizeof (long)) {
+			fb_writeword (fb_readword (src), dest);
+			src += sizeof (long);
+			dest += sizeof (long);
+			n -= sizeof (long);
+		}
+		while (n) {
+			fb_writeb (fb_readb (src), dest); src++; dest++;
+			n--;
+		}
+		return;
+	}
+
+	if ((dest + n <= src || src + n <= dest) &&
+	    !(3 & ((unsigned long) src ^ (unsigned long) dest))) {
+		while (n && (3 & (unsigned long) src)) {
 			fb_writeb (fb_readb (src), dest); src++; dest++;
 			n--;
 		}
+		while (n >= 16) {
+			u32 a = fb_readl (src);
+			u32 b = fb_readl (src + 4);
+			u32 c = fb_readl (src + 8);
+			u32 d = fb_readl (src + 12);
+			fb_writel (a, dest);
+			fb_writel (b, dest + 4);
+			fb_writel (c, dest + 8);
+			fb_writel (d, dest + 12);
+			src += 16;
+			dest += 16;
+			n -= 16;
+		}
+		while (n >= 4) {
+			fb_writel (fb_readl (src), dest);
+			src += 4;
+			dest += 4;
+			n -= 4;
+		}
+		while (n) {
+			fb_writeb (fb_readb (src), dest); src++; dest++;
+			n--;
+		}
+		return;
+	}
+
+	if (dest < src) {
+		while (n) {
+			k = n < sizeof (buf) ? n : sizeof (buf);
+			memcpy_fromio (buf, src, k);
+			memcpy_toio (dest, buf, k);
+			src += k;
+			dest += k;
+			n -= k;
+		}
+	} else {
+		src += n;
+		dest += n;
+		while (n) {
+			k = n < sizeof (buf) ? n : sizeof (buf);
+			src -= k;
+			dest -= k;
+			memcpy_fromio (buf, src, k);
+			memcpy_toio (dest, buf, k);
+			n -= k;
+		}
 	}
 }
 
 
-/* XX Would be nice to be able to halt the copy prematurely when window gets hidden.
+/* Copies a rectangle within the screen or a backing store, one
+ * row per block move. Rows are taken top down or bottom up
+ * according to the direction of the copy; the row moves
+ * themselves are safe for any overlap. A backing store is
+ * system memory, so it is simply memmove'd.
+ *
+ * XX Would be nice to be able to halt the copy prematurely when window gets hidden.
  */
-void fb_copyarea (struct fb_info *info, 
+static void __fb_copyarea (struct fb_info *info, unsigned char *base, u32 linelen,
 		short xsrc,short ysrc,short w, short h, 
 		short xdest,short ydest)
 {
-        u32 bytes_per_pixel, offset, linelen;
-        unsigned char *src;
-        unsigned char *dest;
-	int n;
-
-	if (!info || w<=0 || h<=0)
-		return;
-	/*----------*/
-
-        bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
-        linelen = info->fix.line_length;
-	offset = ysrc * linelen + xsrc * bytes_per_pixel;
-        src = info->screen_base;
-	if (!src) 
-		return;
+	u32 bytes_per_pixel;
+	unsigned char *src;
+	unsigned char *dest;
+	int n, step, in_ram;
 
-        dest = src;
-        src += offset;
-	offset = ydest * linelen + xdest * bytes_per_pixel;
-	dest += offset;
+	bytes_per_pixel = (info->var.bits_per_pixel + 7) >> 3;
+	src = base + ysrc * linelen + xsrc * bytes_per_pixel;
+	dest = base + ydest * linelen + xdest * bytes_per_pixel;
 	n = w * bytes_per_pixel;
+	in_ram = base < (unsigned char*) info->screen_base ||
+		base >= (unsigned char*) info->screen_base + info->fix.smem_len;
 
-	if (ydest < ysrc) {
-		int j=0;
-		while (j < h) {
-			fbui_copy_within (dest,src,n);
-			dest += linelen;
-			src += linelen;
-			j++;
-		}
-	} else
+	step = linelen;
 	if (ydest > ysrc) {
-		int j=h-1;
-		dest += linelen * h;
-		src += linelen * h;
-		while (j >= 0) {
-			dest -= linelen;
-			src -= linelen;
-			fbui_copy_within (dest,src,n);
-			j--;
-		}
-	} else { 
-		/* y equal */
-		int dif = xsrc > xdest ? xsrc-xdest : xdest-xsrc;
-
-		/* leftgoing */
-		if (xdest < xsrc) {
-			int j=0;
-			while (j < h) {
-				register unsigned char *d = dest;
-				register unsigned char *s = src;
-				register int i = w * bytes_per_pixel;
-				while (i) {
-					if (dif>3 && !(3 & (u32) s) && i>3) {
-						u32 v = fb_readl (s); s+= 4;
-						if (!(3 & (u32) d)) {
-							fb_writel (v, d); 
-							d += 4;
-							i -= 4;
-
-							while (i >= 4) {
-								v= fb_readl (s);
-								s += 4;
-								fb_writel(v, d);
-								d += 4;
-								i -= 4;
-							}
-						} else {
-							fb_writeb (v, d); 
-							d++; v >>= 8;
-							fb_writeb (v, d); 
-							d++; v >>= 8;
-							fb_writeb (v, d); 
-							d++; v >>= 8;
-							fb_writeb (v, d); 
-							d++;
-							i -= 4;
-						}
-					} else {
-						fb_writeb (fb_readb (s), d);
-						s++;
-						d++;
-						i--;
-					}
-				}
-				dest += linelen;
-				src += linelen;
-				j++;
-			}
-			
-		} else {
-		/* rightgoing */
-			int j=0;
-			while (j < h) {
-				int i = w * bytes_per_pixel;
-				unsigned char *d = dest + i;
-				unsigned char *s = src + i;
-				while (i) {
-					if (dif>3 && !(3 & (u32) s) && i>3) 
-					{
-						u32 v;
-						s -= 4;
-						v = fb_readl (s);
-						if (!(3 & (u32) d)) {
-							d -= 4;
-							fb_writel (v, d);
-							i -= 4;
-
-							while (i >= 4) {
-								v=fb_readl(s-3);
-								s -= 4;
-								fb_writel(v,d-3); 
-								d -= 4;
-								i -= 4;
-							}
-						} else {
-							d--;
-							fb_writeb (v>>24, d); 
-							d--;
-							fb_writeb (v>>16, d); 
-							d--;
-							fb_writeb (v>>8, d); 
-							d--;
-							fb_writeb (v, d); 
-							i -= 4;
-						}
-					} else {
-						s--;
-						d--;
-						fb_writeb (fb_readb (s), d);
-						i--;
-					}
-				}
-				dest += linelen;
-				src += linelen;
-				j++;
-			}
-		}
+		src += (h-1) * linelen;
+		dest += (h-1) * linelen;
+		step = -step;
 	}
+
+	while (h--) {
+		if (in_ram)
+			memmove (dest, src, n);
+		else
+			fbui_copy_within (dest, src, n);
+		src += step;
+		dest += step;
+	}
+}
+
+void fb_copyarea (struct fb_info *info, 
+		short xsrc,short ysrc,short w, short h, 
+		short xdest,short ydest)
+{
+	if (!info || w<=0 || h<=0 || !info->screen_base)
+		return;
+	/*----------*/
+
+	__fb_copyarea (info, fbui_screen (info), info->fix.line_length,
+		xsrc, ysrc, w, h, xdest, ydest);
+	fbui_shadow_damage (info, xdest, ydest, xdest + w - 1, ydest + h - 1);
 }
 
 int fbui_copy_area (struct fb_info *info, struct fbui_window *win, 
 	short xsrc,short ysrc,short w, short h, short xdest,short ydest)
 {
 	short win_w, win_h;
+	int i;
 
 	if (!info || !win)
 		return FBUI_ERR_NULLPTR;
 	if (info->state != FBINFO_STATE_RUNNING) 
 		return FBUI_ERR_NOTRUNNING;
-	if (win->console != info->currcon)
-		return FBUI_SUCCESS;
-	if (win->is_hidden)
+	if (!win->backing_store && !fbui_onscreen (info, win))
 		return FBUI_SUCCESS;
 	if (xsrc==xdest && ysrc==ydest)
 		return 0;
@@ -4318,16 +7378,49 @@ int fbui_copy_area (struct fb_info *info, struct fbui_window *win,
 		short dif=(ysrc+h) - win_h;
 		h -= dif; 
 	}
-	if ((xdest+w-1) > win_w) { 
+	if ((xdest+w-1) >= win_w) { 
 		short dif=(xdest+w) - win_w;
 		w -= dif; 
 	}
-	if ((ydest+h-1) > win_h) { 
+	if ((ydest+h-1) >= win_h) { 
 		short dif=(ydest+h) - win_h;
 		h -= dif; 
 	}
+	if (w <= 0 || h <= 0)
+		return 0;
 	/*----------*/
 
+	if (win->backing_store) {
+		__fb_copyarea (info, win->backing_store, win->backing_linelen,
+			xsrc, ysrc, w, h, xdest, ydest);
+		return fbui_backing_show (info, win, 
+			xdest, ydest, xdest+w-1, ydest+h-1);
+	}
+
+	/* Pixels can only be moved within one visible piece of the 
+	 * window; otherwise the client is asked to redraw the area.
+	 */
+	for (i=0; i < win->nclip; i++) {
+		struct fbui_cliprect *r = &win->clip [i];
+		if (xsrc >= r->x0 && ysrc >= r->y0 && 
+		    xsrc+w-1 <= r->x1 && ysrc+h-1 <= r->y1 &&
+		    xdest >= r->x0 && ydest >= r->y0 && 
+		    xdest+w-1 <= r->x1 && ydest+h-1 <= r->y1)
+			break;
+	}
+	if (i >= win->nclip) {
+		for (i=0; i < win->nclip; i++) {
+			short a=xdest, b=xdest+w-1, c=ydest, d=ydest+h-1;
+			if (fbui_clip (win, i, &a, &c, &b, &d)) {
+				fbui_add_damage (win, xdest, ydest, 
+					xdest+w-1, ydest+h-1);
+				fbui_send_damage (info, win);
+				break;
+			}
+		}
+		return FBUI_SUCCESS;
+	}
+
 	xsrc += win->x0;
 	ysrc += win->y0;
 	xdest += win->x0;
@@ -75,11 +75,12 @@ static int vesafb_pan_display(struct fb_var_screeninfo *var,
 
 	offset = (var->yoffset * info->fix.line_length + var->xoffset) / 4;
 
+	/* BL=0x80 makes the switch during vertical retrace */
         __asm__ __volatile__(
                 "call *(%%edi)"
                 : /* no return value */
                 : "a" (0x4f07),         /* EAX */
-                  "b" (0),              /* EBX */
+                  "b" ((var->activate & FB_ACTIVATE_VBL) ? 0x80 : 0), /* EBX */
                   "c" (offset),         /* ECX */
                   "d" (offset >> 16),   /* EDX */
                   "D" (&pmi_start));    /* EDI */
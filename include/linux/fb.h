@@ -48,6 +48,8 @@
 #define FBIO_UI_EXEC            0x461b  /* arg = ptr to array of shorts (1st=count) */
 	/* Control commands are _not_ queued and are always executed*/
 #define FBIO_UI_CONTROL		0x461c  /* arg = ptr to fbui_ctrlparams struct */
+	/* Doorbell: drain the window's mmap'd command ring */
+#define FBIO_UI_KICK		0x461d  /* arg = window id */
 #define FBUI_NAMELEN 32
 typedef unsigned long RGB;
 
@@ -82,6 +84,7 @@ struct fbui_openparams {
 	char	need_motion;	/* pointer focus */
 	char	receive_all_motion;	/* supported for window manager only */
 	char	initially_hidden;
+	char	backing_store;	/* keep offscreen copy; exposes served in-kernel */
 	short 	x0;
 	short 	y0;
 	short 	x1;
@@ -134,6 +137,7 @@ struct fbui_ctrlparams {
 	unsigned long	cutpaste_length;
 	struct fbui_event 	*event;	/* passed _out_ */
 	char	string [FBUI_NAMELEN];
+	int	nevents;	/* array size for POLLEVENTS/WAITEVENTS */
 };
 
 #define FBUI_EVENTMASK_KEY	1
@@ -166,6 +170,27 @@ struct fbui_ctrlparams {
 #define FBUI_CUTLENGTH	13
 #define FBUI_SUBTITLE	14
 #define FBUI_SETFONT	15
+#define FBUI_POLLEVENTS	16	/* up to nevents events into event[] */
+#define FBUI_WAITEVENTS	17
+#define FBUI_DOUBLEBUFFER	18	/* x: 1 => begin, 0 => end */
+#define FBUI_PRESENT	19	/* show what was drawn since last present */
+#define FBUI_GETCAPS	20	/* returns FBUI_CMD_VERSION | FBUI_CAP_* */
+#define FBUI_LOADCURSOR	21	/* width x height pixels at pointer, hot spot
+				   at x,y; returns a handle */
+#define FBUI_SETCURSOR	22	/* x: handle for this window, 0 => default */
+#define FBUI_CURSORMAX	64	/* largest pointer width or height */
+
+/* Command encoding version, and what the kernel supports */
+#define FBUI_CMD_VERSION	2
+#define FBUI_CAP_WIDE		0x100
+#define FBUI_CAP_INLINE		0x200
+#define FBUI_CAP_RING		0x400
+#define FBUI_CAP_DOUBLEBUFFER	0x800
+#define FBUI_CAP_BITBLIT	0x1000
+#define FBUI_CAP_PUTIMAGE	0x2000
+#define FBUI_CAP_CURSOR		0x4000
+
+#define FBUI_MAXEVENTSPERBATCH 16
 
 #define FBUI_CTL_TAKESWIN 32
 /* Numbers >= FBUI_CTL_TAKESWIN take a window argument */
@@ -176,6 +201,7 @@ struct fbui_ctrlparams {
 #define FBUI_ASSIGN_KEYFOCUS	(FBUI_CTL_TAKESWIN+5)	/* wm only */
 #define FBUI_ASSIGN_PTRFOCUS	(FBUI_CTL_TAKESWIN+7)	/* wm only */
 #define FBUI_MOVE_RESIZE	(FBUI_CTL_TAKESWIN+6)	/* wm only */
+#define FBUI_RAISE	(FBUI_CTL_TAKESWIN+8)	/* wm only */
 
 /* FBUI font weight */
 #define FB_FONTWEIGHT_LIGHT (0)
@@ -221,7 +247,7 @@ struct fbui_font {
 
 /* FBUI event types. Events are 31-bit values; type is lower 4 bits */
 #define FBUI_EVENT_NONE 	0
-#define FBUI_EVENT_EXPOSE 	1
+#define FBUI_EVENT_EXPOSE 	1	/* x,y,width,height: area; width 0 => all */
 #define FBUI_EVENT_HIDE 	2
 #define FBUI_EVENT_UNHIDE 	3
 #define FBUI_EVENT_ENTER 	4	/* future... mouse pointer enter */
@@ -230,7 +256,7 @@ struct fbui_font {
 #define FBUI_EVENT_MOVE_RESIZE	7	/* window was moved by wm */
 #define FBUI_EVENT_ACCEL 	8	/* keyboard accelerator (Alt-) key */
 #define FBUI_EVENT_WINCHANGE 	9	/* recv'd only by window manager */
-#define FBUI_EVENT_MOTION	10	/* mouse pointer moved */
+#define FBUI_EVENT_MOTION	10	/* mouse pointer moved; key = #samples merged */
 #define FBUI_EVENT_BUTTON	11	/* mouse button activity */
 
 /* FBUI queued commands: for use with FBIO_UI_EXEC ioctl */
@@ -250,6 +276,59 @@ struct fbui_font {
 #define FBUI_PUTRGB3 	13
 #define FBUI_CLEARAREA 	14
 #define FBUI_TINYBLIT	15
+#define FBUI_PUTRGBA 	16	/* top byte: transparency, 0-255 */
+#define FBUI_BLENDAREA 	17	/* ditto */
+#define FBUI_BITBLIT 	18	/* 1 bpp, rows padded to bytes */
+#define FBUI_PUTRGBINLINE	19	/* pixels follow in the command stream */
+#define FBUI_PUTRGBAINLINE	20	/* ditto */
+#define FBUI_PUTIMAGE	21	/* rectangle, FBUI_IMAGE_* format */
+
+/* Source formats for FBUI_PUTIMAGE */
+#define FBUI_IMAGE_RGB24	0	/* bytes R,G,B */
+#define FBUI_IMAGE_XRGB32	1	/* 32 bit 0xRRGGBB, top byte ignored */
+#define FBUI_IMAGE_NATIVE	2	/* the framebuffer's own format */
+#define FBUI_IMAGE_GRAY8	3	/* one byte of gray */
+
+/* Flag in a command word: each user pointer in the command takes
+ * four words, low first, rather than two. Needed by 64 bit clients.
+ */
+#define FBUI_WIDE	0x8000
+
+/* Shared command ring, one per window. Mapped by the client with
+ * mmap(2) at page offset FBUI_RING_PGOFF + window id, length
+ * sizeof(struct fbui_ring). The client appends commands in the
+ * same format as for FBIO_UI_EXEC at data[head % FBUI_RING_WORDS]
+ * and then advances head; the kernel consumes from tail. Indices
+ * are free-running. If busy is clear after head is advanced,
+ * the client must issue FBIO_UI_KICK.
+ */
+#define FBUI_RING_WORDS 4096	/* must be a power of 2 */
+#define FBUI_RING_PGOFF 0x40000
+
+struct fbui_ring {
+	volatile __u32	head;	/* written by client only */
+	volatile __u32	tail;	/* written by kernel only */
+	volatile __u32	busy;	/* nonzero while kernel is draining */
+	__u32	reserved;
+	unsigned short	data [FBUI_RING_WORDS];
+};
+
+/* Event ring, one per process. Mapped by the client with mmap(2)
+ * at page offset FBUI_EVENTS_PGOFF + the id of any of its windows,
+ * length sizeof(struct fbui_eventring) plus size events, rounded
+ * up to a page. The kernel appends at events[head % size] and then
+ * advances head; the client takes events from tail and then advances
+ * it. Indices are free-running. The client writes only tail.
+ */
+#define FBUI_EVENTS_PGOFF 0x50000
+
+struct fbui_eventring {
+	volatile __u32	head;	/* written by kernel only */
+	volatile __u32	tail;	/* written by the reader only */
+	__u32	size;		/* events in the ring, a power of 2 */
+	__u32	reserved;
+	struct fbui_event	events [0];
+};
 
 /* FBUI ioctl return values */
 #define FBUI_SUCCESS 0
@@ -285,6 +364,8 @@ struct fbui_font {
 #define FBUI_ERR_DRAWING -225
 #define FBUI_ERR_MISSINGPROCENT -224
 #define FBUI_ERR_BADVC -223
+#define FBUI_ERR_NORING -222
+#define FBUI_ERR_NOTFLIPPING -221
 
 /* ==========================================================================*/
 
@@ -588,6 +669,7 @@ struct vm_area_struct;
 struct fb_info;
 struct device;
 struct file;
+struct poll_table_struct;
 
 /* Definitions below are used in the parsed monitor specs */
 #define FB_DPMS_ACTIVE_OFF	1
@@ -746,6 +828,49 @@ struct fb_pixmap {
 
 
 /*=====================================================*/
+#define FBUI_MAXDAMAGE 4
+
+/* Kernel copy of one glyph of a client's font */
+struct fbui_glyph {
+	unsigned char	width;		/* advance; 0 => not drawable */
+	unsigned char	bitwidth;
+	unsigned char	height;
+	char		left;
+	char		descent;
+	u32		*rows;		/* leftmost pixel in bit 31 */
+};
+
+/* A window's glyph cache, made the first time a font is used.
+ * The client's fbui_font struct, with its user pointers, is
+ * the key: a different struct means a different font.
+ */
+struct fbui_fontcache {
+	struct fbui_font	font;
+	struct fbui_glyph	glyphs [256];	/* by character code */
+	u32			rows [0];
+};
+
+/* A pointer shape loaded with FBUI_LOADCURSOR, in the form taken by
+ * FBUI_PUTRGBA, with a copy in the framebuffer's own format.
+ */
+struct fbui_cursor {
+	short	width, height;
+	short	hot_x, hot_y;
+	struct fbui_processentry *owner; /* which loaded it, or NULL */
+	unsigned char	*native;
+	u32	argb [0];
+};
+
+/* Memory a client maps with mmap(2). It is freed when its holder
+ * and the last mapping of it have both let go, so no mapping can
+ * fault in pages that were freed or handed to someone else.
+ */
+struct fbui_shared {
+	atomic_t	count;
+	unsigned long	size;	/* page aligned */
+	void		*addr;	/* vmalloc'd */
+};
+
 struct fbui_window { 
 	short	id;		/* window id */
 	int 	pid; 		/* process id */
@@ -770,8 +895,36 @@ struct fbui_window {
 	unsigned int need_motion : 1;
 	unsigned int receive_all_motion : 1;
 	unsigned int font_valid : 1;
+	unsigned int want_backing : 1;
+	unsigned int flipping : 1;	/* drawing goes to a back buffer */
+	unsigned int flip_want_backing : 1; /* want_backing before flipping */
+
+	unsigned char *backing_store; /* offscreen copy of window, or NULL */
+	u32	backing_linelen;
+
+	struct fbui_ring *ring;	/* mapped command ring, or NULL */
+	struct fbui_shared *ringmem;	/* which holds it */
+
+	unsigned char *bounce;	/* client pixels copied in by a put */
+	u32	bounce_size;
+
+	/* window-relative areas not yet reported in Expose events */
+	short	ndamage;
+	struct fbui_damage { short x0, y0, x1, y1; } damage [FBUI_MAXDAMAGE];
+
+	/* Stacking position; higher is nearer the viewer. The wm is 
+	 * always at the bottom. The visible region is kept as a list
+	 * of window-relative rectangles, updated when any window on the
+	 * console is opened, closed, moved, hidden or restacked.
+	 */
+	int	z;
+	short	nclip;
+	struct fbui_cliprect { short x0, y0, x1, y1; } *clip;
 
 	struct fbui_font font;	/* default font, used if font ptr NULL */
+	struct fbui_fontcache *fontcache;
+
+	short	cursor;		/* pointer shape handle, or 0 */
 
 	struct fbui_processentry *processentry;
 
@@ -791,6 +944,11 @@ extern int fbui_exec (struct fb_info *info, short win_id, short n, unsigned char
 extern int fbui_control (struct fb_info *info, struct fbui_ctrlparams*);
 extern int fbui_open (struct fb_info *info, struct fbui_openparams*);
 extern int fbui_close (struct fb_info *info, short);
+extern int fbui_kick (struct fb_info *info, short);
+extern int fbui_mmap (struct fb_info *info, struct file *file, 
+	struct vm_area_struct *vma);
+extern unsigned int fbui_poll (struct fb_info *info, struct file *file, 
+	struct poll_table_struct *wait);
 
 extern void fb_clear (struct fb_info *, u32);
 extern void fb_point (struct fb_info *, short,short, u32, char);
@@ -818,18 +976,18 @@ struct fbui_processentry {
 	unsigned short	wait_event_mask;
 
 #define FBUI_MAXEVENTSPERPROCESS (CONFIG_FB_UI_EVENTQUEUELEN)
-	struct fbui_event events [FBUI_MAXEVENTSPERPROCESS];
-	short	events_head;
-	short	events_tail;
-	short	events_pending;
-	spinlock_t queuelock;
-	struct semaphore queuesem;
+#define FBUI_RESERVEDEVENTS (FBUI_MAXEVENTSPERPROCESS/4) /* not for motion */
+	struct fbui_eventring *evring;	/* shared with the process */
+	struct fbui_shared *evmem;	/* which holds it */
+	u32	events_head;	/* the kernel's own copy of evring->head */
+	spinlock_t queuelock;	/* between producers only */
 };
 
 #define FBUI_MAXCONSOLES 12
 #define FBUI_TOTALACCELS 128
 #define FBUI_MAXINCOMINGKEYS 32
 #define FBUI_CUTPASTE_LIMIT 0x10000
+#define FBUI_MAXCURSORS 32
 #define FBUI_MAXWINDOWSPERVC (CONFIG_FB_UI_WINDOWSPERVC)
 
 
@@ -981,6 +1139,12 @@ struct fb_info {
 	unsigned char	redsize, greensize, bluesize;
 	unsigned char	redshift, greenshift, blueshift;
 
+	/* RGB to native pixel conversion, and the routines that store
+	 * spans of RGB pixels for this depth; set up by fbui_init */
+	u32	red_lut [256], green_lut [256], blue_lut [256];
+	void	(*rgb_span) (struct fb_info *, unsigned char *, u32 *, int);
+	void	(*rgb3_span) (struct fb_info *, unsigned char *, unsigned char *, int);
+
 	struct fbui_window 	*window_managers [FBUI_MAXCONSOLES];
 	struct fbui_window 	*windows [FBUI_MAXCONSOLES * FBUI_MAXWINDOWSPERVC];
 	struct rw_semaphore 	winptrSem;
@@ -996,16 +1160,39 @@ struct fb_info {
 	unsigned char	force_placement [FBUI_MAXCONSOLES];
 	struct tty_struct 	*ttysave [FBUI_MAXCONSOLES];
 	struct fbui_window 	*pointer_window [FBUI_MAXCONSOLES];
+	int		ztop [FBUI_MAXCONSOLES]; /* highest z given out */
 	unsigned int	pointer_active : 1;
 	unsigned int	pointer_hidden : 1;
-	unsigned int 	have_hardware_pointer: 1;
+	unsigned int 	have_hardware_pointer: 1; /* via fbops->fb_cursor */
+	unsigned int	hw_pointer_shown : 1;
 	unsigned int	mode24 : 1;
 	short		curr_mouse_x, curr_mouse_y; /* <--primary */
-	short		mouse_x0, mouse_y0, mouse_x1, mouse_y1;
+	short		mouse_x0, mouse_y0; /* where pointer is drawn */
+	struct timer_list	pointer_timer;	/* shows it after drawing */
+	spinlock_t	pointer_lock;	/* between it and drawing starting */
+
+	/* pointer shapes by handle - 1; the one being shown */
+	struct fbui_cursor	*cursors [FBUI_MAXCURSORS];
+	struct fbui_cursor	*pointer_default, *pointer_shape;
+	struct fbui_cursor	*hw_pointer_shape; /* last sent to fb_cursor */
 
 	struct rw_semaphore	cutpaste_sem;
 	unsigned char	*cutpaste_buffer;
 	u32	cutpaste_length;
+
+	/* system memory copy of the screen that fbui draws into, or
+	 * NULL; dirty areas are copied to screen_base by fbui_shadow_flush */
+	unsigned char	*shadow;
+	spinlock_t	shadow_lock;
+	struct timer_list	shadow_timer;
+	short		nshadow_dirty;
+	struct fbui_damage	shadow_dirty [FBUI_MAXDAMAGE];
+
+	/* the full-screen window drawing into a hidden page, or NULL;
+	 * byte offsets from screen_base of the shown and hidden pages */
+	struct fbui_window	*flip_window;
+	u32		front_offset;
+	u32		back_offset;
 #endif
 
 	/* From here on everything is device dependent */
@@ -0,0 +1,321 @@
+/*=========================================================================
+ *
+ * fbbench, a benchmark for the FBUI (in-kernel framebuffer UI) drawing code
+ * Copyright (C) 2004 Zachary T Smith, fbui@comcast.net
+ *
+ * This module is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this module; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * (See the file COPYING in the main directory of this archive for
+ * more details.)
+ *
+ *=======================================================================*/
+
+
+/* Userspace stand-ins for the kernel interfaces that fbui.c uses, so
+ * that its drawing code can be compiled into a normal program. Only
+ * the drawing paths are expected to work; locking, scheduling, tasks
+ * and consoles are no-ops, and user copies are plain memory copies.
+ * Every <linux/...> and <asm/...> header that fbui.c, fb.h and input.h
+ * include, other than those two, is made by the Makefile to include
+ * this file.
+ */
+
+#ifndef _FBBENCH_KERNEL_H
+#define _FBBENCH_KERNEL_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+typedef signed char s8;
+typedef short s16;
+typedef int s32;
+typedef long long s64;
+typedef u8 __u8;
+typedef u16 __u16;
+typedef u32 __u32;
+typedef u64 __u64;
+typedef s8 __s8;
+typedef s16 __s16;
+typedef s32 __s32;
+typedef s64 __s64;
+
+#define __user
+#define __iomem
+#define __init
+#define __exit
+#define __devinit
+
+#define likely(x) (x)
+#define unlikely(x) (x)
+#define barrier() __asm__ __volatile__("" ::: "memory")
+#define mb() __sync_synchronize()
+#define rmb() mb()
+#define wmb() mb()
+#define smp_mb() mb()
+#define smp_rmb() mb()
+#define smp_wmb() mb()
+#define cmpxchg(p,o,n) __sync_val_compare_and_swap(p,o,n)
+#if __SIZEOF_LONG__ == 8
+#define BITS_PER_LONG 64
+#else
+#define BITS_PER_LONG 32
+#endif
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+
+/* fb.h declares this array of a type it defines later */
+#define vesa_modes *fbbench_vesa_modes
+
+/* printk */
+#define KERN_INFO ""
+#define KERN_ERR ""
+#define KERN_WARNING ""
+#define KERN_DEBUG ""
+#define printk(...) ({ 0; })
+
+/* Memory */
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 1
+#define PAGE_SIZE 4096UL
+#define PAGE_SHIFT 12
+#define PAGE_ALIGN(x) (((x)+PAGE_SIZE-1) & ~(PAGE_SIZE-1))
+struct page { int flags; };
+#define SetPageReserved(p) ((p)->flags |= 1)
+#define ClearPageReserved(p) ((p)->flags &= ~1)
+static struct page fbbench_page;
+static inline void *kmalloc (size_t n, int flags) { return malloc (n); }
+static inline void kfree (const void *p) { free ((void*) p); }
+static inline void *vmalloc (unsigned long n) { return malloc (n); }
+static inline void vfree (void *p) { free (p); }
+static inline int get_order (unsigned long n)
+{
+	int order = 0;
+	while ((PAGE_SIZE << order) < n)
+		order++;
+	return order;
+}
+static inline unsigned long __get_free_pages (int flags, unsigned int order)
+{
+	return (unsigned long) malloc (PAGE_SIZE << order);
+}
+static inline void free_pages (unsigned long p, unsigned int order)
+{
+	free ((void*) p);
+}
+static inline struct page *virt_to_page (const void *p) { return &fbbench_page; }
+static inline struct page *vmalloc_to_page (void *p) { return &fbbench_page; }
+static inline void get_page (struct page *p) { }
+static inline unsigned long virt_to_phys (volatile void *p) { return (unsigned long) p; }
+#define __pa(x) virt_to_phys((void*)(x))
+
+/* User space is our own space */
+#define VERIFY_READ 0
+#define VERIFY_WRITE 1
+#define access_ok(t,p,n) 1
+#define get_user(x,p) ((x) = *(p), 0)
+#define __get_user(x,p) ((x) = *(p), 0)
+#define put_user(x,p) (*(p) = (x), 0)
+#define __put_user(x,p) (*(p) = (x), 0)
+static inline unsigned long copy_from_user (void *to, const void *from, unsigned long n)
+{
+	memcpy (to, from, n);
+	return 0;
+}
+static inline unsigned long copy_to_user (void *to, const void *from, unsigned long n)
+{
+	memcpy (to, from, n);
+	return 0;
+}
+#define __copy_from_user copy_from_user
+#define __copy_to_user copy_to_user
+static inline long strncpy_from_user (char *to, const char *from, long n)
+{
+	long i;
+	for (i=0; i < n; i++)
+		if (!(to[i] = from[i]))
+			break;
+	return i;
+}
+
+/* I/O memory is system memory */
+#define __raw_readb(a) (*(volatile u8*)(a))
+#define __raw_readw(a) (*(volatile u16*)(a))
+#define __raw_readl(a) (*(volatile u32*)(a))
+#define __raw_readq(a) (*(volatile u64*)(a))
+#define __raw_writeb(v,a) (*(volatile u8*)(a) = (v))
+#define __raw_writew(v,a) (*(volatile u16*)(a) = (v))
+#define __raw_writel(v,a) (*(volatile u32*)(a) = (v))
+#define __raw_writeq(v,a) (*(volatile u64*)(a) = (v))
+#define memset_io(a,b,c) memset((void*)(a),b,c)
+#define memcpy_toio(a,b,c) memcpy((void*)(a),b,c)
+#define memcpy_fromio(a,b,c) memcpy(a,(void*)(b),c)
+
+/* Atomics and locks: the benchmark is single threaded */
+typedef struct { volatile int counter; } atomic_t;
+#define ATOMIC_INIT(i) { (i) }
+#define atomic_read(v) ((v)->counter)
+#define atomic_set(v,i) ((v)->counter = (i))
+#define atomic_inc(v) ((v)->counter++)
+#define atomic_dec(v) ((v)->counter--)
+#define atomic_dec_and_test(v) (--(v)->counter == 0)
+typedef struct { int lock; } spinlock_t;
+#define SPIN_LOCK_UNLOCKED (spinlock_t) { 0 }
+#define spin_lock_init(l) ((l)->lock = 0)
+#define spin_lock(l) ((void)(l))
+#define spin_unlock(l) ((void)(l))
+#define spin_lock_irqsave(l,f) ((f) = 0, (void)(l))
+#define spin_unlock_irqrestore(l,f) ((void)(f), (void)(l))
+#define local_irq_save(f) ((f) = 0)
+#define local_irq_restore(f) ((void)(f))
+#define read_lock(x) ((void)0)
+#define read_unlock(x) ((void)0)
+#define read_lock_irq(x) ((void)(x))
+#define read_unlock_irq(x) ((void)(x))
+struct semaphore { int count; };
+struct rw_semaphore { int count; };
+#define down(s) ((void)(s))
+#define up(s) ((void)(s))
+#define down_trylock(s) 0
+#define down_interruptible(s) 0
+#define init_MUTEX(s) ((s)->count = 1)
+#define sema_init(s,n) ((s)->count = (n))
+#define down_read(s) ((void)(s))
+#define up_read(s) ((void)(s))
+#define down_write(s) ((void)(s))
+#define up_write(s) ((void)(s))
+#define down_read_trylock(s) 1
+#define down_write_trylock(s) 1
+#define init_rwsem(s) ((s)->count = 0)
+
+/* Waiting, timers, scheduling */
+typedef struct { int x; } wait_queue_head_t;
+#define init_waitqueue_head(q) ((void)(q))
+#define wait_event_interruptible(q,cond) ({ 0; })
+#define wake_up(q) ((void)(q))
+#define wake_up_interruptible(q) ((void)(q))
+struct timer_list {
+	unsigned long expires;
+	unsigned long data;
+	void (*function) (unsigned long);
+};
+#define init_timer(t) ((void)(t))
+#define add_timer(t) ((void)(t))
+#define mod_timer(t,e) ({ 0; })
+#define del_timer(t) ({ 0; })
+#define del_timer_sync(t) ({ 0; })
+#define timer_pending(t) 0
+static volatile unsigned long jiffies;
+#define HZ 100
+#define time_after(a,b) ((long)(b) - (long)(a) < 0)
+#define time_before(a,b) time_after(b,a)
+#define udelay(n) ((void)(n))
+#define mdelay(n) ((void)(n))
+#define msleep(n) ((void)(n))
+#define schedule() ((void)0)
+#define signal_pending(t) 0
+
+/* Tasks */
+struct task_struct { int pid; char comm [16]; };
+static struct task_struct fbbench_task;
+#define current (&fbbench_task)
+#define find_task_by_pid(pid) ((struct task_struct*) 0)
+struct pid { int nr; };
+#define PIDTYPE_PID 0
+#define find_pid(type,nr) ((struct pid*) 0)
+static int tasklist_lock;
+
+/* Files, memory maps, polling */
+struct inode { int x; };
+struct file { void *private_data; unsigned int f_flags; };
+struct vm_operations_struct;
+struct vm_area_struct {
+	unsigned long vm_start, vm_end, vm_pgoff, vm_flags;
+	unsigned long vm_page_prot;
+	struct vm_operations_struct *vm_ops;
+	void *vm_private_data;
+	struct file *vm_file;
+};
+struct vm_operations_struct {
+	void (*open) (struct vm_area_struct *);
+	void (*close) (struct vm_area_struct *);
+	struct page *(*nopage) (struct vm_area_struct *, unsigned long, int *);
+};
+#define NOPAGE_SIGBUS ((struct page*) 0)
+#define VM_FAULT_MINOR 1
+#define VM_WRITE 2
+#define VM_SHARED 8
+#define VM_MAYWRITE 0x20
+#define VM_IO 0x4000
+#define VM_RESERVED 0x80000
+#define remap_page_range(v,a,p,n,f) 0
+typedef struct poll_table_struct { int x; } poll_table;
+#define poll_wait(f,q,p) ((void)0)
+#define POLLIN 1
+#define POLLOUT 4
+#define POLLERR 8
+#define POLLHUP 16
+#define POLLRDNORM 0x40
+#define POLLWRNORM 0x100
+#define DEFAULT_POLLMASK (POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM)
+
+/* Devices, modules, lists */
+struct list_head { struct list_head *next, *prev; };
+#define INIT_LIST_HEAD(l) ((l)->next = (l)->prev = (l))
+struct work_struct { int x; };
+struct notifier_block { int x; };
+struct device { int x; };
+struct class_device { int x; };
+struct module { int x; };
+#define THIS_MODULE ((struct module*) 0)
+#define EXPORT_SYMBOL(x) extern int fbbench_ksym_##x
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+#define module_init(x) extern int fbbench_init
+#define module_exit(x) extern int fbbench_exit
+
+/* Consoles: there is only one, and it is in graphics mode */
+struct tty_struct { int x; };
+struct vc_data { int vc_num; struct tty_struct *vc_tty; };
+struct vc { struct vc_data *d; };
+struct vt_struct { int vc_num; int vc_mode; };
+#define KD_TEXT 0
+#define KD_GRAPHICS 1
+#define MAX_NR_CONSOLES 63
+static struct vt_struct fbbench_vt = { 0, KD_GRAPHICS };
+static struct vt_struct *vt_cons [MAX_NR_CONSOLES] = { &fbbench_vt };
+static struct vc vc_cons [MAX_NR_CONSOLES];
+#define vc_cons_allocated(n) ((n) == 0)
+#define vc_allocate(n) 0
+#define acquire_console_sem() ((void)0)
+#define release_console_sem() ((void)0)
+#define do_unblank_screen(n) ((void)0)
+#define do_blank_screen(n) ((void)0)
+#define redraw_screen(a,b) ((void)0)
+
+/* Provided by fbui-input.c */
+#define fbui_input_register_handler(...) ({ 0; })
+
+#endif
@@ -0,0 +1,566 @@
+/*=========================================================================
+ *
+ * fbbench, a benchmark for the FBUI (in-kernel framebuffer UI) drawing code
+ * Copyright (C) 2004 Zachary T Smith, fbui@comcast.net
+ *
+ * This module is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This module is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this module; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ *
+ * (See the file COPYING in the main directory of this archive for
+ * more details.)
+ *
+ *=======================================================================*/
+
+/* fbbench compiles the kernel's fbui.c into a userspace program and
+ * runs its drawing primitives against a framebuffer in malloc'd memory,
+ * at 8, 16, 24 and 32 bits per pixel. Each case is run a fixed number
+ * of times, so that the results, including the checksum of the
+ * framebuffer afterward, can be compared from one build to the next.
+ *
+ * Usage: fbbench [-q] [-s] [-d bpp] [primitive ...]
+ *	-q	quick run, 1/8 as many calls
+ *	-s	draw into a shadow framebuffer, flushing it after each call
+ *	-d bpp	only benchmark the given depth
+ */
+
+#include <time.h>
+
+#include "fbui.c"
+
+#define XRES 1280
+#define YRES 1024
+
+/* Each case draws about this many pixels in all */
+#define PIXEL_BUDGET (64 * 1024 * 1024)
+
+static long budget = PIXEL_BUDGET;
+static int use_shadow;
+
+static struct fb_info *info;
+static struct fbui_window *win;
+
+/* The pixel puts that vesafb provides, for window puts to use */
+static struct fb_ops ops = {
+	.fb_putpixels_native = fb_putpixels_native,
+	.fb_putpixels_rgb = fb_putpixels_rgb,
+	.fb_putpixels_rgb3 = fb_putpixels_rgb3,
+};
+static struct fbui_font font;
+
+/* fbui.c reads RGB pixels as 32 bit words */
+static u32 rgb_src [XRES];
+static u32 rgba_src [XRES];
+static unsigned char rgb3_src [3 * XRES];
+static unsigned char bitmap_src [XRES / 8 * 16];
+static unsigned char string [64];
+
+struct depth {
+	int bpp;
+	int rlen, glen, blen;
+	int roff, goff, boff;
+};
+
+static struct depth depths[] = {
+	{ 8,  3, 3, 2,  5, 2, 0 },
+	{ 16, 5, 6, 5,  11, 5, 0 },
+	{ 24, 8, 8, 8,  16, 8, 0 },
+	{ 32, 8, 8, 8,  16, 8, 0 },
+};
+#define NDEPTHS (sizeof (depths) / sizeof (struct depth))
+
+static short sizes[] = { 16, 64, 256, 1024 };
+#define NSIZES (sizeof (sizes) / sizeof (short))
+
+
+/* Sets up the fb_info for a framebuffer of the given depth.
+ */
+static void
+screen_open (struct depth *d)
+{
+	info = calloc (1, sizeof (struct fb_info));
+	if (!info) {
+		fprintf (stderr, "fbbench: out of memory\n");
+		exit (1);
+	}
+	info->var.xres = XRES;
+	info->var.yres = YRES;
+	info->var.bits_per_pixel = d->bpp;
+	info->var.red.length = d->rlen;
+	info->var.green.length = d->glen;
+	info->var.blue.length = d->blen;
+	info->var.red.offset = d->roff;
+	info->var.green.offset = d->goff;
+	info->var.blue.offset = d->boff;
+	info->fix.line_length = XRES * ((d->bpp + 7) >> 3);
+	info->screen_size = info->fix.line_length * YRES;
+	info->fix.smem_len = info->screen_size;
+	info->screen_base = calloc (1, info->screen_size);
+	if (!info->screen_base) {
+		fprintf (stderr, "fbbench: out of memory\n");
+		exit (1);
+	}
+	info->state = FBINFO_STATE_RUNNING;
+	info->currcon = 0;
+	info->fbops = &ops;
+
+	fbui_init (info);
+
+	if (use_shadow) {
+		info->shadow = malloc (info->screen_size);
+		if (!info->shadow) {
+			fprintf (stderr, "fbbench: out of memory\n");
+			exit (1);
+		}
+	}
+}
+
+
+static void
+screen_close ()
+{
+	free (info->screen_base);
+	free (info->shadow);
+	kfree (info->pointer_default);
+	free (info);
+	info = NULL;
+}
+
+
+/* Makes a visible, unobscured window of the given size at the
+ * bottom right of the screen, so that its coordinates are not
+ * trivially aligned.
+ */
+static void
+window_open (short width, short height)
+{
+	if (width > XRES - 3)
+		width = XRES - 3;
+	if (height > YRES - 3)
+		height = YRES - 3;
+
+	win = calloc (1, sizeof (struct fbui_window));
+	if (!win) {
+		fprintf (stderr, "fbbench: out of memory\n");
+		exit (1);
+	}
+	win->console = 0;
+	win->x0 = XRES - width;
+	win->y0 = YRES - height;
+	win->x1 = XRES - 1;
+	win->y1 = YRES - 1;
+	win->width = width;
+	win->height = height;
+	win->nclip = 1;
+	win->clip = malloc (sizeof (struct fbui_cliprect));
+	win->clip->x0 = 0;
+	win->clip->y0 = 0;
+	win->clip->x1 = width - 1;
+	win->clip->y1 = height - 1;
+}
+
+
+static void
+window_close ()
+{
+	if (win->fontcache)
+		vfree (win->fontcache);
+	kfree (win->bounce);
+	free (win->clip);
+	free (win);
+	win = NULL;
+}
+
+
+/* An 8x13 font whose glyphs are patterns made from the character
+ * codes, with about half of their bits set.
+ */
+static void
+font_make ()
+{
+	static unsigned char lefts [256], heights [256], widths [256];
+	static unsigned char bitwidths [256], descents [256];
+	static unsigned char bits [256 * 13];
+	static unsigned char *bitmaps [256];
+	int ch, j;
+
+	font.ascent = 11;
+	font.descent = 2;
+	font.first_char = 0;
+	font.last_char = 127;
+	font.nchars = 128;
+	font.lefts = lefts;
+	font.heights = heights;
+	font.widths = widths;
+	font.bitwidths = bitwidths;
+	font.descents = descents;
+	font.bitmap_buffer = bits;
+	font.bitmaps = bitmaps;
+
+	for (ch=0; ch < 128; ch++) {
+		heights [ch] = 13;
+		widths [ch] = 8;
+		bitwidths [ch] = 8;
+		descents [ch] = 2;
+		bitmaps [ch] = bits + 13 * ch;
+		for (j=0; j < 13; j++)
+			bits [13 * ch + j] = (ch * 37 + j * 91) ^ (j & 1 ? 0x55 : 0xaa);
+	}
+}
+
+
+static void
+data_make ()
+{
+	int i;
+
+	for (i=0; i < XRES; i++) {
+		rgb_src [i] = (i * 0x10204) & 0xffffff;
+		rgba_src [i] = rgb_src [i] | ((u32) i << 24);
+		rgb3_src [3*i] = i;
+		rgb3_src [3*i+1] = i >> 2;
+		rgb3_src [3*i+2] = i * 3;
+	}
+	for (i=0; i < sizeof (bitmap_src); i++)
+		bitmap_src [i] = (i * 37) ^ (i >> 3);
+	for (i=0; i < sizeof (string) - 1; i++)
+		string [i] = 32 + (i * 7) % 95;
+	string [i] = 0;
+
+	font_make ();
+}
+
+
+/* FNV-1a hash of the framebuffer.
+ */
+static u32
+checksum ()
+{
+	u32 sum = 2166136261U;
+	u32 i;
+
+	for (i=0; i < info->screen_size; i++)
+		sum = (sum ^ info->screen_base [i]) * 16777619;
+	return sum;
+}
+
+
+/* Fills the framebuffer with a pattern, so that copies
+ * move something and partial draws show in the checksum.
+ */
+static void
+screen_fill ()
+{
+	u32 i;
+
+	for (i=0; i < info->screen_size; i++)
+		info->screen_base [i] = (i * 131) >> 7;
+	if (info->shadow)
+		memcpy (info->shadow, info->screen_base, info->screen_size);
+}
+
+
+static double
+now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Each primitive draws call number i of a run of a given size,
+ * returning the number of pixels it touched.
+ */
+typedef long (*Bench) (int i, short size);
+
+
+static long
+bench_hline (int i, short size)
+{
+	short x = i % (XRES - size);
+	fb_hline (info, x, x + size - 1, i % YRES, (u32) i * 0x10101);
+	return size;
+}
+
+
+static long
+bench_vline (int i, short size)
+{
+	if (size > YRES)
+		size = YRES;
+	fb_vline (info, i % XRES, 0, size - 1, (u32) i * 0x10101);
+	return size;
+}
+
+
+static long
+bench_point (int i, short size)
+{
+	fb_point (info, (i * 7) % XRES, (i * 13) % YRES, (u32) i * 0x10101, 0);
+	return 1;
+}
+
+
+static long
+bench_putpixels_rgb (int i, short size)
+{
+	fb_putpixels_rgb (info, i % (XRES - size), i % YRES, size,
+		(unsigned long*) rgb_src, 0);
+	return size;
+}
+
+
+static long
+bench_putpixels_rgb3 (int i, short size)
+{
+	fb_putpixels_rgb3 (info, i % (XRES - size), i % YRES, size,
+		rgb3_src, 0);
+	return size;
+}
+
+
+/* Puts a row of pixels into a window from client memory, as
+ * fbview and mpeg2decode do for each scanline.
+ */
+static long
+bench_put (int i, short size)
+{
+	fbui_put (info, win, 0, i % win->height, size,
+		(unsigned char*) rgba_src);
+	return size < win->width ? size : win->width;
+}
+
+
+static long
+bench_put_rgb3 (int i, short size)
+{
+	fbui_put_rgb3 (info, win, 0, i % win->height, size, rgb3_src);
+	return size < win->width ? size : win->width;
+}
+
+
+/* Copies a square down and right by a few pixels, overlapping itself,
+ * as when scrolling or dragging.
+ */
+static long
+bench_copyarea (int i, short size)
+{
+	if (size > YRES - 8)
+		size = YRES - 8;
+	fb_copyarea (info, i & 7, 0, size, size, 3 + (i & 1), 5);
+	return (long) size * size;
+}
+
+
+/* Fills a square in a window, and all of the screen.
+ */
+static long
+bench_fill_area (int i, short size)
+{
+	fbui_fill_area (info, win, 0, 0, size - 1, size - 1, (u32) i * 0x10101);
+	return (long) win->width * win->height;
+}
+
+
+static long
+bench_clear (int i, short size)
+{
+	fb_clear (info, (u32) i * 0x10101);
+	return (long) XRES * YRES;
+}
+
+
+/* Blends a row of pixels of varying transparency into a window.
+ */
+static long
+bench_put_rgba (int i, short size)
+{
+	fbui_put_rgba (info, win, 0, i % win->height, size, rgba_src, 0);
+	return win->width;
+}
+
+
+/* Blends a half-transparent color over all of a window.
+ */
+static long
+bench_blend_area (int i, short size)
+{
+	fbui_blend_area (info, win, 0, 0, size - 1, size - 1,
+		0x80000000 | ((u32) i * 0x10101 & 0xffffff));
+	return (long) win->width * win->height;
+}
+
+
+/* Blits a 32 bit row into each line of a window.
+ */
+static long
+bench_tinyblit (int i, short size)
+{
+	fbui_tinyblit (info, win, i % size - 16, i % win->height, 32,
+		0xffffff, (u32) i * 0x10101, 0x5a5a5a5a ^ i);
+	return 32;
+}
+
+
+/* Blits a 1-bit bitmap 16 rows high across a window, with a
+ * background on even calls and without on odd ones.
+ */
+static long
+bench_bitblit (int i, short size)
+{
+	fbui_bitblit (info, win, (i & 7) - 4, i % win->height, size, 16,
+		bitmap_src, 0xffffff, i & 1 ? 0xff000000 : (u32) i * 0x10101);
+	return (long) size * 16;
+}
+
+
+/* Draws a string across a window; counts the pixels in the
+ * character cells drawn.
+ */
+static long
+bench_draw_string (int i, short size)
+{
+	int w;
+
+	w = fbui_draw_string (info, win, &font, (i & 7) - 4,
+		(i * 13) % win->height, string, (u32) i * 0x10101);
+	return w > 0 ? (long) w * (font.ascent + font.descent) : 0;
+}
+
+
+struct primitive {
+	char *name;
+	Bench bench;
+	char uses_window;
+	char sized;
+};
+
+static struct primitive primitives[] = {
+	{ "hline", bench_hline, 0, 1 },
+	{ "vline", bench_vline, 0, 1 },
+	{ "point", bench_point, 0, 0 },
+	{ "putpixels_rgb", bench_putpixels_rgb, 0, 1 },
+	{ "putpixels_rgb3", bench_putpixels_rgb3, 0, 1 },
+	{ "put", bench_put, 1, 1 },
+	{ "put_rgb3", bench_put_rgb3, 1, 1 },
+	{ "copyarea", bench_copyarea, 0, 1 },
+	{ "fill_area", bench_fill_area, 1, 1 },
+	{ "clear", bench_clear, 0, 0 },
+	{ "put_rgba", bench_put_rgba, 1, 1 },
+	{ "blend_area", bench_blend_area, 1, 1 },
+	{ "tinyblit", bench_tinyblit, 1, 1 },
+	{ "bitblit", bench_bitblit, 1, 1 },
+	{ "draw_string", bench_draw_string, 1, 1 },
+};
+#define NPRIMITIVES (sizeof (primitives) / sizeof (struct primitive))
+
+
+/* Runs one primitive at one size. A first call, untimed, sets up
+ * anything the primitive caches, e.g. the font.
+ */
+static void
+run (struct primitive *p, struct depth *d, short size)
+{
+	long pixels, calls, i;
+	double t;
+
+	if (p->uses_window)
+		window_open (size, size);
+	screen_fill ();
+
+	pixels = p->bench (0, size);
+	if (pixels <= 0)
+		pixels = 1;
+	calls = budget / pixels;
+	if (calls < 16)
+		calls = 16;
+	if (calls > 4 * 1024 * 1024)
+		calls = 4 * 1024 * 1024;
+
+	screen_fill ();
+	pixels = 0;
+	t = now ();
+	for (i=0; i < calls; i++) {
+		pixels += p->bench (i, size);
+		fbui_shadow_flush (info);
+	}
+	t = now () - t;
+
+	printf ("%-16s %3d %5d %9ld %12.1f %10.2f  %08x\n",
+		p->name, d->bpp, p->sized ? size : 1, calls,
+		t * 1e9 / calls, pixels / t / 1e6, checksum ());
+
+	if (p->uses_window)
+		window_close ();
+}
+
+
+int
+main (int argc, char **argv)
+{
+	char *wanted [NPRIMITIVES];
+	int nwanted = 0;
+	int bpp = 0;
+	int i, j, k, m;
+
+	for (i=1; i < argc; i++) {
+		if (!strcmp (argv[i], "-q"))
+			budget = PIXEL_BUDGET / 8;
+		else if (!strcmp (argv[i], "-s"))
+			use_shadow = 1;
+		else if (!strcmp (argv[i], "-d") && i+1 < argc)
+			bpp = atoi (argv[++i]);
+		else if (argv[i][0] == '-' || nwanted == NPRIMITIVES) {
+			fprintf (stderr, "Usage: fbbench [-q] [-s] [-d bpp] [primitive ...]\n");
+			exit (1);
+		}
+		else
+			wanted [nwanted++] = argv[i];
+	}
+
+	data_make ();
+
+	printf ("%-16s %3s %5s %9s %12s %10s  %8s\n", "primitive", "bpp",
+		"size", "calls", "ns/call", "Mpixels/s", "checksum");
+
+	for (j=0; j < NDEPTHS; j++) {
+		struct depth *d = &depths [j];
+
+		if (bpp && bpp != d->bpp)
+			continue;
+
+		screen_open (d);
+		for (k=0; k < NPRIMITIVES; k++) {
+			struct primitive *p = &primitives [k];
+
+			if (nwanted) {
+				for (m=0; m < nwanted; m++)
+					if (!strcmp (wanted[m], p->name))
+						break;
+				if (m == nwanted)
+					continue;
+			}
+
+			if (!p->sized)
+				run (p, d, 1);
+			else
+				for (m=0; m < NSIZES; m++)
+					run (p, d, sizes [m]);
+		}
+		screen_close ();
+	}
+
+	return 0;
+}
@@ -95,7 +95,7 @@ printf ("our window is id %d\n", win->id);
 		time_t t;
 		int need=0, mustclear=0;
 		int size;
-		usleep (500000);
+		fbui_idle (dpy, 500000);
 
 		t = time(0);
 		int tdiff = t - t0;
@@ -94,7 +94,7 @@ main(int argc, char** argv)
 		time_t t;
 		int need=0;
 		int need_redraw=0;
-		usleep (50000);
+		fbui_idle (dpy, 1000000);
 
 		t = time(NULL);
 		int tdiff = t - t0;
@@ -40,6 +40,7 @@
 #ifndef DISPLAY /* if not X11 */
 static Display *fbui_display = NULL;
 static Window *fbui_window = NULL;
+static int fbui_double_buffered = 0;
 
 extern int fbui_console;
 
@@ -486,6 +487,9 @@ int tgaflag;
 	argc,argv);
     if (!fbui_window)
       FATAL ("cannot create window");
+
+    /* Frames are shown only once complete */
+    fbui_double_buffered = !fbui_double_buffer (fbui_display, fbui_window, 1);
   }
 
   /* matrix coefficients */
@@ -520,12 +524,11 @@ int tgaflag;
     }
   }
 
-  for (i=0; i<height; i++)
-  {
-    fbui_put_rgb3 (fbui_display, fbui_window, 0, i, horizontal_size, 
-	rows + i * horizontal_size * 3);
-    fbui_flush (fbui_display, fbui_window);
-  }
+  fbui_put_image (fbui_display, fbui_window, 0, 0, horizontal_size, height,
+	rows, horizontal_size * 3, FBUI_IMAGE_RGB24);
+  fbui_flush (fbui_display, fbui_window);
+  if (fbui_double_buffered)
+    fbui_present (fbui_display, fbui_window);
 
   time_t t2 = time(NULL);
   if (t != t2) {
@@ -96,7 +96,7 @@ main(int argc, char** argv)
 		int need_redraw=0;
 		Event ev;
 
-		usleep(50000);
+		fbui_idle (dpy, 1000000);
 
 		if ((t - t0) >= 60) {
 			total = checkmail (server,user,pass);
@@ -51,7 +51,7 @@
 #define max(AA,BB) ( (AA)>(BB) ? (AA) : (BB) )
 
 
-extern void draw_background (Display *dpy, Window *win);
+extern void draw_background (Display *dpy, Window *win, short,short,short,short);
 
 extern int read_JPEG_file (char*);
 
@@ -463,8 +463,8 @@ main(int argc, char** argv)
         }
 
 	/* If the wm was started after windows appeared,
-	 * we need to hide those windows to prevent fbui_overlap_check
-	 * from complaining.
+	 * we need to hide those windows so that they can
+	 * be placed into panels.
 	 */
 	window_count = fbui_window_info (dpy, self, &info[0], MAXWINS);
 	for (i=0; i<window_count; i++) {
@@ -526,6 +526,7 @@ main(int argc, char** argv)
 
 	int need_list = 1;
 	int need_redraw = 0;
+	short dmg_x0=0, dmg_y0=0, dmg_x1=-1, dmg_y1=-1; /* damaged area */
 	goto getlist;
 
 	while(1) {
@@ -545,6 +546,24 @@ printf ("%s got event %s\n", argv[0], fbui_get_event_name (ev.type));
 			FATAL ("event not for our window");
 
 		if (num == FBUI_EVENT_EXPOSE) {
+			short x1 = ev.x + ev.width - 1;
+			short y1 = ev.y + ev.height - 1;
+
+			/* width 0 means the whole window */
+			if (ev.width <= 0 || ev.height <= 0) {
+				ev.x = ev.y = 0;
+				x1 = win_w - 1;
+				y1 = win_h - 1;
+			}
+			if (dmg_x1 < dmg_x0) {
+				dmg_x0 = ev.x; dmg_y0 = ev.y;
+				dmg_x1 = x1; dmg_y1 = y1;
+			} else {
+				if (ev.x < dmg_x0) dmg_x0 = ev.x;
+				if (ev.y < dmg_y0) dmg_y0 = ev.y;
+				if (x1 > dmg_x1) dmg_x1 = x1;
+				if (y1 > dmg_y1) dmg_y1 = y1;
+			}
 			need_redraw = 1;
 		}
 		else if (num == FBUI_EVENT_WINCHANGE) {
@@ -885,6 +904,9 @@ printf ("   program %s.... %s\n", info[i].name,info[i].hidden?"hidden":"");
 			need_list=0;
 
 			need_redraw = 1;
+			dmg_x0 = dmg_y0 = 0;
+			dmg_x1 = win_w - 1;
+			dmg_y1 = win_h - 1;
 		} 
 		
 		if (need_redraw) {
@@ -892,7 +914,8 @@ printf ("   program %s.... %s\n", info[i].name,info[i].hidden?"hidden":"");
 
 			need_redraw = 0;
 
-			draw_background (dpy,self);
+			draw_background (dpy,self, dmg_x0, dmg_y0, dmg_x1, dmg_y1);
+			dmg_x1 = dmg_y1 = -1;
 			draw_window_list (dpy, self);
 
 			i=0; 
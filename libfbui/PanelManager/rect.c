@@ -282,46 +282,45 @@ draw_image (Display *dpy, Window *win, short x0, short y0, short x1, short y1)
 	if (x1>=image_width) x1=image_width-1;
 	if (y1>=image_height) y1=image_height-1;
 	
-	for (j=y0; j<=y1; j++) {
-		if (image_ncomponents == 1 || grayscale) {
-			for(i=x0; i<x1; i++) {
-				unsigned long pix=0;
-				unsigned char *p = image_buffer +
-					image_ncomponents*(i + j*image_width);
-
-				/* pixels are grayscale */
-				if (image_ncomponents == 1) {
-					pix = *p;
-					pix <<= 8;
-					pix |= *p;
-					pix <<= 8;
-					pix |= *p;
-				} else {
-					pix = *p++;
-					pix += *p++;
-					pix += *p;
-					pix /= 3;
-					pix |= (pix<<8) | (pix<<16);
-				}
-
-				fbui_draw_point (dpy, win, i, j, pix);
-			}
-		}
-		else
-		{
-			fbui_put_rgb3 (dpy, win, x0, j, x1-x0+1,
-				image_buffer + 3*(j*image_width+x0));
+	if (image_ncomponents == 1) {
+		fbui_put_image (dpy, win, x0, y0, x1-x0+1, y1-y0+1,
+			image_buffer + y0*image_width+x0, image_width,
+			FBUI_IMAGE_GRAY8);
+	}
+	else if (grayscale) {
+		unsigned char *gray = malloc ((x1-x0+1) * (y1-y0+1));
+		unsigned char *q = gray;
+		if (!gray)
+			return;
+
+		for (j=y0; j<=y1; j++) {
+			unsigned char *p = image_buffer + 3*(j*image_width+x0);
+			for (i=x0; i<=x1; i++, p += 3)
+				*q++ = (p[0] + p[1] + p[2]) / 3;
 		}
+
+		fbui_put_image (dpy, win, x0, y0, x1-x0+1, y1-y0+1,
+			gray, x1-x0+1, FBUI_IMAGE_GRAY8);
+		fbui_flush (dpy, win);
+		free (gray);
+		return;
+	}
+	else
+	{
+		fbui_put_image (dpy, win, x0, y0, x1-x0+1, y1-y0+1,
+			image_buffer + 3*(y0*image_width+x0), 3*image_width,
+			FBUI_IMAGE_RGB24);
 	}
 
 	fbui_flush(dpy,win);
 }
 
 
+/* Redraws the background within x0,y0 - x1,y1 where no window is */
 void
-draw_background (Display *dpy, Window *win)
+draw_background (Display *dpy, Window *win, short x0, short y0, short x1, short y1)
 {
-	Rect *list1 = Rect_new (0,0,win_w-1,win_h-1);
+	Rect *list1 = Rect_new (x0,y0,x1,y1);
 	Rect *list2 = NULL;
 	Rect *ptr;
 	int mypid = getpid();
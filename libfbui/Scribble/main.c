@@ -291,73 +291,78 @@ main(int argc, char** argv)
 	int y0 = (win->height - canvas->height) >> 1;
 
 	while (1) {
-		int total;
-		int need=0;
-		Event ev;
-		Window *win;
-		int x=0, y=0;
-		int type;
-		int err;
-
-		if (err = fbui_wait_event (dpy, &ev, FBUI_EVENTMASK_ALL)) {
-			fbui_print_error (err);
+		Event evs [FBUI_MAXEVENTSPERBATCH];
+		Window *win = NULL;
+		int i, n;
+
+		n = fbui_wait_events (dpy, evs, FBUI_MAXEVENTSPERBATCH, FBUI_EVENTMASK_ALL);
+		if (n < 0) {
+			fbui_print_error (n);
 			continue;
 		}
 
+		for (i = 0; i < n; i++) {
+			Event ev = evs[i];
+			int type;
+
 printf ("%s got event %s\n", argv[0], fbui_get_event_name (ev.type));
 
-		win = ev.win;
-		if (!win)
-			FATAL("null window");
+			win = ev.win;
+			if (!win)
+				FATAL("null window");
 
-		type = ev.type;
+			type = ev.type;
 
-		switch (type) {
-		case FBUI_EVENT_EXPOSE:
-			Canvas_draw (canvas, dpy, win, 1);
-			continue;
+			switch (type) {
+			case FBUI_EVENT_EXPOSE:
+				Canvas_draw (canvas, dpy, win, 1);
+				continue;
 
-		case FBUI_EVENT_KEY: {
-			short key = ev.key >> 2;
-			short state = ev.key & 3;
+			case FBUI_EVENT_KEY: {
+				short key = ev.key >> 2;
+				short state = ev.key & 3;
 printf ("key=%d\n", key);
 
-			if (state && key == KEY_Q)
-				goto finit;
+				if (state && key == KEY_Q)
+					goto finit;
 
-			if (state && key == KEY_S)
-				Canvas_serialize (canvas, "image");
+				if (state && key == KEY_S)
+					Canvas_serialize (canvas, "image");
 
-			if (state && key == KEY_L)
-				Canvas_deserialize (canvas, "image");
-			break;
-		 }
+				if (state && key == KEY_L)
+					Canvas_deserialize (canvas, "image");
+				break;
+			 }
 
-		case FBUI_EVENT_BUTTON:
+			case FBUI_EVENT_BUTTON:
 printf ("got button event, value=%d\n", ev.key);
-			if (ev.key & FBUI_BUTTON_LEFT)
-				button_down = ev.key & 1;
-			break;
+				if (ev.key & FBUI_BUTTON_LEFT)
+					button_down = ev.key & 1;
+				break;
 		
-		case FBUI_EVENT_MOTION: {
-			short x= ev.x - x0;
-			short y= ev.y - y0;
-
-			if (button_down && x >= 0 && y >= 0 && 
-			    x < canvas->width && y < canvas->height) 
-			{
-				Canvas_put_pixel (canvas, x, y, RGB_RED);
-				fbui_draw_point (dpy, win, ev.x, ev.y, RGB_RED);
-				fbui_flush (dpy, win);
-			}
-			break;
-		 }
+			case FBUI_EVENT_MOTION: {
+				short x= ev.x - x0;
+				short y= ev.y - y0;
+
+				if (button_down && x >= 0 && y >= 0 && 
+				    x < canvas->width && y < canvas->height) 
+				{
+					Canvas_put_pixel (canvas, x, y, RGB_RED);
+					fbui_draw_point (dpy, win, ev.x, ev.y, RGB_RED);
+				}
+				break;
+			 }
 		
-		case FBUI_MOVE_RESIZE:
-			x0 = (ev.width - canvas->width) >> 1;
-			y0 = (ev.height - canvas->height) >> 1;
-			break;
+			case FBUI_MOVE_RESIZE:
+				x0 = (ev.width - canvas->width) >> 1;
+				y0 = (ev.height - canvas->height) >> 1;
+				break;
+			}
 		}
+
+		/* one flush for the whole batch of points */
+		if (win)
+			fbui_flush (dpy, win);
 	}
 finit:
 
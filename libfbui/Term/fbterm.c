@@ -11,6 +11,7 @@ void fbtermNextPos ();
 int FBUIWriteChar (wchar_t);
 int FBUIInit_graphicsmode (int,short,short,short,short);
 void HandleFBUIEvents (unsigned char *, size_t *);
+int FBUIEventFD (void);
 void FBUIExit (void);
 void fbtermBlinkCursor (int);
 #ifdef DEBUG
@@ -222,6 +223,7 @@ main (int argc, char **argv)
 	char buf[128];
 	struct timeval tv;
 	fd_set rfds, wfds;
+	int fbui_fd, maxfd;
 	char *shell = "/bin/sh";
 
 	int vc = -1;
@@ -384,7 +386,16 @@ main (int argc, char **argv)
 		if (shellinput_size)
 			FD_SET (master_fd, &wfds);
 
-		err = select (master_fd + 1, &rfds, &wfds, NULL, &tv);
+		/* wake up at once for keystrokes */
+		maxfd = master_fd;
+		fbui_fd = FBUIEventFD ();
+		if (fbui_fd >= 0) {
+			FD_SET (fbui_fd, &rfds);
+			if (fbui_fd > maxfd)
+				maxfd = fbui_fd;
+		}
+
+		err = select (maxfd + 1, &rfds, &wfds, NULL, &tv);
 		if (err < 0 && errno != EINTR)
 		{
 			perror ("fbterm: select");
@@ -75,10 +75,15 @@ extern int linewrap_pending;
 
 extern int (*fbtermPutShellChar) (unsigned char *, size_t *, wchar_t);
 
-void redraw ()
+/* Repaints text rows j0 through j1 */
+void redraw_rows (int j0, int j1)
 {
 	int j;
-	for (j=0; j<terminal_height; j++) {
+	if (j0 < 0)
+		j0 = 0;
+	if (j1 >= terminal_height)
+		j1 = terminal_height - 1;
+	for (j=j0; j<=j1; j++) {
 		int i;
 		for (i=0; i<terminal_width; ) {
 			int ix =i + j*terminal_width;
@@ -117,6 +122,11 @@ void redraw ()
 	}
 }
 
+void redraw ()
+{
+	redraw_rows (0, terminal_height - 1);
+}
+
 void resize(int new_width, int new_height)
 {
 	int i, j;
@@ -404,20 +414,22 @@ fbtermEraseDisplay ()
 void
 fbtermScrollUp (unsigned int nb_lines)
 {
-	debug (DEBUG_DETAIL, "Scrolling %d lines in region %d-%d", nb_lines, region_top, region_bottom);
+	int height = region_bottom - region_top - nb_lines;
 
-#if 0
-	/* too slow due to video memory read speed */
-
-	fbui_copy_area (dpy, win, 0, (region_top+nb_lines)*cell_h, 
-		0, region_top*cell_h,
-		vis_w, (region_bottom-region_top-nb_lines)*cell_h);
-	int y = (region_bottom - nb_lines)*cell_h;
-	fbui_fill_area (dpy, win, 0, y, vis_w, vis_h, color[default_bgcolor]);
-#endif
+	debug (DEBUG_DETAIL, "Scrolling %d lines in region %d-%d", nb_lines, region_top, region_bottom);
 
 	scroll_exposebuf_up (nb_lines, region_top, region_bottom);
-	redraw();
+
+	/* The window has a backing store, so the kernel
+	 * moves the text without reading video memory.
+	 */
+	if (height > 0) {
+		fbui_copy_area (dpy, win, 0, (region_top+nb_lines)*cell_h, 
+			0, region_top*cell_h,
+			vis_w, height*cell_h);
+		redraw_rows (region_bottom - nb_lines, region_bottom - 1);
+	} else
+		redraw_rows (region_top, region_bottom - 1);
 }
 
 void
@@ -502,6 +514,14 @@ FBUIWriteChar (wchar_t charcode)
 
 
 
+/* For the main loop's select() */
+int
+FBUIEventFD (void)
+{
+	return dpy ? dpy->fd : -1;
+}
+
+
 void
 HandleFBUIEvents (unsigned char *shellinput, size_t *shellinput_size)
 {
@@ -514,7 +534,6 @@ HandleFBUIEvents (unsigned char *shellinput, size_t *shellinput_size)
 	Event ev;
 	unsigned char event_num;
 
-	usleep (3000);
 	if (fbui_poll_event (dpy, &ev, FBUI_EVENTMASK_ALL))
 		return;
 
@@ -526,7 +545,11 @@ printf ("event id = %d, window id %d\n", ev.id, win->id);
 	}
 
 	if (event_num == FBUI_EVENT_EXPOSE) {
-		redraw();
+		/* width 0 means the whole window */
+		if (ev.width > 0 && ev.height > 0)
+			redraw_rows (ev.y / cell_h, (ev.y + ev.height - 1) / cell_h);
+		else
+			redraw();
 	}
 	else if (event_num == FBUI_EVENT_MOVE_RESIZE) {
 		vis_w = ev.width;
@@ -732,6 +755,8 @@ printf ("fbterm: trying for window size %d,%d to provide %dx%d text\n", default_
 	dpy = fbui_display_open ();
         if (!dpy)
                 FATAL ("cannot open display");
+
+	dpy->backing_store = 1;
 	
         win = fbui_window_open (dpy, default_w, default_h, 
 		&win_w, &win_h,
@@ -187,6 +187,7 @@ int image_ncomponents;
 int image_orig_width, image_orig_height;
 
 static int grayscale=0;
+static unsigned char *gray_buffer;
 
 static int fileNum = 0;
 static char *path = NULL;
@@ -678,8 +679,13 @@ printf ("fbview got MR: %d %d\n", win_w, win_h);
 		fbui_clear_area (dpy, win, 0, target_h+5, w, target_h+5 + text_height);
 		fbui_draw_string (dpy, win, pcf, 0, target_h + 5, expr, RGB_WHITE);
 
-		for (j=0; j<image_height; j++) {
-			if (image_ncomponents == 1 || grayscale) {
+		if (image_ncomponents == 1 || grayscale) {
+			/* one byte of gray per pixel, put in one go */
+			gray_buffer = realloc (gray_buffer, image_width * image_height);
+			if (!gray_buffer)
+				FATAL ("out of memory");
+
+			for (j=0; j<image_height; j++) {
 				for(i=0; i<image_width; i++) {
 					unsigned long pix=0;
 					unsigned char *p = NULL;
@@ -691,46 +697,43 @@ printf ("fbview got MR: %d %d\n", win_w, win_h);
 						pix += *p++;
 						pix += *p;
 						pix /= 3;
-						pix |= (pix<<8) | (pix<<16);
 					} 
 					else if (image_buffer) {
 						p = image_buffer + image_ncomponents*(i + j*image_width);
-						/* pixels are grayscale */
 						if (image_ncomponents == 1) {
 							pix = *p;
-							pix <<= 8;
-							pix |= *p;
-							pix <<= 8;
-							pix |= *p;
 						} else {
 							pix = *p++;
 							pix += *p++;
 							pix += *p;
 							pix /= 3;
-							pix |= (pix<<8) | (pix<<16);
 						}
 					}
 					else if (image_buffer_long) {
 						int yy = (image_height-1) - j;
 						p2= image_buffer_long + i + yy*image_width;
 						pix = *p2;
+						pix = ((pix & 0xff) + ((pix >> 8) & 0xff) +
+							((pix >> 16) & 0xff)) / 3;
 					}
 
-					fbui_draw_point (dpy, win, i, j, pix);
+					gray_buffer [i + j*image_width] = pix;
 				}
-			} 
-			else 
-			{
-				if (shrunken_image_buffer)
-					fbui_put_rgb3 (dpy, win, 0, j, image_width, 
-						shrunken_image_buffer + 3*j*image_width);
-				else if (image_buffer)
-					fbui_put_rgb3 (dpy, win, 0, j, image_width, 
-						image_buffer + 3*j*image_width);
-				else if (image_buffer_long)
-					fbui_put_rgb (dpy, win, 0, j, image_width, 
-						image_buffer_long + 4*j*image_width);
 			}
+
+			fbui_put_image (dpy, win, 0, 0, image_width, image_height,
+				gray_buffer, image_width, FBUI_IMAGE_GRAY8);
+		} 
+		else if (shrunken_image_buffer)
+			fbui_put_image (dpy, win, 0, 0, image_width, image_height,
+				shrunken_image_buffer, 3*image_width, FBUI_IMAGE_RGB24);
+		else if (image_buffer)
+			fbui_put_image (dpy, win, 0, 0, image_width, image_height,
+				image_buffer, 3*image_width, FBUI_IMAGE_RGB24);
+		else if (image_buffer_long) {
+			for (j=0; j<image_height; j++)
+				fbui_put_rgb (dpy, win, 0, j, image_width, 
+					image_buffer_long + 4*j*image_width);
 		}
 
 		fbui_flush (dpy, win);
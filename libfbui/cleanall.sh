@@ -1,7 +1,7 @@
 #/bin/sh
 
 DIRS=". Calc Launcher MPEG Test Clock ToDo Term LoadMonitor Viewer
-MailCheck Dump WindowManager PanelManager"
+MailCheck Dump WindowManager PanelManager Bench"
 
 for DIR in $DIRS
 do
@@ -40,6 +40,7 @@
 #include <ctype.h>
 #include <time.h>
 #include <sys/param.h>
+#include <sys/select.h>
 
 
 
@@ -90,6 +91,49 @@ errlog (char *s, char *s2)
 }
 
 
+/* Full barrier: the kernel must not miss a head update
+ * just as it clears busy.
+ */
+#if defined(__i386__)
+#define ring_mb() __asm__ __volatile__ ("lock; addl $0,0(%%esp)" : : : "memory")
+#else
+#define ring_mb() __sync_synchronize()
+#endif
+
+/* Appends the buffered commands to the shared ring.
+ * Returns 1 if there was no room, so the caller can use the ioctl.
+ */
+static int
+fbui_ring_flush (Display *dpy, Window *win)
+{
+	struct fbui_ring *ring = win->ring;
+	unsigned short n = win->command_ix-2;
+	unsigned short *src = win->command + 2;
+	__u32 head;	/* free-running, so differences must wrap at 32 bits */
+	int result=0;
+
+	head = ring->head;
+	if (FBUI_RING_WORDS - (head - ring->tail) < n) {
+		/* drains the ring unless another thread is at it */
+		result = ioctl (dpy->fd, FBIO_UI_KICK, win->id);
+		if (result < 0)
+			return result;
+		if (FBUI_RING_WORDS - (head - ring->tail) < n)
+			return 1;
+	}
+
+	while (n--)
+		ring->data [head++ & (FBUI_RING_WORDS-1)] = *src++;
+	ring_mb();
+	ring->head = head;
+	ring_mb();
+
+	if (!ring->busy)
+		result = ioctl (dpy->fd, FBIO_UI_KICK, win->id);
+	return result;
+}
+
+
 int
 fbui_flush (Display *dpy, Window *win)
 {
@@ -101,6 +145,14 @@ fbui_flush (Display *dpy, Window *win)
 	if (win->command_ix <= 2)
 		return 0;
 
+	if (win->ring) {
+		result = fbui_ring_flush (dpy, win);
+		if (result != 1) {
+			win->command_ix = 2;
+			return result;
+		}
+	}
+
 	win->command[0] = win->id;
 	win->command[1] = win->command_ix-2;
 	if (win->command[1])
@@ -126,6 +178,76 @@ check_flush (Display *dpy, Window *win, int need)
 	return result;
 }
 
+/* A 64 bit client must send pointers in the wide encoding,
+ * which has FBUI_WIDE in the command word and four words
+ * per pointer. Callers of check_flush allow for the four.
+ */
+static unsigned short
+wide_flag (Window *win)
+{
+	return (sizeof (void*) > 4 && (win->caps & FBUI_CAP_WIDE)) ? FBUI_WIDE : 0;
+}
+
+static void
+put_pointer (Window *win, void *p)
+{
+	unsigned long v = (unsigned long) p;
+
+	win->command [win->command_ix++] = v;
+	win->command [win->command_ix++] = v >> 16;
+	if (wide_flag (win)) {
+		win->command [win->command_ix++] = (v >> 16) >> 16;
+		win->command [win->command_ix++] = ((v >> 16) >> 16) >> 16;
+	}
+}
+
+/* Sends pixels inside the command stream, so the kernel has no
+ * user pointer to follow and the caller's array need not last
+ * until the flush. Each pixel takes two words.
+ */
+static int
+put_inline (Display *dpy, Window *win, unsigned short cmd,
+	short x, short y, short n, unsigned long *p)
+{
+	int result=0;
+	unsigned int v;
+	short i, k;
+
+	while (n > 0) {
+		k = n < LIBFBUI_INLINEMAX ? n : LIBFBUI_INLINEMAX;
+		if (result = check_flush (dpy, win, 4 + 2*k))
+			return result;
+
+		win->command [win->command_ix++] = cmd;
+		win->command [win->command_ix++] = x;
+		win->command [win->command_ix++] = y;
+		win->command [win->command_ix++] = k;
+		for (i=0; i < k; i++) {
+			v = p [i];
+			memcpy (win->command + win->command_ix, &v, 4);
+			win->command_ix += 2;
+		}
+
+		x += k;
+		p += k;
+		n -= k;
+	}
+
+	return 0;
+}
+
+/* Whether n pixels at p should go inline. A 64 bit client's
+ * unsigned longs are not the kernel's 32 bit pixels, so it 
+ * always sends them inline when it can.
+ */
+static int
+want_inline (Window *win, short n)
+{
+	if (!(win->caps & FBUI_CAP_INLINE))
+		return 0;
+	return n <= LIBFBUI_INLINESMALL || sizeof (unsigned long) > 4;
+}
+
 
 
 /* called only by wm */
@@ -384,6 +506,22 @@ fbui_unhide (Display *dpy, Window *wm, short id)
 	return result;
 }
 
+/* called only by wm */
+int
+fbui_raise (Display *dpy, Window *wm, short id)
+{
+	if (!dpy) return -1;
+	/*---------------*/
+
+	struct fbui_ctrlparams ctl;
+	memset (&ctl, 0, sizeof (struct fbui_ctrlparams));
+	ctl.op = FBUI_RAISE;
+	ctl.id = wm->id;
+	ctl.id2 = id;
+
+	return ioctl (dpy->fd, FBIO_UI_CONTROL, (unsigned long)&ctl) < 0 ? -errno : 0;
+}
+
 int
 fbui_draw_point (Display *dpy, Window *win, short x, short y, unsigned long color)
 {
@@ -470,6 +608,37 @@ fbui_flush(dpy,win);
 	return 0;
 }
 
+/* Rows of bits are padded to whole bytes, leftmost pixel in the
+ * top bit. A bgcolor with a nonzero top byte is not drawn.
+ */
+int
+fbui_bitblit (Display *dpy, Window *win, short x, short y,
+		short width, short height,
+		unsigned char *bits,
+		unsigned long color,
+		unsigned long bgcolor)
+{
+	int result=0;
+
+	if (!dpy || !win || !bits) return -1;
+	/*---------------*/
+	if (result = check_flush (dpy, win,13))
+		return result;
+
+	win->command [win->command_ix++] = FBUI_BITBLIT | wide_flag (win);
+	win->command [win->command_ix++] = x;
+	win->command [win->command_ix++] = y;
+	win->command [win->command_ix++] = width;
+	win->command [win->command_ix++] = height;
+	put_pointer (win, bits);
+	win->command [win->command_ix++] = color;
+	win->command [win->command_ix++] = color>>16;
+	win->command [win->command_ix++] = bgcolor;
+	win->command [win->command_ix++] = bgcolor>>16;
+
+	return 0;
+}
+
 int
 fbui_draw_hline (Display *dpy, Window *win, short x0, short x1, short y, unsigned long color)
 {
@@ -537,30 +706,23 @@ fbui_draw_string (Display *dpy, Window *win, struct fbui_font *font,
 	unsigned long color)
 {
 	int result=0;
-        unsigned long n;
-        unsigned long n2;
 	unsigned char *str = (unsigned char*) str_;
 
 	if (!dpy || !win || !str)
 		return -1;
 	/*---------------*/
 
-	if (result = check_flush (dpy, win,10))
+	if (result = check_flush (dpy, win,14))
 		return result;
 
         if (!str) FATAL("null param3");
 
-	n = (unsigned long) str;
-	n2 = (unsigned long)font;
-
-	win->command [win->command_ix++] = FBUI_STRING;
+	win->command [win->command_ix++] = FBUI_STRING | wide_flag (win);
 	win->command [win->command_ix++] = x0;
 	win->command [win->command_ix++] = y0;
-	win->command [win->command_ix++] = n2;
-	win->command [win->command_ix++] = n2>>16;
+	put_pointer (win, font);
 	win->command [win->command_ix++] = strlen (str);
-	win->command [win->command_ix++] = n;
-	win->command [win->command_ix++] = n>>16;
+	put_pointer (win, str);
 	win->command [win->command_ix++] = color;
 	win->command [win->command_ix++] = color>>16;
 
@@ -584,6 +746,122 @@ fbui_set_subtitle (Display *dpy, Window *win, char *str)
 	return ioctl (dpy->fd, FBIO_UI_CONTROL, &ctl) < 0 ? -errno : 0;
 }
 
+/* Asks for drawing to go to a back buffer, shown by fbui_present */
+int
+fbui_double_buffer (Display *dpy, Window *win, int yes)
+{
+	struct fbui_ctrlparams ctl;
+
+	if (!dpy || !win)
+		return FBUI_ERR_NULLPTR;
+	/*---------------*/
+
+	fbui_flush (dpy, win);
+
+	memset (&ctl, 0, sizeof (struct fbui_ctrlparams));
+	ctl.op = FBUI_DOUBLEBUFFER;
+	ctl.id = win->id;
+	ctl.x = yes ? 1 : 0;
+
+	return ioctl (dpy->fd, FBIO_UI_CONTROL, &ctl) < 0 ? -errno : 0;
+}
+
+int
+fbui_present (Display *dpy, Window *win)
+{
+	struct fbui_ctrlparams ctl;
+
+	if (!dpy || !win)
+		return FBUI_ERR_NULLPTR;
+	/*---------------*/
+
+	fbui_flush (dpy, win);
+
+	memset (&ctl, 0, sizeof (struct fbui_ctrlparams));
+	ctl.op = FBUI_PRESENT;
+	ctl.id = win->id;
+
+	return ioctl (dpy->fd, FBIO_UI_CONTROL, &ctl) < 0 ? -errno : 0;
+}
+
+/* Gives the kernel a pointer shape of up to FBUI_CURSORMAX pixels
+ * square, in the form taken by fbui_put_rgba, with its hot spot at
+ * hot_x,hot_y. Returns a handle for fbui_set_cursor, or an error.
+ */
+int
+fbui_load_cursor (Display *dpy, Window *win, short w, short h,
+	short hot_x, short hot_y, unsigned long *pixels)
+{
+	struct fbui_ctrlparams ctl;
+	unsigned int *p;
+	int i, result;
+
+	if (!dpy || !win || !pixels)
+		return FBUI_ERR_NULLPTR;
+	if (w <= 0 || h <= 0 || w > FBUI_CURSORMAX || h > FBUI_CURSORMAX)
+		return FBUI_ERR_BADPARAM;
+	/*---------------*/
+
+	/* The kernel takes 32 bit pixels */
+	p = malloc (w * h * sizeof (unsigned int));
+	if (!p)
+		return FBUI_ERR_NOMEM;
+	for (i=0; i < w * h; i++)
+		p[i] = pixels[i];
+
+	memset (&ctl, 0, sizeof (struct fbui_ctrlparams));
+	ctl.op = FBUI_LOADCURSOR;
+	ctl.id = win->id;
+	ctl.x = hot_x;
+	ctl.y = hot_y;
+	ctl.width = w;
+	ctl.height = h;
+	ctl.pointer = (unsigned char*) p;
+
+	result = ioctl (dpy->fd, FBIO_UI_CONTROL, &ctl);
+	free (p);
+	return result < 0 ? -errno : result;
+}
+
+/* Chooses the pointer shape shown over the window; 0 is the default */
+int
+fbui_set_cursor (Display *dpy, Window *win, int handle)
+{
+	struct fbui_ctrlparams ctl;
+
+	if (!dpy || !win)
+		return FBUI_ERR_NULLPTR;
+	/*---------------*/
+
+	memset (&ctl, 0, sizeof (struct fbui_ctrlparams));
+	ctl.op = FBUI_SETCURSOR;
+	ctl.id = win->id;
+	ctl.x = handle;
+
+	return ioctl (dpy->fd, FBIO_UI_CONTROL, &ctl) < 0 ? -errno : 0;
+}
+
+/* Returns the kernel's FBUI_CMD_VERSION and FBUI_CAP_* bits,
+ * or 0 if it is too old to say.
+ */
+int
+fbui_get_caps (Display *dpy, Window *win)
+{
+	struct fbui_ctrlparams ctl;
+	int result;
+
+	if (!dpy || !win)
+		return 0;
+	/*---------------*/
+
+	memset (&ctl, 0, sizeof (struct fbui_ctrlparams));
+	ctl.op = FBUI_GETCAPS;
+	ctl.id = win->id;
+
+	result = ioctl (dpy->fd, FBIO_UI_CONTROL, &ctl);
+	return result < 0 ? 0 : result;
+}
+
 int
 fbui_set_font (Display *dpy, Window *win, struct fbui_font *font)
 {
@@ -657,6 +935,27 @@ fbui_fill_area (Display *dpy, Window *win, short x0, short y0, short x1, short y
 	return 0;
 }
 
+int
+fbui_blend_area (Display *dpy, Window *win, short x0, short y0, short x1, short y1, unsigned long color)
+{
+	int result=0;
+
+	if (!dpy || !win) return -1;
+	/*---------------*/
+	if (result = check_flush (dpy, win,7))
+		return result;
+
+	win->command [win->command_ix++] = FBUI_BLENDAREA;
+	win->command [win->command_ix++] = x0;
+	win->command [win->command_ix++] = y0;
+	win->command [win->command_ix++] = x1;
+	win->command [win->command_ix++] = y1;
+	win->command [win->command_ix++] = color;
+	win->command [win->command_ix++] = color>>16;
+
+	return 0;
+}
+
 int
 fbui_clear_area (Display *dpy, Window *win, short x0, short y0, short x1, short y1)
 {
@@ -704,14 +1003,13 @@ fbui_put (Display *dpy, Window *win, short x, short y, short n, unsigned char *p
 
 	if (!dpy || !win || !p) return -1;
 	/*---------------*/
-	if (result = check_flush (dpy, win,6))
+	if (result = check_flush (dpy, win,8))
 		return result;
 
-	win->command [win->command_ix++] = FBUI_PUT;
+	win->command [win->command_ix++] = FBUI_PUT | wide_flag (win);
 	win->command [win->command_ix++] = x;
 	win->command [win->command_ix++] = y;
-	win->command [win->command_ix++] = (unsigned long)p;
-	win->command [win->command_ix++] = ((unsigned long)p)>>16;
+	put_pointer (win, p);
 	win->command [win->command_ix++] = n;
 
 	return 0;
@@ -724,14 +1022,16 @@ fbui_put_rgb (Display *dpy, Window *win, short x, short y, short n, unsigned lon
 
 	if (!dpy || !win || !p) return -1;
 	/*---------------*/
-	if (result = check_flush (dpy, win,6))
+	if (want_inline (win, n))
+		return put_inline (dpy, win, FBUI_PUTRGBINLINE, x, y, n, p);
+
+	if (result = check_flush (dpy, win,8))
 		return result;
 
-	win->command [win->command_ix++] = FBUI_PUTRGB;
+	win->command [win->command_ix++] = FBUI_PUTRGB | wide_flag (win);
 	win->command [win->command_ix++] = x;
 	win->command [win->command_ix++] = y;
-	win->command [win->command_ix++] = (unsigned long) p;
-	win->command [win->command_ix++] = ((unsigned long) p) >>16;
+	put_pointer (win, p);
 	win->command [win->command_ix++] = n;
 
 	return 0;
@@ -744,19 +1044,143 @@ fbui_put_rgb3 (Display *dpy, Window *win, short x, short y, short n, unsigned ch
 
 	if (!dpy || !win || !p) return -1;
 	/*---------------*/
-	if (result = check_flush (dpy, win,6))
+	if (result = check_flush (dpy, win,8))
 		return result;
 
-	win->command [win->command_ix++] = FBUI_PUTRGB3;
+	win->command [win->command_ix++] = FBUI_PUTRGB3 | wide_flag (win);
 	win->command [win->command_ix++] = x;
 	win->command [win->command_ix++] = y;
-	win->command [win->command_ix++] = (unsigned long) p;
-	win->command [win->command_ix++] = ((unsigned long) p) >>16;
+	put_pointer (win, p);
 	win->command [win->command_ix++] = n;
 
 	return 0;
 }
 
+int
+fbui_put_rgba (Display *dpy, Window *win, short x, short y, short n, unsigned long *p)
+{
+	int result=0;
+
+	if (!dpy || !win || !p) return -1;
+	/*---------------*/
+	if (want_inline (win, n))
+		return put_inline (dpy, win, FBUI_PUTRGBAINLINE, x, y, n, p);
+
+	if (result = check_flush (dpy, win,8))
+		return result;
+
+	win->command [win->command_ix++] = FBUI_PUTRGBA | wide_flag (win);
+	win->command [win->command_ix++] = x;
+	win->command [win->command_ix++] = y;
+	put_pointer (win, p);
+	win->command [win->command_ix++] = n;
+
+	return 0;
+}
+
+/* Puts a w by h image whose rows are stride bytes apart, in one of
+ * the FBUI_IMAGE_* formats. Like fbui_put, the image must not change
+ * before the flush. A kernel without FBUI_PUTIMAGE gets a put per row.
+ */
+int
+fbui_put_image (Display *dpy, Window *win, short x, short y, 
+	short w, short h, void *p, int stride, int format)
+{
+	static unsigned long row [LIBFBUI_INLINEMAX];
+	unsigned char *src = (unsigned char*) p;
+	int result=0;
+	short i, j, k, m;
+
+	if (!dpy || !win || !p) return -1;
+	if (w <= 0 || h <= 0) return 0;
+	if (stride < 0 || stride > 0xffff) return FBUI_ERR_BADPARAM;
+	/*---------------*/
+
+	if (win->caps & FBUI_CAP_PUTIMAGE) {
+		if (result = check_flush (dpy, win,11))
+			return result;
+
+		win->command [win->command_ix++] = FBUI_PUTIMAGE | wide_flag (win);
+		win->command [win->command_ix++] = x;
+		win->command [win->command_ix++] = y;
+		win->command [win->command_ix++] = w;
+		win->command [win->command_ix++] = h;
+		put_pointer (win, p);
+		win->command [win->command_ix++] = stride;
+		win->command [win->command_ix++] = format;
+		return 0;
+	}
+
+	for (j=0; j < h && !result; j++, src += stride) {
+		switch (format) {
+		case FBUI_IMAGE_RGB24:
+			result = fbui_put_rgb3 (dpy, win, x, y+j, w, src);
+			break;
+		case FBUI_IMAGE_XRGB32:
+			result = fbui_put_rgb (dpy, win, x, y+j, w, 
+				(unsigned long*) src);
+			break;
+		case FBUI_IMAGE_NATIVE:
+			result = fbui_put (dpy, win, x, y+j, w, src);
+			break;
+		case FBUI_IMAGE_GRAY8:
+			/* the row buffer is reused, so flush each piece */
+			for (i=0; i < w && !result; i += k) {
+				k = w - i < LIBFBUI_INLINEMAX ? w - i : LIBFBUI_INLINEMAX;
+				for (m=0; m < k; m++)
+					row [m] = src [i+m] * 0x10101;
+				result = fbui_put_rgb (dpy, win, x+i, y+j, k, row);
+				if (!result)
+					result = fbui_flush (dpy, win);
+			}
+			break;
+		default:
+			return FBUI_ERR_BADPARAM;
+		}
+	}
+	return result;
+}
+
+
+/* Maps the process's event ring, through any of its windows.
+ * The kernel says how many events it holds, so a ring bigger
+ * than a page is mapped again at its full size.
+ */
+static void
+fbui_map_events (Display *dpy, Window *win)
+{
+	struct fbui_eventring *r;
+	off_t offset;
+	int len, need;
+
+	if (!dpy || !win)
+		return;
+	/*---------------*/
+
+	offset = (off_t) (FBUI_EVENTS_PGOFF + win->id) * getpagesize ();
+	len = getpagesize ();
+	r = (struct fbui_eventring*) mmap (NULL, len, PROT_READ | PROT_WRITE,
+		MAP_SHARED, dpy->fd, offset);
+	if (r == (struct fbui_eventring*) MAP_FAILED)
+		return;
+
+	need = sizeof (struct fbui_eventring) + r->size * sizeof (struct fbui_event);
+	if (!r->size || (r->size & (r->size - 1))) {
+		munmap ((void*) r, len);
+		return;
+	}
+	if (need > len) {
+		munmap ((void*) r, len);
+		len = (need + getpagesize () - 1) & ~(getpagesize () - 1);
+		r = (struct fbui_eventring*) mmap (NULL, len, 
+			PROT_READ | PROT_WRITE, MAP_SHARED, dpy->fd, offset);
+		if (r == (struct fbui_eventring*) MAP_FAILED)
+			return;
+	}
+
+	dpy->events = r;
+	dpy->events_len = len;
+}
 
 int
 fbui_window_close (Display *dpy, Window *win)
@@ -769,6 +1193,9 @@ fbui_window_close (Display *dpy, Window *win)
 
 	r = ioctl (dpy->fd, FBIO_UI_CLOSE, win->id);
 
+	if (win->ring)
+		munmap ((void*) win->ring, sizeof (struct fbui_ring));
+
 	Window *prev = NULL;
 	Window *ptr = dpy->list;
 	while (ptr) {
@@ -784,6 +1211,12 @@ fbui_window_close (Display *dpy, Window *win)
 			prev->next = win->next;
 	}
 
+	/* The kernel drops the event ring with the last window */
+	if (!dpy->list && dpy->events) {
+		munmap ((void*) dpy->events, dpy->events_len);
+		dpy->events = NULL;
+	}
+
 	free (win);
 	return r;
 }
@@ -939,6 +1372,62 @@ fbui_convert_key (Display *dpy, long keyinfo)
 }
 
 
+static void
+fbui_convert_event (Display *dpy, Event *e, struct fbui_event *event)
+{
+	Window *win;
+
+	memset (e, 0, sizeof(Event));
+	e->type = event->type;
+	e->id = event->id;
+	e->key = event->key;
+	e->x = event->x;
+	e->y = event->y;
+	e->width = event->width;
+	e->height = event->height;
+
+	win = dpy->list;
+	while (win) {
+		if (win->id == event->id)
+			break;
+		win = win->next;
+	}
+	e->win = win;
+
+	if (!win)
+		fprintf(stderr, "libfbui: cannot identify window for id %d\n", event->id);
+	else
+	if (event->type == FBUI_EVENT_MOVE_RESIZE) {
+		win->width = event->width;
+		win->height = event->height;
+	}
+}
+
+/* Takes up to n events from the shared event ring without entering
+ * the kernel, provided it already has this mask. Returns how many.
+ */
+static int
+fbui_ring_events (Display *dpy, struct fbui_event *events, int n, 
+	unsigned short mask)
+{
+	struct fbui_eventring *r = dpy->events;
+	unsigned int tail;
+	int count = 0;
+
+	if (!r || mask != dpy->event_mask)
+		return 0;
+	/*---------------*/
+
+	tail = r->tail;
+	while (count < n && tail != r->head) {
+		ring_mb ();
+		events [count++] = r->events [tail & (r->size - 1)];
+		ring_mb ();
+		r->tail = ++tail;
+	}
+	return count;
+}
+
 int
 fbui_poll_event (Display *dpy, Event *e, unsigned short mask)
 {
@@ -958,6 +1447,11 @@ fbui_poll_event (Display *dpy, Event *e, unsigned short mask)
 	memset (e, 0, sizeof(Event));
 
 	struct fbui_event event;
+	if (fbui_ring_events (dpy, &event, 1, mask)) {
+		fbui_convert_event (dpy, e, &event);
+		return 0;
+	}
+
 	struct fbui_ctrlparams ctl;
 	memset (&ctl, 0, sizeof (struct fbui_ctrlparams));
 	ctl.op = FBUI_POLLEVENT;
@@ -965,6 +1459,7 @@ fbui_poll_event (Display *dpy, Event *e, unsigned short mask)
 	ctl.x = (short)mask;
 	ctl.event = &event;
 	retval = ioctl (dpy->fd, FBIO_UI_CONTROL, &ctl);
+	dpy->event_mask = mask;
 
 	if (retval < 0)
 		return -errno;
@@ -1013,7 +1508,13 @@ fbui_wait_event (Display *dpy, Event *e, unsigned short mask)
 
 	memset (e, 0, sizeof(Event));
 
+	/* Block in the kernel only when the ring is empty */
 	struct fbui_event event;
+	if (fbui_ring_events (dpy, &event, 1, mask)) {
+		fbui_convert_event (dpy, e, &event);
+		return 0;
+	}
+
 	struct fbui_ctrlparams ctl;
 	memset (&ctl, 0, sizeof (struct fbui_ctrlparams));
 	ctl.op = FBUI_WAITEVENT;
@@ -1021,6 +1522,7 @@ fbui_wait_event (Display *dpy, Event *e, unsigned short mask)
 	ctl.x = (short)mask;
 	ctl.event = &event;
 	int retval = ioctl (dpy->fd, FBIO_UI_CONTROL, &ctl);
+	dpy->event_mask = mask;
 
 	if (retval < 0)
 		return -errno;
@@ -1054,6 +1556,93 @@ fbui_wait_event (Display *dpy, Event *e, unsigned short mask)
 	return 0;
 }
 
+/* Sleeps for up to usec microseconds, returning early
+ * if an event arrives. Use instead of usleep + fbui_poll_event.
+ */
+int
+fbui_idle (Display *dpy, long usec)
+{
+	Window *win;
+	fd_set rfds;
+	struct timeval tv;
+
+	if (!dpy) 
+		return -1;
+	/*---------------*/
+
+	win = dpy->list;
+	while (win) {
+		fbui_flush (dpy, win);
+		win = win->next;
+	}
+
+	FD_ZERO (&rfds);
+	FD_SET (dpy->fd, &rfds);
+	tv.tv_sec = usec / 1000000;
+	tv.tv_usec = usec % 1000000;
+	return select (dpy->fd + 1, &rfds, NULL, NULL, &tv);
+}
+
+/* Fetches up to n events with one ioctl.
+ */
+static int
+fbui_get_events (Display *dpy, Event *e, int n, unsigned short mask, char op)
+{
+	Window *win;
+	struct fbui_event events [FBUI_MAXEVENTSPERBATCH];
+	struct fbui_ctrlparams ctl;
+	int i, retval;
+
+	if (!dpy || !e || n <= 0) 
+		return -1;
+	/*---------------*/
+
+	win = dpy->list;
+	while (win) {
+		fbui_flush (dpy, win);
+		win = win->next;
+	}
+
+	if (n > FBUI_MAXEVENTSPERBATCH)
+		n = FBUI_MAXEVENTSPERBATCH;
+
+	retval = fbui_ring_events (dpy, events, n, mask);
+	if (retval) {
+		for (i = 0; i < retval; i++)
+			fbui_convert_event (dpy, &e[i], &events[i]);
+		return retval;
+	}
+
+	memset (&ctl, 0, sizeof (struct fbui_ctrlparams));
+	ctl.op = op;
+	ctl.id = dpy->list ? dpy->list->id : -1;
+	ctl.x = (short)mask;
+	ctl.event = events;
+	ctl.nevents = n;
+	retval = ioctl (dpy->fd, FBIO_UI_CONTROL, &ctl);
+	dpy->event_mask = mask;
+
+	if (retval < 0)
+		return -errno;
+
+	for (i = 0; i < retval; i++)
+		fbui_convert_event (dpy, &e[i], &events[i]);
+
+	return retval;
+}
+
+int
+fbui_poll_events (Display *dpy, Event *e, int n, unsigned short mask)
+{
+	return fbui_get_events (dpy, e, n, mask, FBUI_POLLEVENTS);
+}
+
+int
+fbui_wait_events (Display *dpy, Event *e, int n, unsigned short mask)
+{
+	return fbui_get_events (dpy, e, n, mask, FBUI_WAITEVENTS);
+}
+
 int
 fbui_get_dims (Display *dpy, Window *win, short *width, short *height)
 {
@@ -1483,6 +2072,7 @@ fbui_window_open (Display *dpy,
 	long bgcolor;
 	Window *win = NULL;
 	char force_type = -1;
+	char backing_store = dpy ? dpy->backing_store : 0;
 
 	if (!dpy || !name || !width_return || !height_return || 
 	    !fgcolor_inout || !bgcolor_inout)
@@ -1564,6 +2154,11 @@ fbui_window_open (Display *dpy,
 			argv[i][0] = 0;
 		}
 		else
+                if (!strcmp(str, "-bs")) {
+			backing_store = 1;
+			*str = 0;
+		}
+		else
                 if (!strncmp(str, "-c",2)) {
                         char *s = 2 + str;
                         if (*s && isdigit(*s)) {
@@ -1600,6 +2195,7 @@ fbui_window_open (Display *dpy,
 	oi.max_height = max_height;
 	oi.bgcolor =	bgcolor;
 	oi.initially_hidden = initially_hidden;
+	oi.backing_store = backing_store;
 	*fgcolor_inout = fgcolor;
 	*bgcolor_inout = bgcolor;
 printf ("vc=%d\n",vc);
@@ -1629,6 +2225,19 @@ printf ("vc=%d\n",vc);
 	win->next = dpy->list;
 	dpy->list = win;
 
+	/* Without a ring, fbui_flush falls back to FBIO_UI_EXEC */
+	win->ring = (struct fbui_ring*) mmap (NULL, sizeof (struct fbui_ring),
+		PROT_READ | PROT_WRITE, MAP_SHARED, dpy->fd, 
+		(off_t) (FBUI_RING_PGOFF + win->id) * getpagesize ());
+	if (win->ring == (struct fbui_ring*) MAP_FAILED)
+		win->ring = NULL;
+
+	/* Events are read through the kernel if this fails */
+	if (!dpy->events)
+		fbui_map_events (dpy, win);
+
+	win->caps = fbui_get_caps (dpy, win);
+
 	short w,h;
 
 	while (fbui_get_dims (dpy, win, &w, &h)) {
@@ -2423,6 +3032,8 @@ char *fbui_error_name (int value)
 	case FBUI_ERR_DRAWING: s = "busy drawing"; break;
 	case FBUI_ERR_MISSINGPROCENT: s = "missing process entry"; break;
 	case FBUI_ERR_BADVC: s = "bad virtual console number"; break;
+	case FBUI_ERR_NORING: s = "no command ring"; break;
+	case FBUI_ERR_NOTFLIPPING: s = "window is not double buffered"; break;
 	}
 	return s;
 }
@@ -37,6 +37,12 @@ enum { true=1, false=0 };
 
 #define LIBFBUI_COMMANDBUFLEN (4096)
 
+/* Pixels per inline put command, and the longest put that
+ * goes inline when a pointer would do.
+ */
+#define LIBFBUI_INLINEMAX (256)
+#define LIBFBUI_INLINESMALL (32)
+
 
 
 typedef struct win {
@@ -45,6 +51,9 @@ typedef struct win {
 	unsigned short command [LIBFBUI_COMMANDBUFLEN + 1];
 	unsigned short command_ix;
 
+	struct fbui_ring *ring;	/* shared command ring, or NULL */
+	int caps;		/* from fbui_get_caps */
+
 	int width, height;
 
 	struct win *next;
@@ -61,6 +70,15 @@ typedef struct {
 	/* needed for creating native-format pixmaps */
 	short red_offset, green_offset, blue_offset;
 	short red_length, green_length, blue_length;
+
+	/* if set, new windows ask the kernel for a backing store */
+	char backing_store;
+
+	/* shared event ring, or NULL, and the event mask last
+	 * given to the kernel, which events from the ring are for */
+	struct fbui_eventring *events;
+	int events_len;
+	unsigned short event_mask;
 } Display;
 
 typedef struct {
@@ -75,6 +93,9 @@ typedef struct {
 
 extern int fbui_poll_event (Display *dpy, Event *, unsigned short mask); /* returns <0 when error */
 extern int fbui_wait_event (Display *dpy, Event *, unsigned short mask); /* returns <0 when error */
+extern int fbui_poll_events (Display *dpy, Event *, int n, unsigned short mask); /* returns #events, <0 when error */
+extern int fbui_wait_events (Display *dpy, Event *, int n, unsigned short mask); /* returns #events, <0 when error */
+extern int fbui_idle (Display *dpy, long usec); /* returns >0 when event pending */
 
 extern int fbui_read_mouse (Display *dpy, Window*, short*,short*);
 
@@ -92,6 +113,7 @@ extern long fbui_cut_length (Display*,Window *wm);
 
 extern int fbui_hide(Display*,Window *wm,short id);
 extern int fbui_unhide(Display*,Window *wm,short id);
+extern int fbui_raise(Display*,Window *wm,short id);
 extern int fbui_delete(Display*,Window *wm,short id);
 extern int fbui_redraw(Display*,Window *wm,short id);
 extern int fbui_move_resize(Display*,Window *wm,short id,short,short,short,short);
@@ -110,6 +132,13 @@ extern int fbui_draw_hline (Display*,Window*, short x0, short x1, short y,unsign
 
 extern int fbui_set_subtitle (Display*,Window*, char *);
 
+extern int fbui_double_buffer (Display*,Window*, int yes);
+extern int fbui_present (Display*,Window*);
+extern int fbui_get_caps (Display*,Window*);
+extern int fbui_load_cursor (Display*,Window*, short w, short h,
+	short hot_x, short hot_y, unsigned long *pixels);
+extern int fbui_set_cursor (Display*,Window*, int handle);
+
 extern int
 fbui_tinyblit (Display *dpy, Window *win, short x, short y,
                 unsigned long color,
@@ -117,6 +146,13 @@ fbui_tinyblit (Display *dpy, Window *win, short x, short y,
                 short width,
                 unsigned long bits);
 
+extern int
+fbui_bitblit (Display *dpy, Window *win, short x, short y,
+                short width, short height,
+                unsigned char *bits,
+                unsigned long color,
+                unsigned long bgcolor);
+
 extern int fbui_draw_line (Display*,Window*, short x0, short y0, short x1, short y1,unsigned long);
 extern int fbui_invert_line (Display*,Window*, short x0, short y0, short x1, short y1);
 extern int fbui_draw_string (Display*,Window*, struct fbui_font*,short, short, char *,unsigned long);
@@ -124,11 +160,14 @@ extern int fbui_set_font (Display *dpy, Window *win, struct fbui_font *font);
 extern int fbui_clear (Display *, Window*);
 extern int fbui_draw_rect (Display*,Window*, short x0, short y0, short x1, short y1,unsigned long);
 extern int fbui_fill_area (Display*,Window*, short x0, short y0, short x1, short y1,unsigned long);
+extern int fbui_blend_area (Display*,Window*, short x0, short y0, short x1, short y1,unsigned long);
 extern int fbui_clear_area (Display*,Window*, short x0, short y0, short x1, short y1);
 extern int fbui_copy_area (Display*,Window*, short xsrc, short ysrc, short xdest, short ydest, short w, short h);
 extern int fbui_put (Display*,Window*, short x, short y, short n, unsigned char *p);
 extern int fbui_put_rgb (Display*,Window*, short x, short y, short n, unsigned long *p);
 extern int fbui_put_rgb3 (Display*,Window*, short x, short y, short n, unsigned char *p);
+extern int fbui_put_rgba (Display*,Window*, short x, short y, short n, unsigned long *p);
+extern int fbui_put_image (Display*,Window*, short x, short y, short w, short h, void *p, int stride, int format);
 
 extern Display *fbui_display_open ();
 extern void fbui_display_close (Display *);